@@ -0,0 +1,698 @@
+/*
+===========================================================================
+Copyright (C) 1997-2006 Id Software, Inc.
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+===========================================================================
+*/
+
+#include "cmdlib.h"
+#include "mathlib.h"
+#include "bitlib.h"
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define BITLIB_X86
+
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define TARGET(x) // msvc lets any function use any instruction set
+#else
+#define TARGET(x) __attribute__((target(x)))
+#endif
+#endif
+
+/*
+===============================================================================
+
+plain c, 8 bytes at a time
+
+===============================================================================
+*/
+
+static qboolean AndBits_c(byte *dest, const byte *a, const byte *b, const byte *seen, int32_t bytes) {
+    uint64_t more;
+    int32_t i;
+
+    more = 0;
+    for (i = 0; i < bytes / 8; i++) {
+        ((uint64_t *)dest)[i] = ((const uint64_t *)a)[i] & ((const uint64_t *)b)[i];
+        more |= ((uint64_t *)dest)[i] & ~((const uint64_t *)seen)[i];
+    }
+
+    return more != 0;
+}
+
+static void OrBits_c(byte *dest, const byte *src, int32_t bytes) {
+    int32_t i;
+
+    for (i = 0; i < bytes / 8; i++)
+        ((uint64_t *)dest)[i] |= ((const uint64_t *)src)[i];
+}
+
+static int32_t PopCount_c(uint64_t v) {
+    v = v - ((v >> 1) & 0x5555555555555555ull);
+    v = (v & 0x3333333333333333ull) + ((v >> 2) & 0x3333333333333333ull);
+    v = (v + (v >> 4)) & 0x0f0f0f0f0f0f0f0full;
+    return (int32_t)((v * 0x0101010101010101ull) >> 56);
+}
+
+// only the first numbits count, whatever is in the bits after them
+static int32_t CountBits_c(const byte *bits, int32_t numbits) {
+    int32_t i, c;
+
+    c = 0;
+    for (i = 0; i < numbits >> 6; i++)
+        c += PopCount_c(((const uint64_t *)bits)[i]);
+    for (i <<= 6; i < numbits; i++)
+        if (bits[i >> 3] & (1 << (i & 7)))
+            c++;
+
+    return c;
+}
+
+#ifdef BITLIB_X86
+
+/*
+===============================================================================
+
+sse2, 16 bytes at a time
+
+===============================================================================
+*/
+
+TARGET("sse2")
+static qboolean AndBits_sse2(byte *dest, const byte *a, const byte *b, const byte *seen, int32_t bytes) {
+    __m128i d, more;
+    int32_t i;
+
+    more = _mm_setzero_si128();
+    for (i = 0; i + 16 <= bytes; i += 16) {
+        d = _mm_and_si128(_mm_loadu_si128((const __m128i *)(a + i)), _mm_loadu_si128((const __m128i *)(b + i)));
+        _mm_storeu_si128((__m128i *)(dest + i), d);
+        more = _mm_or_si128(more, _mm_andnot_si128(_mm_loadu_si128((const __m128i *)(seen + i)), d));
+    }
+
+    // the tail is done either way, dest has to be whole
+    return AndBits_c(dest + i, a + i, b + i, seen + i, bytes - i) | (_mm_movemask_epi8(_mm_cmpeq_epi8(more, _mm_setzero_si128())) != 0xffff);
+}
+
+TARGET("sse2")
+static void OrBits_sse2(byte *dest, const byte *src, int32_t bytes) {
+    int32_t i;
+
+    for (i = 0; i + 16 <= bytes; i += 16)
+        _mm_storeu_si128((__m128i *)(dest + i),
+                         _mm_or_si128(_mm_loadu_si128((const __m128i *)(dest + i)), _mm_loadu_si128((const __m128i *)(src + i))));
+    OrBits_c(dest + i, src + i, bytes - i);
+}
+
+TARGET("popcnt")
+static int32_t CountBits_popcnt(const byte *bits, int32_t numbits) {
+    int32_t i, c;
+
+    c = 0;
+    for (i = 0; i < numbits >> 6; i++)
+        c += (int32_t)_mm_popcnt_u64(((const uint64_t *)bits)[i]);
+    for (i <<= 6; i < numbits; i++)
+        if (bits[i >> 3] & (1 << (i & 7)))
+            c++;
+
+    return c;
+}
+
+/*
+===============================================================================
+
+avx2, 32 bytes at a time
+
+===============================================================================
+*/
+
+TARGET("avx2")
+static qboolean AndBits_avx2(byte *dest, const byte *a, const byte *b, const byte *seen, int32_t bytes) {
+    __m256i d, more;
+    int32_t i;
+
+    more = _mm256_setzero_si256();
+    for (i = 0; i + 32 <= bytes; i += 32) {
+        d = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)(a + i)), _mm256_loadu_si256((const __m256i *)(b + i)));
+        _mm256_storeu_si256((__m256i *)(dest + i), d);
+        more = _mm256_or_si256(more, _mm256_andnot_si256(_mm256_loadu_si256((const __m256i *)(seen + i)), d));
+    }
+
+    // the tail is done either way, dest has to be whole
+    return AndBits_c(dest + i, a + i, b + i, seen + i, bytes - i) | (!_mm256_testz_si256(more, more));
+}
+
+TARGET("avx2")
+static void OrBits_avx2(byte *dest, const byte *src, int32_t bytes) {
+    int32_t i;
+
+    for (i = 0; i + 32 <= bytes; i += 32)
+        _mm256_storeu_si256((__m256i *)(dest + i),
+                            _mm256_or_si256(_mm256_loadu_si256((const __m256i *)(dest + i)), _mm256_loadu_si256((const __m256i *)(src + i))));
+    OrBits_c(dest + i, src + i, bytes - i);
+}
+
+/*
+===============================================================================
+
+avx512, 64 bytes at a time
+
+===============================================================================
+*/
+
+TARGET("avx512f")
+static qboolean AndBits_avx512(byte *dest, const byte *a, const byte *b, const byte *seen, int32_t bytes) {
+    __m512i d, more;
+    int32_t i;
+
+    more = _mm512_setzero_si512();
+    for (i = 0; i + 64 <= bytes; i += 64) {
+        d = _mm512_and_si512(_mm512_loadu_si512(a + i), _mm512_loadu_si512(b + i));
+        _mm512_storeu_si512(dest + i, d);
+        more = _mm512_or_si512(more, _mm512_andnot_si512(_mm512_loadu_si512(seen + i), d));
+    }
+
+    // the tail is done either way, dest has to be whole
+    return AndBits_c(dest + i, a + i, b + i, seen + i, bytes - i) | (_mm512_test_epi64_mask(more, more) != 0);
+}
+
+TARGET("avx512f")
+static void OrBits_avx512(byte *dest, const byte *src, int32_t bytes) {
+    int32_t i;
+
+    for (i = 0; i + 64 <= bytes; i += 64)
+        _mm512_storeu_si512(dest + i, _mm512_or_si512(_mm512_loadu_si512(dest + i), _mm512_loadu_si512(src + i)));
+    OrBits_c(dest + i, src + i, bytes - i);
+}
+
+#endif // BITLIB_X86
+
+/*
+===============================================================================
+
+separating planes
+
+EdgeSeparators is the inner loop of NextSeperator in flow.c, for one
+source edge against every point of pass.  The sse2 and avx2 versions
+try 4 or 8 pass points at once and give the same planes in the same
+order as the plain c: the float math is done in the same order, the
+1 / sqrt is done in double, and the epsilon tests are against the
+floats that split the same way the double epsilon does.
+
+===============================================================================
+*/
+
+/*
+=============
+SoAWinding
+=============
+*/
+void SoAWinding(const vec3_t *points, int32_t numpoints, soawinding_t *out) {
+    int32_t i;
+
+    out->numpoints = numpoints;
+    for (i = 0; i < numpoints; i++) {
+        out->x[i] = (float)points[i][0];
+        out->y[i] = (float)points[i][1];
+        out->z[i] = (float)points[i][2];
+    }
+    for (; i & 15; i++)
+        out->x[i] = out->y[i] = out->z[i] = 0;
+}
+
+static int32_t EdgeSeparators_c(const soawinding_t *source, const soawinding_t *pass, int32_t i, double epsilon,
+                                qboolean flipclip, vec_t (*planes)[4]) {
+    int32_t j, k, l, n;
+    vec3_t v1, v2, normal;
+    vec_t length, dist;
+    float d;
+    qboolean fliptest, front;
+
+    n     = 0;
+    l     = (i + 1) % source->numpoints;
+    v1[0] = (vec_t)(source->x[l] - source->x[i]);
+    v1[1] = (vec_t)(source->y[l] - source->y[i]);
+    v1[2] = (vec_t)(source->z[l] - source->z[i]);
+
+    for (j = 0; j < pass->numpoints; j++) {
+        v2[0]     = (vec_t)(pass->x[j] - source->x[i]);
+        v2[1]     = (vec_t)(pass->y[j] - source->y[i]);
+        v2[2]     = (vec_t)(pass->z[j] - source->z[i]);
+
+        normal[0] = v1[1] * v2[2] - v1[2] * v2[1];
+        normal[1] = v1[2] * v2[0] - v1[0] * v2[2];
+        normal[2] = v1[0] * v2[1] - v1[1] * v2[0];
+
+        length    = normal[0] * normal[0] + normal[1] * normal[1] + normal[2] * normal[2];
+        if (length < epsilon)
+            continue;
+
+        length = 1 / sqrt(length);
+        normal[0] *= length;
+        normal[1] *= length;
+        normal[2] *= length;
+        dist = (vec_t)pass->x[j] * normal[0] + (vec_t)pass->y[j] * normal[1] + (vec_t)pass->z[j] * normal[2];
+
+        // the first point of source off the plane tells which side it's on
+        fliptest = false;
+        for (k = 0; k < source->numpoints; k++) {
+            if (k == i || k == l)
+                continue;
+            d = (vec_t)source->x[k] * normal[0] + (vec_t)source->y[k] * normal[1] + (vec_t)source->z[k] * normal[2] - dist;
+            if (d < -epsilon) {
+                fliptest = false;
+                break;
+            } else if (d > epsilon) {
+                fliptest = true;
+                break;
+            }
+        }
+        if (k == source->numpoints)
+            continue; // planar with source portal
+
+        if (fliptest) {
+            normal[0] = 0 - normal[0];
+            normal[1] = 0 - normal[1];
+            normal[2] = 0 - normal[2];
+            dist      = -dist;
+        }
+
+        // all of pass on the front, at least one point off the plane
+        front = false;
+        for (k = 0; k < pass->numpoints; k++) {
+            if (k == j)
+                continue;
+            d = (vec_t)pass->x[k] * normal[0] + (vec_t)pass->y[k] * normal[1] + (vec_t)pass->z[k] * normal[2] - dist;
+            if (d < -epsilon)
+                break;
+            else if (d > epsilon)
+                front = true;
+        }
+        if (k != pass->numpoints || !front)
+            continue;
+
+        if (flipclip) {
+            normal[0] = 0 - normal[0];
+            normal[1] = 0 - normal[1];
+            normal[2] = 0 - normal[2];
+            dist      = -dist;
+        }
+
+        planes[n][0] = normal[0];
+        planes[n][1] = normal[1];
+        planes[n][2] = normal[2];
+        planes[n][3] = dist;
+        n++;
+    }
+
+    return n;
+}
+
+#ifdef BITLIB_X86
+
+// a float f beats epsilon (f > epsilon in double) just when it beats
+// this one
+static float FloatBelow(double epsilon) {
+    float f;
+
+    f = (float)epsilon;
+    if ((double)f > epsilon)
+        f = nextafterf(f, -HUGE_VALF);
+    return f;
+}
+
+// and f < epsilon just when f < this one
+static float FloatAbove(double epsilon) {
+    float f;
+
+    f = (float)epsilon;
+    if ((double)f < epsilon)
+        f = nextafterf(f, HUGE_VALF);
+    return f;
+}
+
+TARGET("sse2")
+static int32_t EdgeSeparators_sse2(const soawinding_t *source, const soawinding_t *pass, int32_t i, double epsilon,
+                                   qboolean flipclip, vec_t (*planes)[4]) {
+    int32_t j, k, l, n, lane, ok;
+    __m128 v1x, v1y, v1z, six, siy, siz, px, py, pz, v2x, v2y, v2z, nx, ny, nz, len, dist, d, inv;
+    __m128 front, back, minlen, zero, sign, fv, bv, live, undecided, flip, good, anyfront, self;
+    __m128i lanes;
+    __m128d one;
+    float out[4][4];
+
+    n      = 0;
+    l      = (i + 1) % source->numpoints;
+    v1x    = _mm_set1_ps(source->x[l] - source->x[i]);
+    v1y    = _mm_set1_ps(source->y[l] - source->y[i]);
+    v1z    = _mm_set1_ps(source->z[l] - source->z[i]);
+    six    = _mm_set1_ps(source->x[i]);
+    siy    = _mm_set1_ps(source->y[i]);
+    siz    = _mm_set1_ps(source->z[i]);
+    front  = _mm_set1_ps(FloatBelow(epsilon));
+    back   = _mm_set1_ps(-FloatBelow(epsilon));
+    minlen = _mm_set1_ps(FloatAbove(epsilon));
+    zero   = _mm_setzero_ps();
+    sign   = _mm_set1_ps(-0.0f);
+    one    = _mm_set1_pd(1);
+    lanes  = _mm_setr_epi32(0, 1, 2, 3);
+
+    for (j = 0; j < pass->numpoints; j += 4) {
+        live = _mm_castsi128_ps(_mm_cmplt_epi32(lanes, _mm_set1_epi32(pass->numpoints - j)));
+        px   = _mm_loadu_ps(pass->x + j);
+        py   = _mm_loadu_ps(pass->y + j);
+        pz   = _mm_loadu_ps(pass->z + j);
+        v2x  = _mm_sub_ps(px, six);
+        v2y  = _mm_sub_ps(py, siy);
+        v2z  = _mm_sub_ps(pz, siz);
+        nx   = _mm_sub_ps(_mm_mul_ps(v1y, v2z), _mm_mul_ps(v1z, v2y));
+        ny   = _mm_sub_ps(_mm_mul_ps(v1z, v2x), _mm_mul_ps(v1x, v2z));
+        nz   = _mm_sub_ps(_mm_mul_ps(v1x, v2y), _mm_mul_ps(v1y, v2x));
+
+        len  = _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, nx), _mm_mul_ps(ny, ny)), _mm_mul_ps(nz, nz));
+        undecided = _mm_and_ps(live, _mm_cmpnlt_ps(len, minlen));
+        if (!_mm_movemask_ps(undecided))
+            continue;
+
+        inv  = _mm_movelh_ps(_mm_cvtpd_ps(_mm_div_pd(one, _mm_sqrt_pd(_mm_cvtps_pd(len)))),
+                             _mm_cvtpd_ps(_mm_div_pd(one, _mm_sqrt_pd(_mm_cvtps_pd(_mm_movehl_ps(len, len))))));
+        nx   = _mm_mul_ps(nx, inv);
+        ny   = _mm_mul_ps(ny, inv);
+        nz   = _mm_mul_ps(nz, inv);
+        dist = _mm_add_ps(_mm_add_ps(_mm_mul_ps(px, nx), _mm_mul_ps(py, ny)), _mm_mul_ps(pz, nz));
+
+        // which side of each plane source is on
+        flip = zero;
+        good = undecided;
+        for (k = 0; k < source->numpoints; k++) {
+            if (k == i || k == l)
+                continue;
+            d         = _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(source->x[k]), nx),
+                                                         _mm_mul_ps(_mm_set1_ps(source->y[k]), ny)),
+                                              _mm_mul_ps(_mm_set1_ps(source->z[k]), nz)),
+                                   dist);
+            fv        = _mm_cmpgt_ps(d, front);
+            bv        = _mm_cmplt_ps(d, back);
+            flip      = _mm_or_ps(flip, _mm_and_ps(fv, undecided));
+            undecided = _mm_andnot_ps(_mm_or_ps(fv, bv), undecided);
+            if (!_mm_movemask_ps(undecided))
+                break;
+        }
+        good = _mm_andnot_ps(undecided, good);
+        if (!_mm_movemask_ps(good))
+            continue; // planar with source portal
+
+        nx   = _mm_or_ps(_mm_and_ps(flip, _mm_sub_ps(zero, nx)), _mm_andnot_ps(flip, nx));
+        ny   = _mm_or_ps(_mm_and_ps(flip, _mm_sub_ps(zero, ny)), _mm_andnot_ps(flip, ny));
+        nz   = _mm_or_ps(_mm_and_ps(flip, _mm_sub_ps(zero, nz)), _mm_andnot_ps(flip, nz));
+        dist = _mm_xor_ps(dist, _mm_and_ps(flip, sign));
+
+        // all of pass on the front
+        anyfront = zero;
+        for (k = 0; k < pass->numpoints; k++) {
+            self     = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_add_epi32(lanes, _mm_set1_epi32(j)), _mm_set1_epi32(k)));
+            d        = _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(pass->x[k]), nx),
+                                                        _mm_mul_ps(_mm_set1_ps(pass->y[k]), ny)),
+                                             _mm_mul_ps(_mm_set1_ps(pass->z[k]), nz)),
+                                  dist);
+            good     = _mm_andnot_ps(_mm_andnot_ps(self, _mm_cmplt_ps(d, back)), good);
+            anyfront = _mm_or_ps(anyfront, _mm_andnot_ps(self, _mm_cmpgt_ps(d, front)));
+            if (!_mm_movemask_ps(good))
+                break;
+        }
+        ok = _mm_movemask_ps(_mm_and_ps(good, anyfront));
+        if (!ok)
+            continue;
+
+        if (flipclip) {
+            nx   = _mm_sub_ps(zero, nx);
+            ny   = _mm_sub_ps(zero, ny);
+            nz   = _mm_sub_ps(zero, nz);
+            dist = _mm_xor_ps(dist, sign);
+        }
+
+        _mm_storeu_ps(out[0], nx);
+        _mm_storeu_ps(out[1], ny);
+        _mm_storeu_ps(out[2], nz);
+        _mm_storeu_ps(out[3], dist);
+        for (lane = 0; lane < 4; lane++) {
+            if (ok & (1 << lane)) {
+                planes[n][0] = out[0][lane];
+                planes[n][1] = out[1][lane];
+                planes[n][2] = out[2][lane];
+                planes[n][3] = out[3][lane];
+                n++;
+            }
+        }
+    }
+
+    return n;
+}
+
+TARGET("avx2")
+static int32_t EdgeSeparators_avx2(const soawinding_t *source, const soawinding_t *pass, int32_t i, double epsilon,
+                                   qboolean flipclip, vec_t (*planes)[4]) {
+    int32_t j, k, l, n, lane, ok;
+    __m256 v1x, v1y, v1z, six, siy, siz, px, py, pz, v2x, v2y, v2z, nx, ny, nz, len, dist, d, inv;
+    __m256 front, back, minlen, zero, sign, fv, bv, live, undecided, flip, good, anyfront, self;
+    __m256i lanes;
+    __m256d one;
+    __m128 lo, hi;
+    float out[4][8];
+
+    n      = 0;
+    l      = (i + 1) % source->numpoints;
+    v1x    = _mm256_set1_ps(source->x[l] - source->x[i]);
+    v1y    = _mm256_set1_ps(source->y[l] - source->y[i]);
+    v1z    = _mm256_set1_ps(source->z[l] - source->z[i]);
+    six    = _mm256_set1_ps(source->x[i]);
+    siy    = _mm256_set1_ps(source->y[i]);
+    siz    = _mm256_set1_ps(source->z[i]);
+    front  = _mm256_set1_ps(FloatBelow(epsilon));
+    back   = _mm256_set1_ps(-FloatBelow(epsilon));
+    minlen = _mm256_set1_ps(FloatAbove(epsilon));
+    zero   = _mm256_setzero_ps();
+    sign   = _mm256_set1_ps(-0.0f);
+    one    = _mm256_set1_pd(1);
+    lanes  = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+
+    for (j = 0; j < pass->numpoints; j += 8) {
+        live = _mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_set1_epi32(pass->numpoints - j), lanes));
+        px   = _mm256_loadu_ps(pass->x + j);
+        py   = _mm256_loadu_ps(pass->y + j);
+        pz   = _mm256_loadu_ps(pass->z + j);
+        v2x  = _mm256_sub_ps(px, six);
+        v2y  = _mm256_sub_ps(py, siy);
+        v2z  = _mm256_sub_ps(pz, siz);
+        nx   = _mm256_sub_ps(_mm256_mul_ps(v1y, v2z), _mm256_mul_ps(v1z, v2y));
+        ny   = _mm256_sub_ps(_mm256_mul_ps(v1z, v2x), _mm256_mul_ps(v1x, v2z));
+        nz   = _mm256_sub_ps(_mm256_mul_ps(v1x, v2y), _mm256_mul_ps(v1y, v2x));
+
+        len  = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(nx, nx), _mm256_mul_ps(ny, ny)), _mm256_mul_ps(nz, nz));
+        undecided = _mm256_and_ps(live, _mm256_cmp_ps(len, minlen, _CMP_NLT_UQ));
+        if (!_mm256_movemask_ps(undecided))
+            continue;
+
+        lo   = _mm256_cvtpd_ps(_mm256_div_pd(one, _mm256_sqrt_pd(_mm256_cvtps_pd(_mm256_castps256_ps128(len)))));
+        hi   = _mm256_cvtpd_ps(_mm256_div_pd(one, _mm256_sqrt_pd(_mm256_cvtps_pd(_mm256_extractf128_ps(len, 1)))));
+        inv  = _mm256_insertf128_ps(_mm256_castps128_ps256(lo), hi, 1);
+        nx   = _mm256_mul_ps(nx, inv);
+        ny   = _mm256_mul_ps(ny, inv);
+        nz   = _mm256_mul_ps(nz, inv);
+        dist = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(px, nx), _mm256_mul_ps(py, ny)), _mm256_mul_ps(pz, nz));
+
+        // which side of each plane source is on
+        flip = zero;
+        good = undecided;
+        for (k = 0; k < source->numpoints; k++) {
+            if (k == i || k == l)
+                continue;
+            d         = _mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(source->x[k]), nx),
+                                                         _mm256_mul_ps(_mm256_set1_ps(source->y[k]), ny)),
+                                              _mm256_mul_ps(_mm256_set1_ps(source->z[k]), nz)),
+                                   dist);
+            fv        = _mm256_cmp_ps(d, front, _CMP_GT_OQ);
+            bv        = _mm256_cmp_ps(d, back, _CMP_LT_OQ);
+            flip      = _mm256_or_ps(flip, _mm256_and_ps(fv, undecided));
+            undecided = _mm256_andnot_ps(_mm256_or_ps(fv, bv), undecided);
+            if (!_mm256_movemask_ps(undecided))
+                break;
+        }
+        good = _mm256_andnot_ps(undecided, good);
+        if (!_mm256_movemask_ps(good))
+            continue; // planar with source portal
+
+        nx   = _mm256_or_ps(_mm256_and_ps(flip, _mm256_sub_ps(zero, nx)), _mm256_andnot_ps(flip, nx));
+        ny   = _mm256_or_ps(_mm256_and_ps(flip, _mm256_sub_ps(zero, ny)), _mm256_andnot_ps(flip, ny));
+        nz   = _mm256_or_ps(_mm256_and_ps(flip, _mm256_sub_ps(zero, nz)), _mm256_andnot_ps(flip, nz));
+        dist = _mm256_xor_ps(dist, _mm256_and_ps(flip, sign));
+
+        // all of pass on the front
+        anyfront = zero;
+        for (k = 0; k < pass->numpoints; k++) {
+            self     = _mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_add_epi32(lanes, _mm256_set1_epi32(j)), _mm256_set1_epi32(k)));
+            d        = _mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(pass->x[k]), nx),
+                                                        _mm256_mul_ps(_mm256_set1_ps(pass->y[k]), ny)),
+                                             _mm256_mul_ps(_mm256_set1_ps(pass->z[k]), nz)),
+                                  dist);
+            good     = _mm256_andnot_ps(_mm256_andnot_ps(self, _mm256_cmp_ps(d, back, _CMP_LT_OQ)), good);
+            anyfront = _mm256_or_ps(anyfront, _mm256_andnot_ps(self, _mm256_cmp_ps(d, front, _CMP_GT_OQ)));
+            if (!_mm256_movemask_ps(good))
+                break;
+        }
+        ok = _mm256_movemask_ps(_mm256_and_ps(good, anyfront));
+        if (!ok)
+            continue;
+
+        if (flipclip) {
+            nx   = _mm256_sub_ps(zero, nx);
+            ny   = _mm256_sub_ps(zero, ny);
+            nz   = _mm256_sub_ps(zero, nz);
+            dist = _mm256_xor_ps(dist, sign);
+        }
+
+        _mm256_storeu_ps(out[0], nx);
+        _mm256_storeu_ps(out[1], ny);
+        _mm256_storeu_ps(out[2], nz);
+        _mm256_storeu_ps(out[3], dist);
+        for (lane = 0; lane < 8; lane++) {
+            if (ok & (1 << lane)) {
+                planes[n][0] = out[0][lane];
+                planes[n][1] = out[1][lane];
+                planes[n][2] = out[2][lane];
+                planes[n][3] = out[3][lane];
+                n++;
+            }
+        }
+    }
+
+    return n;
+}
+
+#endif // BITLIB_X86
+
+/*
+===============================================================================
+
+dispatch
+
+===============================================================================
+*/
+
+enum { BK_C,
+       BK_SSE2,
+       BK_AVX2,
+       BK_AVX512,
+       NUM_BITKERNELS };
+
+static bitkernel_t bitkernels[NUM_BITKERNELS] = {
+    {"c", AndBits_c, OrBits_c, CountBits_c, EdgeSeparators_c},
+#ifdef BITLIB_X86
+    {"sse2", AndBits_sse2, OrBits_sse2, CountBits_c, EdgeSeparators_sse2},
+    {"avx2", AndBits_avx2, OrBits_avx2, CountBits_c, EdgeSeparators_avx2},
+    // a pass portal seldom has more than 8 points, and avx512f would
+    // let the compiler fuse the multiplies and adds
+    {"avx512", AndBits_avx512, OrBits_avx512, CountBits_c, EdgeSeparators_avx2},
+#endif
+};
+
+bitkernel_t *bitkernel = &bitkernels[BK_C];
+
+static int32_t numsupported = -1;
+static bitkernel_t *supported[NUM_BITKERNELS];
+
+#ifdef BITLIB_X86
+static qboolean cpu_sse2, cpu_popcnt, cpu_avx2, cpu_avx512;
+
+static void CheckCPU(void) {
+#ifdef _MSC_VER
+    int info[4];
+    uint64_t xcr0 = 0;
+
+    __cpuid(info, 1);
+    cpu_sse2   = (info[3] >> 26) & 1;
+    cpu_popcnt = (info[2] >> 23) & 1;
+    if ((info[2] >> 27) & 1) // the os saves the avx registers
+        xcr0 = _xgetbv(0);
+
+    __cpuidex(info, 7, 0);
+    cpu_avx2   = ((info[1] >> 5) & 1) && (xcr0 & 0x06) == 0x06;
+    cpu_avx512 = ((info[1] >> 16) & 1) && (xcr0 & 0xe6) == 0xe6;
+#else
+    __builtin_cpu_init();
+    cpu_sse2   = __builtin_cpu_supports("sse2");
+    cpu_popcnt = __builtin_cpu_supports("popcnt");
+    cpu_avx2   = __builtin_cpu_supports("avx2");
+    cpu_avx512 = __builtin_cpu_supports("avx512f");
+#endif
+}
+#endif
+
+/*
+=============
+SupportedBitKernels
+=============
+*/
+int32_t SupportedBitKernels(bitkernel_t **list) {
+    int32_t i;
+
+    if (numsupported < 0) {
+        numsupported              = 0;
+        supported[numsupported++] = &bitkernels[BK_C];
+#ifdef BITLIB_X86
+        CheckCPU();
+        if (cpu_popcnt)
+            for (i = BK_SSE2; i < NUM_BITKERNELS; i++)
+                bitkernels[i].countbits = CountBits_popcnt;
+        if (cpu_sse2)
+            supported[numsupported++] = &bitkernels[BK_SSE2];
+        if (cpu_avx2)
+            supported[numsupported++] = &bitkernels[BK_AVX2];
+        if (cpu_avx512)
+            supported[numsupported++] = &bitkernels[BK_AVX512];
+#endif
+    }
+
+    for (i = 0; i < numsupported; i++)
+        list[i] = supported[i];
+    return numsupported;
+}
+
+/*
+=============
+SelectBitKernel
+=============
+*/
+void SelectBitKernel(const char *name) {
+    bitkernel_t *list[NUM_BITKERNELS];
+    int32_t i, count;
+
+    count = SupportedBitKernels(list);
+    if (!name) {
+        bitkernel = list[count - 1];
+        return;
+    }
+
+    for (i = 0; i < count; i++) {
+        if (!Q_strcasecmp((char *)list[i]->name, (char *)name)) {
+            bitkernel = list[i];
+            return;
+        }
+    }
+    Error("bit kernel %s isn't supported on this cpu", name);
+}
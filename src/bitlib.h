@@ -0,0 +1,65 @@
+/*
+===========================================================================
+Copyright (C) 1997-2006 Id Software, Inc.
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+===========================================================================
+*/
+
+// bitlib.h -- and, or and count over the vis bit strings, and the
+// separating plane search of the vis flow
+
+// the strings are a multiple of 8 bytes long.  SelectBitKernel picks
+// avx512, avx2 or sse2 code for the cpu we're on, plain c if there is
+// none of them, and the macros below go through it.
+
+#define MAX_SOA_POINTS 64 // MAX_POINTS_ON_WINDING
+
+// a winding with x, y and z in their own arrays, the tail past
+// numpoints is zeroed out to a multiple of 16.  float whatever vec_t
+// is, the sse2 and avx2 kernels load them as packed floats
+typedef struct
+{
+    int32_t numpoints;
+    float x[MAX_SOA_POINTS];
+    float y[MAX_SOA_POINTS];
+    float z[MAX_SOA_POINTS];
+} soawinding_t;
+
+typedef struct
+{
+    const char *name;
+    // dest = a & b, true if that has a bit that isn't in seen
+    qboolean (*andbits)(byte *dest, const byte *a, const byte *b, const byte *seen, int32_t bytes);
+    void (*orbits)(byte *dest, const byte *src, int32_t bytes); // dest |= src
+    int32_t (*countbits)(const byte *bits, int32_t numbits);
+    // the separating planes through source edge i and each point of
+    // pass in turn, as normal and dist, returns how many
+    int32_t (*edgeseparators)(const soawinding_t *source, const soawinding_t *pass, int32_t i, double epsilon,
+                              qboolean flipclip, vec_t (*planes)[4]);
+} bitkernel_t;
+
+extern bitkernel_t *bitkernel;
+
+#define AndBits(dest, a, b, seen, bytes) bitkernel->andbits(dest, a, b, seen, bytes)
+#define OrBits(dest, src, bytes)         bitkernel->orbits(dest, src, bytes)
+#define CountBits(bits, numbits)         bitkernel->countbits(bits, numbits)
+#define EdgeSeparators(source, pass, i, epsilon, flipclip, planes) \
+    bitkernel->edgeseparators(source, pass, i, epsilon, flipclip, planes)
+
+void SoAWinding(const vec3_t *points, int32_t numpoints, soawinding_t *out);
+
+void SelectBitKernel(const char *name); // NULL for the best one the cpu has
+int32_t SupportedBitKernels(bitkernel_t **list); // plain c first, best last
@@ -74,24 +74,25 @@ CreateBrushWindings
 */
 void CreateBrushWindings(bspbrush_t *brush) {
     int32_t i, j;
-    winding_t *w;
+    fixedwinding_t w;
     side_t *side;
     plane_t *plane;
 
     for (i = 0; i < brush->numsides; i++) {
         side  = &brush->sides[i];
         plane = &mapplanes[side->planenum];
-        w     = BaseWindingForPlane(plane->normal, plane->dist);
-        for (j = 0; j < brush->numsides && w; j++) {
+        BaseFixedWindingForPlane(&w, plane->normal, plane->dist);
+        for (j = 0; j < brush->numsides; j++) {
             if (i == j)
                 continue;
             if (brush->sides[j].bevel)
                 continue;
             plane = &mapplanes[brush->sides[j].planenum ^ 1];
-            ChopWindingInPlace(&w, plane->normal, plane->dist, 0);
+            if (!ChopFixedWindingInPlace(&w, plane->normal, plane->dist, 0))
+                break;
         }
 
-        side->winding = w;
+        side->winding = CopyFixedWinding(&w);
     }
 
     BoundBrush(brush);
@@ -211,8 +212,7 @@ AllocNode
 node_t *AllocNode(void) {
     node_t *node;
 
-    node = malloc(sizeof(*node));
-    memset(node, 0, sizeof(*node));
+    node = AllocBlock(sizeof(*node));
 
     return node;
 }
@@ -227,8 +227,7 @@ bspbrush_t *AllocBrush(int32_t numsides) {
     int32_t c;
 
     c  = (intptr_t) & (((bspbrush_t *)0)->sides[numsides]);
-    bb = malloc(c);
-    memset(bb, 0, c);
+    bb = AllocBlock(c);
     if (numthreads == 1)
         c_active_brushes++;
     return bb;
@@ -245,7 +244,7 @@ void FreeBrush(bspbrush_t *brushes) {
     for (i = 0; i < brushes->numsides; i++)
         if (brushes->sides[i].winding)
             FreeWinding(brushes->sides[i].winding);
-    free(brushes);
+    FreeBlock(brushes);
     if (numthreads == 1)
         c_active_brushes--;
 }
@@ -790,7 +789,8 @@ void SplitBrush(bspbrush_t *brush, int32_t planenum,
                 bspbrush_t **front, bspbrush_t **back) {
     bspbrush_t *b[2];
     int32_t i, j;
-    winding_t *w, *cw[2], *midwinding;
+    winding_t *w, *cw[2];
+    fixedwinding_t midwinding;
     plane_t *plane, *plane2;
     side_t *s, *cs;
     vec_t d, d_front, d_back;
@@ -828,16 +828,18 @@ void SplitBrush(bspbrush_t *brush, int32_t planenum,
 
     // create a new winding from the split plane
 
-    w = BaseWindingForPlane(plane->normal, plane->dist);
-    for (i = 0; i < brush->numsides && w; i++) {
+    BaseFixedWindingForPlane(&midwinding, plane->normal, plane->dist);
+    for (i = 0; i < brush->numsides; i++) {
         plane2 = &mapplanes[brush->sides[i].planenum ^ 1];
-        ChopWindingInPlace(&w, plane2->normal, plane2->dist, 0); // PLANESIDE_EPSILON);
+        if (!ChopFixedWindingInPlace(&midwinding, plane2->normal, plane2->dist, 0)) // PLANESIDE_EPSILON);
+            break;
     }
 
-    if (!w || WindingIsTiny(w)) {
+    if (!midwinding.numpoints || WindingIsTiny(FixedWindingPoints(&midwinding))) {
         // the brush isn't really split
         int32_t side;
 
+        FreeFixedWinding(&midwinding);
         side = BrushMostlyOnSide(brush, plane);
         if (side == PSIDE_FRONT)
             *front = CopyBrush(brush);
@@ -846,12 +848,10 @@ void SplitBrush(bspbrush_t *brush, int32_t planenum,
         return;
     }
 
-    if (WindingIsHuge(w)) {
+    if (WindingIsHuge(FixedWindingPoints(&midwinding))) {
         qprintf("WARNING: huge winding\n");
     }
 
-    midwinding = w;
-
     // split it for real
 
     for (i = 0; i < 2; i++) {
@@ -912,6 +912,7 @@ void SplitBrush(bspbrush_t *brush, int32_t planenum,
             qprintf("split removed brush\n");
         else
             qprintf("split not on both sides\n");
+        FreeFixedWinding(&midwinding);
         if (b[0]) {
             FreeBrush(b[0]);
             *front = CopyBrush(brush);
@@ -933,9 +934,9 @@ void SplitBrush(bspbrush_t *brush, int32_t planenum,
         cs->visible  = false;
         cs->tested   = false;
         if (i == 0)
-            cs->winding = CopyWinding(midwinding);
+            cs->winding = CopyWinding(FixedWindingPoints(&midwinding));
         else
-            cs->winding = midwinding;
+            cs->winding = CopyFixedWinding(&midwinding);
     }
 
     {
@@ -1119,8 +1120,10 @@ tree_t *BrushBSP(bspbrush_t *brushlist, vec3_t mins, vec3_t maxs) {
     qprintf("%5i visible faces\n", c_faces);
     qprintf("%5i nonvisible faces\n", c_nonvisfaces);
 
-    c_nodes        = 0;
-    c_nonvis       = 0;
+    if (numthreads == 1) {
+        c_nodes  = 0;
+        c_nonvis = 0;
+    }
     node           = AllocNode();
 
     node->volume   = BrushFromBounds(mins, maxs);
@@ -51,6 +51,8 @@ int32_t max_entities = MAX_MAP_ENTITIES; // qb: from kmqbsp3- Knightmare- adjust
 int32_t max_bounds   = DEFAULT_MAP_SIZE; // Knightmare- adjustable max bounds
 int32_t block_size   = 1024;             // Knightmare- adjustable block size
 
+int32_t bspthreads   = 1;
+
 node_t *block_nodes[10][10];
 
 /*
@@ -254,18 +256,25 @@ void ProcessWorldModel(void) {
 
 /*
 ============
-ProcessSubModel
+BuildSubModel
 
+Runs the csg, bsp, portal and face passes for a submodel.  Nothing is
+written to the bsp lumps, so submodels can be built in parallel once the
+planes they share exist.
 ============
 */
-void ProcessSubModel(void) {
+int32_t numsubmodels;
+int32_t *submodel_entities;
+tree_t **submodel_trees;
+
+void BuildSubModel(int32_t submodel) {
     entity_t *e;
     int32_t start, end;
     tree_t *tree;
     bspbrush_t *list;
     vec3_t mins, maxs;
 
-    e       = &entities[entity_num];
+    e       = &entities[submodel_entities[submodel]];
 
     start   = e->firstbrush;
     end     = start + e->numbrushes;
@@ -279,6 +288,62 @@ void ProcessSubModel(void) {
     MakeTreePortals(tree);
     MarkVisibleSides(tree, start, end);
     MakeFaces(tree->headnode);
+
+    submodel_trees[submodel] = tree;
+}
+
+void BuildSubModel_Thread(int32_t submodel) {
+    BuildSubModel(submodel + 1);
+}
+
+/*
+============
+BuildSubModels
+
+The clip box and head node planes are the same for every submodel, so the
+first one is built alone to create them.  The rest only look planes up and
+are built in parallel.
+============
+*/
+void BuildSubModels(void) {
+    int32_t i;
+    int32_t oldnumplanes;
+    int32_t oldnumthreads;
+
+    submodel_entities = malloc(num_entities * sizeof(*submodel_entities));
+    submodel_trees    = malloc(num_entities * sizeof(*submodel_trees));
+
+    numsubmodels      = 0;
+    for (i = 1; i < num_entities; i++) {
+        if (entities[i].numbrushes)
+            submodel_entities[numsubmodels++] = i;
+    }
+    if (!numsubmodels)
+        return;
+
+    BuildSubModel(0);
+
+    oldnumplanes  = nummapplanes;
+    oldnumthreads = numthreads;
+    numthreads    = bspthreads;
+    RunThreadsOnIndividual(numsubmodels - 1, !verbose, BuildSubModel_Thread);
+    numthreads = oldnumthreads;
+
+    if (nummapplanes != oldnumplanes)
+        Error("BuildSubModels: a submodel created a new plane");
+}
+
+/*
+============
+ProcessSubModel
+
+Emits a submodel made by BuildSubModels
+============
+*/
+void ProcessSubModel(int32_t submodel) {
+    tree_t *tree;
+
+    tree = submodel_trees[submodel];
     FixTjuncs(tree->headnode);
     WriteBSP(tree->headnode);
     FreeTree(tree);
@@ -290,21 +355,36 @@ ProcessModels
 ============
 */
 void ProcessModels(void) {
+    int32_t submodel;
+
     BeginBSPFile();
 
+    submodel = -1;
     for (entity_num = 0; entity_num < num_entities; entity_num++) {
         if (!entities[entity_num].numbrushes)
             continue;
 
+        // the world goes first, its planes have to be made before
+        // the submodels are built
+        if (entity_num != 0 && submodel == -1) {
+            BuildSubModels();
+            submodel = 0;
+        }
+
         qprintf("############### model %i ###############\n", nummodels);
         BeginModel();
         if (entity_num == 0)
             ProcessWorldModel();
         else
-            ProcessSubModel();
+            ProcessSubModel(submodel++);
         EndModel();
     }
 
+    free(submodel_entities);
+    free(submodel_trees);
+    submodel_entities = NULL;
+    submodel_trees    = NULL;
+
     EndBSPFile();
 }
 
@@ -358,6 +438,11 @@ void BSP_ProcessArgument(const char * arg) {
         ProcessModels();
     }
 
+    // nothing built from the map outlives the stage, so its windings,
+    // brushes, nodes, portals and faces are released all at once
+    PrintBlockStats();
+    FreeAllBlocks();
+
     PrintBSPFileSizes();
     printf("<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<< END bsp >>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>\n\n");
 }
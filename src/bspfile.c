@@ -96,36 +96,133 @@ dareaportal_t * dareaportals;//[MAX_MAP_AREAPORTALS];
 
 byte dpop[256];
 
+qboolean bsp_frommemory = false;
+qboolean bsp_tomemory   = false;
+qboolean keepstages     = false;
+portaldata_t stageportals;
+
+lumpalloc_t lumpalloc;
+
+// LoadBSPFile maps the file and points the lumps straight into it, the
+// mapping is private so a stage may write to them without touching the file
+static byte *bspmap;
+static int32_t bspmapsize;
+static qboolean bspmapped;
+
+typedef struct
+{
+    void **data;
+    int32_t *allocated;
+    int32_t size;
+} lumpref_t;
+
+#define LUMPREF(lump) {(void **)&lump, &lumpalloc.lump, sizeof(*lump)}
+
+static lumpref_t lumprefs[] = {
+    LUMPREF(dmodels), LUMPREF(dvisdata), LUMPREF(dlightdata), LUMPREF(dentdata),
+    LUMPREF(dleafs), LUMPREF(dleafsX), LUMPREF(dplanes), LUMPREF(dvertexes),
+    LUMPREF(dnodes), LUMPREF(dnodesX), LUMPREF(texinfo), LUMPREF(dfaces),
+    LUMPREF(dfacesX), LUMPREF(dedges), LUMPREF(dedgesX), LUMPREF(dleaffaces),
+    LUMPREF(dleaffacesX), LUMPREF(dleafbrushes), LUMPREF(dleafbrushesX), LUMPREF(dsurfedges),
+    LUMPREF(dbrushes), LUMPREF(dbrushsides), LUMPREF(dbrushsidesX), LUMPREF(dareas),
+    LUMPREF(dareaportals)};
+
+static qboolean InBSPMap(void *data) {
+    return bspmap && (byte *)data >= bspmap && (byte *)data <= bspmap + bspmapsize;
+}
+
+/*
+=============
+ReleaseBSPMap
+
+Unmaps the loaded file.  With keep set the lumps still in it are
+copied to the heap first, otherwise they are dropped.
+=============
+*/
+static void ReleaseBSPMap(qboolean keep) {
+    lumpref_t *ref;
+    void *copy;
+
+    if (!bspmap)
+        return;
+
+    for (ref = lumprefs; ref < lumprefs + sizeof(lumprefs) / sizeof(lumprefs[0]); ref++) {
+        if (!InBSPMap(*ref->data))
+            continue;
+        if (keep) {
+            copy = malloc(((size_t)*ref->allocated + 1) * ref->size);
+            if (!copy)
+                Error("ReleaseBSPMap: couldn't allocate %i elements of %i bytes", *ref->allocated, ref->size);
+            memcpy(copy, *ref->data, (size_t)*ref->allocated * ref->size);
+            *ref->data = copy;
+        } else {
+            *ref->data      = NULL;
+            *ref->allocated = 0;
+        }
+    }
+
+    UnmapFile(bspmap, bspmapsize, bspmapped);
+    bspmap = NULL;
+    dvis   = (dvis_t *)dvisdata;
+}
+
+/*
+=============
+GrowLump
+
+Makes sure a lump has room for count elements.  It grows by half
+again each time, so appending one element at a time stays cheap.
+A lump still in the mapped file is copied out the first time it grows.
+=============
+*/
+void *GrowLump(void *data, int32_t *allocated, int32_t count, int32_t size) {
+    int32_t newcount;
+    void *copy;
+
+    if (count <= *allocated)
+        return data;
+
+    newcount = *allocated + *allocated / 2;
+    if (newcount < count)
+        newcount = count;
+
+    if (InBSPMap(data)) {
+        copy = malloc((size_t)newcount * size);
+        if (copy)
+            memcpy(copy, data, (size_t)*allocated * size);
+        data = copy;
+    } else
+        data = realloc(data, (size_t)newcount * size);
+    if (!data)
+        Error("GrowLump: couldn't allocate %i elements of %i bytes", newcount, size);
+
+    // fields nobody sets are written out as zero
+    memset((byte *)data + (size_t)*allocated * size, 0, (size_t)(newcount - *allocated) * size);
+    *allocated = newcount;
+
+    return data;
+}
+
+/*
+=============
+ReserveVisData
+
+Keeps dvis pointing at the vis lump when it moves
+=============
+*/
+void ReserveVisData(int32_t size) {
+    if (size < sizeof(dvis_t))
+        size = sizeof(dvis_t);
+    ReserveLump(dvisdata, size);
+    dvis = (dvis_t *)dvisdata;
+}
+
 void InitBSPFile(void) {
     static qboolean init = false;
-    if(!init) {
+    if (!init) {
         init = true;
-        dmodels = (dmodel_t*)malloc(sizeof(*dmodels) * MAX_MAP_MODELS_QBSP);
-        dvisdata = (byte*)malloc(sizeof(*dvisdata) * MAX_MAP_VISIBILITY_QBSP);
-        dvis = (dvis_t *)dvisdata;
-        dlightdata = (byte*)malloc(sizeof(*dlightdata) * MAX_MAP_LIGHTING_QBSP);
-        dentdata = (char*)malloc(sizeof(*dentdata) * MAX_MAP_ENTSTRING_QBSP);
-        dleafs = (dleaf_t*)malloc(sizeof(*dleafs) * MAX_MAP_LEAFS);
-        dleafsX = (dleaf_tx*)malloc(sizeof(*dleafsX) * MAX_MAP_LEAFS_QBSP);
-        dplanes = (dplane_t*)malloc(sizeof(*dplanes) * MAX_MAP_PLANES_QBSP);
-        dvertexes = (dvertex_t*)malloc(sizeof(*dvertexes) * MAX_MAP_VERTS_QBSP);
-        dnodes = (dnode_t*)malloc(sizeof(*dnodes) * MAX_MAP_NODES);
-        dnodesX = (dnode_tx*)malloc(sizeof(*dnodesX) * MAX_MAP_NODES_QBSP);
-        texinfo = (texinfo_t*)malloc(sizeof(*texinfo) * MAX_MAP_TEXINFO_QBSP);
-        dfaces = (dface_t*)malloc(sizeof(*dfaces) * MAX_MAP_FACES);
-        dfacesX = (dface_tx*)malloc(sizeof(*dfacesX) * MAX_MAP_FACES_QBSP);
-        dedges = (dedge_t*)malloc(sizeof(*dedges) * MAX_MAP_EDGES);
-        dedgesX = (dedge_tx*)malloc(sizeof(*dedgesX) * MAX_MAP_EDGES_QBSP);
-        dleaffaces = (uint16_t*)malloc(sizeof(*dleaffaces) * MAX_MAP_LEAFFACES);
-        dleaffacesX = (uint32_t*)malloc(sizeof(*dleaffacesX) * MAX_MAP_LEAFFACES_QBSP);
-        dleafbrushes = (uint16_t*)malloc(sizeof(*dleafbrushes) * MAX_MAP_LEAFBRUSHES);
-        dleafbrushesX = (uint32_t*)malloc(sizeof(*dleafbrushesX) * MAX_MAP_LEAFBRUSHES_QBSP);
-        dsurfedges = (int32_t*)malloc(sizeof(*dsurfedges) * MAX_MAP_SURFEDGES_QBSP);
-        dbrushes = (dbrush_t*)malloc(sizeof(*dbrushes) * MAX_MAP_BRUSHES_QBSP);
-        dbrushsides = (dbrushside_t*)malloc(sizeof(*dbrushsides) * MAX_MAP_BRUSHSIDES);
-        dbrushsidesX = (dbrushside_tx*)malloc(sizeof(*dbrushsidesX) * MAX_MAP_BRUSHSIDES_QBSP);
-        dareas = (darea_t*)malloc(sizeof(*dareas) * MAX_MAP_AREAS);
-        dareaportals = (dareaportal_t*)malloc(sizeof(*dareaportals) * MAX_MAP_AREAPORTALS);
+        ReserveVisData(0);
+        dvis->numclusters = 0;
     }
 }
 
@@ -207,6 +304,12 @@ void SwapBSPFile(qboolean todisk) {
     int32_t i, j;
     dmodel_t *d;
 
+#ifndef __BIG_ENDIAN__
+    // the file order is the host order, and a pass that rewrote every
+    // value unchanged would still copy every page of a mapped file
+    return;
+#endif
+
     // models
     for (i = 0; i < nummodels; i++) {
         d            = &dmodels[i];
@@ -407,8 +510,9 @@ void SwapBSPFile(qboolean todisk) {
 }
 
 dheader_t *header;
+static dheader_t inheader;
 
-int32_t CopyLump(int32_t lump, void *dest, int32_t size) {
+static void CheckLump(int32_t lump, int32_t size) {
     int32_t length, ofs;
 
     length = header->lumps[lump].filelen;
@@ -416,92 +520,142 @@ int32_t CopyLump(int32_t lump, void *dest, int32_t size) {
 
     if (length % size)
         Error("LoadBSPFile: odd lump size  (length: %i  size: %i  remainder: %i)", length, size, length % size);
+    if (length < 0 || ofs < 0 || ofs > bspmapsize - length)
+        Error("LoadBSPFile: lump %i runs past the end of the file", lump);
+}
+
+int32_t CopyLump(int32_t lump, void *dest, int32_t size) {
+    CheckLump(lump, size);
+    memcpy(dest, bspmap + header->lumps[lump].fileofs, header->lumps[lump].filelen);
 
-    memcpy(dest, (byte *)header + ofs, length);
+    return header->lumps[lump].filelen / size;
+}
 
-    return length / size;
+int32_t LumpCount(int32_t lump, int32_t size) {
+    return header->lumps[lump].filelen / size;
 }
 
 /*
 =============
-LoadBSPFile
+MapLump
+
+Points a lump at its data in the mapped file.  Only a lump that isn't
+aligned for its type gets copied out.
 =============
 */
-void LoadBSPFile(char *filename) {
+static int32_t MapLump(int32_t lump, void **data, int32_t *allocated, int32_t size) {
+    int32_t count;
+
+    CheckLump(lump, size);
+    count = LumpCount(lump, size);
+
+    if (header->lumps[lump].fileofs & 3) {
+        *data = GrowLump(*data, allocated, count, size);
+        return CopyLump(lump, *data, size);
+    }
+
+    free(*data);
+    *data      = bspmap + header->lumps[lump].fileofs;
+    *allocated = count;
+
+    return count;
+}
+
+#define LoadLump(lump, dest) MapLump(lump, (void **)&(dest), &lumpalloc.dest, sizeof(*(dest)))
+
+/*
+=============
+MapBSPFile
+
+Maps a bsp file and checks its header, nothing past the header is read
+until a lump is used
+=============
+*/
+static void MapBSPFile(char *filename) {
     int32_t i;
 
     InitBSPFile();
+    ReleaseBSPMap(false);
 
-    //
-    // load the file header
-    //
-    LoadFile(filename, (void **)&header);
+    bspmapsize = MapFile(filename, (void **)&bspmap, &bspmapped);
+    if (bspmapsize < sizeof(dheader_t))
+        Error("%s is not a recognized BSP file (IBSP or QBSP).", filename);
 
-    // swap the header
+    // swap a copy of the header so its page of the file stays clean
+    header = &inheader;
+    memcpy(header, bspmap, sizeof(dheader_t));
     for (i = 0; i < sizeof(dheader_t) / 4; i++)
         ((int32_t *)header)[i] = LittleLong(((int32_t *)header)[i]);
 
-    // qb: qbsp
-    use_qbsp = false;
-
-    switch (header->ident) {
-    case IDBSPHEADER:
-        break;
-    case QBSPHEADER:
-        use_qbsp = true;
-        printf("using QBSP extended limits \n");
-        break;
-    default:
-        Error("%s is not a recognized BSP file (IBSP or QBSP).",
-              filename);
-    }
+    if (header->ident != IDBSPHEADER && header->ident != QBSPHEADER)
+        Error("%s is not a recognized BSP file (IBSP or QBSP).", filename);
     if (header->version != BSPVERSION)
         Error("%s is version %i, not %i", filename, header->version, BSPVERSION);
+}
 
-    nummodels   = CopyLump(LUMP_MODELS, dmodels, sizeof(dmodel_t));
-    numvertexes = CopyLump(LUMP_VERTEXES, dvertexes, sizeof(dvertex_t));
-    numplanes   = CopyLump(LUMP_PLANES, dplanes, sizeof(dplane_t));
+/*
+=============
+LoadBSPFile
+=============
+*/
+void LoadBSPFile(char *filename) {
+    MapBSPFile(filename);
+
+    // qb: qbsp
+    use_qbsp = header->ident == QBSPHEADER;
+    if (use_qbsp)
+        printf("using QBSP extended limits \n");
+
+    nummodels   = LoadLump(LUMP_MODELS, dmodels);
+    numvertexes = LoadLump(LUMP_VERTEXES, dvertexes);
+    numplanes   = LoadLump(LUMP_PLANES, dplanes);
 
     if (use_qbsp) {
-        numleafs       = CopyLump(LUMP_LEAFS, dleafsX, sizeof(dleaf_tx));
-        numnodes       = CopyLump(LUMP_NODES, dnodesX, sizeof(dnode_tx));
-        numtexinfo     = CopyLump(LUMP_TEXINFO, texinfo, sizeof(texinfo_t));
-        numfaces       = CopyLump(LUMP_FACES, dfacesX, sizeof(dface_tx));
-        numleaffaces   = CopyLump(LUMP_LEAFFACES, dleaffacesX, sizeof(dleaffacesX[0]));
-        numleafbrushes = CopyLump(LUMP_LEAFBRUSHES, dleafbrushesX, sizeof(dleafbrushesX[0]));
+        numleafs       = LoadLump(LUMP_LEAFS, dleafsX);
+        numnodes       = LoadLump(LUMP_NODES, dnodesX);
+        numtexinfo     = LoadLump(LUMP_TEXINFO, texinfo);
+        numfaces       = LoadLump(LUMP_FACES, dfacesX);
+        numleaffaces   = LoadLump(LUMP_LEAFFACES, dleaffacesX);
+        numleafbrushes = LoadLump(LUMP_LEAFBRUSHES, dleafbrushesX);
     } else {
-        numleafs       = CopyLump(LUMP_LEAFS, dleafs, sizeof(dleaf_t));
-        numnodes       = CopyLump(LUMP_NODES, dnodes, sizeof(dnode_t));
-        numtexinfo     = CopyLump(LUMP_TEXINFO, texinfo, sizeof(texinfo_t));
-        numfaces       = CopyLump(LUMP_FACES, dfaces, sizeof(dface_t));
-        numleaffaces   = CopyLump(LUMP_LEAFFACES, dleaffaces, sizeof(dleaffaces[0]));
-        numleafbrushes = CopyLump(LUMP_LEAFBRUSHES, dleafbrushes, sizeof(dleafbrushes[0]));
+        numleafs       = LoadLump(LUMP_LEAFS, dleafs);
+        numnodes       = LoadLump(LUMP_NODES, dnodes);
+        numtexinfo     = LoadLump(LUMP_TEXINFO, texinfo);
+        numfaces       = LoadLump(LUMP_FACES, dfaces);
+        numleaffaces   = LoadLump(LUMP_LEAFFACES, dleaffaces);
+        numleafbrushes = LoadLump(LUMP_LEAFBRUSHES, dleafbrushes);
     }
 
-    numsurfedges = CopyLump(LUMP_SURFEDGES, dsurfedges, sizeof(dsurfedges[0]));
+    numsurfedges = LoadLump(LUMP_SURFEDGES, dsurfedges);
 
     if (use_qbsp)
-        numedges = CopyLump(LUMP_EDGES, dedgesX, sizeof(dedge_tx));
+        numedges = LoadLump(LUMP_EDGES, dedgesX);
     else
-        numedges = CopyLump(LUMP_EDGES, dedges, sizeof(dedge_t));
+        numedges = LoadLump(LUMP_EDGES, dedges);
 
-    numbrushes = CopyLump(LUMP_BRUSHES, dbrushes, sizeof(dbrush_t));
+    numbrushes = LoadLump(LUMP_BRUSHES, dbrushes);
 
     if (use_qbsp)
-        numbrushsides = CopyLump(LUMP_BRUSHSIDES, dbrushsidesX, sizeof(dbrushside_tx));
+        numbrushsides = LoadLump(LUMP_BRUSHSIDES, dbrushsidesX);
     else
-        numbrushsides = CopyLump(LUMP_BRUSHSIDES, dbrushsides, sizeof(dbrushside_t));
+        numbrushsides = LoadLump(LUMP_BRUSHSIDES, dbrushsides);
 
-    numareas       = CopyLump(LUMP_AREAS, dareas, sizeof(darea_t));
-    numareaportals = CopyLump(LUMP_AREAPORTALS, dareaportals, sizeof(dareaportal_t));
+    numareas       = LoadLump(LUMP_AREAS, dareas);
+    numareaportals = LoadLump(LUMP_AREAPORTALS, dareaportals);
 
-    visdatasize    = CopyLump(LUMP_VISIBILITY, dvisdata, 1);
-    lightdatasize  = CopyLump(LUMP_LIGHTING, dlightdata, 1);
-    entdatasize    = CopyLump(LUMP_ENTITIES, dentdata, 1);
+    visdatasize    = LoadLump(LUMP_VISIBILITY, dvisdata);
+    ReserveVisData(visdatasize);
+    if (!visdatasize)
+        dvis->numclusters = 0;
+    lightdatasize = LoadLump(LUMP_LIGHTING, dlightdata);
 
-    CopyLump(LUMP_POP, dpop, 1);
+    // every stage parses the entities and may rewrite them, so they are
+    // copied, with a spare zero byte for the parser's lookahead
+    ReserveLump(dentdata, LumpCount(LUMP_ENTITIES, 1) + 1);
+    entdatasize           = CopyLump(LUMP_ENTITIES, dentdata, 1);
+    dentdata[entdatasize] = 0;
 
-    free(header); // everything has been copied out
+    CopyLump(LUMP_POP, dpop, 1);
 
     //
     // swap everything
@@ -517,38 +671,18 @@ Only loads the texinfo lump to scan for textures
 =============
 */
 void LoadBSPFileTexinfo(char *filename) {
-    int32_t i;
-    FILE *f;
-    int32_t length, ofs;
+    MapBSPFile(filename);
 
-    header = malloc(sizeof(dheader_t));
+    numtexinfo = LoadLump(LUMP_TEXINFO, texinfo);
 
-    f      = fopen(filename, "rb");
-    if (!fread(header, sizeof(dheader_t), 1, f))
-        Error("Texinfo header read error");
-
-    // swap the header
-    for (i = 0; i < sizeof(dheader_t) / 4; i++)
-        ((int32_t *)header)[i] = LittleLong(((int32_t *)header)[i]);
-
-    if (header->ident != IDBSPHEADER && header->ident != QBSPHEADER)
-        Error("%s is not an IBSP or QBSP file", filename);
-    if (header->version != BSPVERSION)
-        Error("%s is version %i, not %i", filename, header->version, BSPVERSION);
-
-    length = header->lumps[LUMP_TEXINFO].filelen;
-    ofs    = header->lumps[LUMP_TEXINFO].fileofs;
-
-    fseek(f, ofs, SEEK_SET);
-    if (!fread(texinfo, length, 1, f))
-        Error("Texinfo lump read error");
-    fclose(f);
-
-    numtexinfo = length / sizeof(texinfo_t);
-
-    free(header); // everything has been copied out
-
-    SwapBSPFile(false);
+#ifdef __BIG_ENDIAN__
+    int32_t i;
+    for (i = 0; i < numtexinfo; i++) {
+        texinfo[i].flags       = LittleLong(texinfo[i].flags);
+        texinfo[i].value       = LittleLong(texinfo[i].value);
+        texinfo[i].nexttexinfo = LittleLong(texinfo[i].nexttexinfo);
+    }
+#endif
 }
 
 //============================================================================
@@ -557,13 +691,18 @@ FILE *wadfile;
 dheader_t outheader;
 
 void AddLump(int32_t lumpnum, void *data, int32_t len) {
+    static const byte pad[4] = {0, 0, 0, 0};
     lump_t *lump;
 
     lump          = &header->lumps[lumpnum];
 
     lump->fileofs = LittleLong(ftell(wadfile));
     lump->filelen = LittleLong(len);
-    SafeWrite(wadfile, data, (len + 3) & ~3);
+    SafeWrite(wadfile, data, len);
+
+    // the lumps are sized to fit, so pad with zeros rather than reading past the end
+    if (len & 3)
+        SafeWrite(wadfile, (void *)pad, 4 - (len & 3));
 }
 
 /*
@@ -575,6 +714,9 @@ Swaps the bsp file in place, so it should not be referenced again
 */
 void WriteBSPFile(char *filename) {
 
+    // the file may be the one the lumps are mapped from
+    ReleaseBSPMap(true);
+
     header = &outheader;
     memset(header, 0, sizeof(dheader_t));
 
@@ -644,6 +786,50 @@ void WriteBSPFile(char *filename) {
     fclose(wadfile);
 }
 
+/*
+=============
+LoadStageBSPFile
+
+Loads the bsp file unless the last stage left it in memory
+=============
+*/
+void LoadStageBSPFile(char *filename) {
+    if (bsp_frommemory) {
+        printf("using %s from memory\n", filename);
+        return;
+    }
+    printf("reading %s\n", filename);
+    LoadBSPFile(filename);
+}
+
+/*
+=============
+WriteStageBSPFile
+
+Writes the bsp file unless the next stage takes it from memory
+=============
+*/
+void WriteStageBSPFile(char *filename) {
+    if (bsp_tomemory && !keepstages) {
+        printf("keeping %s in memory for the next stage\n", filename);
+        return;
+    }
+    WriteBSPFile(filename);
+    if (bsp_tomemory)
+        SwapBSPFile(false); // the next stage still uses the lumps
+}
+
+/*
+=============
+FreePortalData
+=============
+*/
+void FreePortalData(portaldata_t *prt) {
+    free(prt->info);
+    free(prt->points);
+    memset(prt, 0, sizeof(*prt));
+}
+
 //============================================================================
 
 /*
@@ -797,8 +983,10 @@ void UnparseEntities(void) {
     epair_t *ep;
     char line[2060];
     int32_t i;
+    int32_t ofs;
     char key[1024], value[1024];
 
+    ReserveLump(dentdata, 1);
     buf  = dentdata;
     end  = buf;
     *end = 0;
@@ -808,6 +996,11 @@ void UnparseEntities(void) {
         if (!ep)
             continue; // ent got removed
 
+        ofs = end - buf;
+        ReserveLump(dentdata, ofs + 5); // open and close braces
+        buf = dentdata;
+        end = buf + ofs;
+
         strcat(end, "{\n");
         end += 2;
 
@@ -818,6 +1011,10 @@ void UnparseEntities(void) {
             StripTrailing(value);
 
             sprintf(line, "\"%s\" \"%s\"\n", key, value);
+            ofs = end - buf;
+            ReserveLump(dentdata, ofs + strlen(line) + 5);
+            buf = dentdata;
+            end = buf + ofs;
             strcat(end, line);
             end += strlen(line);
         }
@@ -98,6 +98,39 @@ extern dbrushside_tx * dbrushsidesX;//[MAX_MAP_BRUSHSIDES_QBSP];
 
 extern byte dpop[256];
 
+// the lumps are sized to fit the loaded file and grow as they are written,
+// lumpalloc holds the number of elements allocated for each one
+typedef struct
+{
+    int32_t dmodels;
+    int32_t dvisdata;
+    int32_t dlightdata;
+    int32_t dentdata;
+    int32_t dleafs, dleafsX;
+    int32_t dplanes;
+    int32_t dvertexes;
+    int32_t dnodes, dnodesX;
+    int32_t texinfo;
+    int32_t dfaces, dfacesX;
+    int32_t dedges, dedgesX;
+    int32_t dleaffaces, dleaffacesX;
+    int32_t dleafbrushes, dleafbrushesX;
+    int32_t dsurfedges;
+    int32_t dbrushes;
+    int32_t dbrushsides, dbrushsidesX;
+    int32_t dareas;
+    int32_t dareaportals;
+} lumpalloc_t;
+
+extern lumpalloc_t lumpalloc;
+
+void *GrowLump(void *data, int32_t *allocated, int32_t count, int32_t size);
+
+// makes room for count elements in a lump, the lump may move
+#define ReserveLump(lump, count) ((lump) = GrowLump((lump), &lumpalloc.lump, (count), sizeof(*(lump))))
+
+void ReserveVisData(int32_t size);
+
 void DecompressVis(byte *in, byte *decompressed);
 int32_t CompressVis(byte *vis, byte *dest);
 
@@ -109,6 +142,29 @@ void PrintBSPFileSizes(void);
 
 //===============
 
+// combined runs hand the lumps and portals on to the next stage in memory
+// instead of writing the .bsp and .prt and loading them again
+
+typedef struct
+{
+    int32_t numclusters;
+    int32_t numportals;
+    int32_t numpoints;
+    int32_t *info; // numpoints, cluster, cluster per portal, little endian as in PRT1-BIN
+    float *points;
+} portaldata_t;
+
+extern qboolean bsp_frommemory; // the lumps already hold the map from the last stage
+extern qboolean bsp_tomemory;   // the next stage takes the lumps from memory
+extern qboolean keepstages;     // write the intermediate files anyway
+extern portaldata_t stageportals;
+
+void LoadStageBSPFile(char *filename);
+void WriteStageBSPFile(char *filename);
+void FreePortalData(portaldata_t *prt);
+
+//===============
+
 typedef struct epair_s {
     struct epair_s *next;
     char *key;
@@ -0,0 +1,797 @@
+/*
+===========================================================================
+Copyright (C) 1997-2006 Id Software, Inc.
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+===========================================================================
+*/
+
+#include "vis.h"
+#include "threads.h"
+#include "mdfour.h"
+
+#include <stddef.h>
+
+extern qboolean nosort;
+
+/*
+==============================================================================
+
+VIS CHECKPOINT FILE
+
+Every so often the portals PortalFlow has finished are saved out to
+name.vck, so a full vis that gets killed can pick up with -resume.
+
+header
+portalbytes of done bits, one per memory portal
+portalbytes of portalvis for each done portal, lowest portal first
+an int32 for each done portal, its chains if it ran over the budget
+
+Only the run of sorted_portals that is done from the start is saved.
+A portal's flow uses the portalvis of the portals done before it, so
+resuming from a sorted prefix sees the same done portals a run that
+never stopped would have.
+
+The header carries a digest of the portal windings and leafs, so a
+checkpoint of an older .prt is never used, and the -vistime and
+-vischains it was made with, which have to match to be used.
+
+The threads hand their finished portals over in batches, so they
+don't all queue on the lock after every portal.
+==============================================================================
+*/
+
+#define CHECKPOINTHEADER (('4' << 24) + ('K' << 16) + ('C' << 8) + 'V') // little-endian "VCK4"
+
+typedef struct
+{
+    int32_t ident;
+    int32_t numportals; // file portals, there are twice as many memory ones
+    int32_t portalclusters;
+    int32_t portalbytes;
+    byte digest[16];
+    int32_t nosort;
+    int32_t numdone;
+    int32_t vistime; // milliseconds
+    int32_t vischains;
+} checkpointheader_t;
+
+#define CHECKPOINT_BATCH 64  // portals a thread finishes before it hands them over
+#define CHECKPOINT_FLUSH 1.0 // or seconds, whichever comes first
+
+typedef struct
+{
+    int32_t count;
+    int32_t portals[CHECKPOINT_BATCH];
+    double lastflush;
+} checkpointbatch_t;
+
+int32_t checkpointtime = 300; // seconds between saves, 0 to never save
+qboolean resume;
+char checkpointfile[1060];
+
+static byte portaldigest[16];
+static byte *donebits;    // every portal PortalFlow is done with
+static byte *prefixbits;  // just the sorted prefix that gets saved
+static int32_t numprefix; // sorted_portals before this are all done
+static double lastsave;
+static checkpointbatch_t batches[MAX_THREADS];
+static const char nofile[] = "doesn't exist";
+static const char otherlimits[] = "was made with a different -vistime or -vischains";
+
+/*
+=============
+DigestPortals
+
+md4 of the leafs and points of all the memory portals, as the
+floats they were in the portal file
+=============
+*/
+static void DigestPortals(byte *digest) {
+    int32_t i, j, k, size;
+    int32_t *buf, *out;
+    portal_t *p;
+    float f;
+
+    size = 0;
+    for (i = 0; i < numportals * 2; i++)
+        size += 2 + portals[i].winding->numpoints * 3;
+
+    buf = out = malloc(size * sizeof(int32_t));
+    for (i = 0, p = portals; i < numportals * 2; i++, p++) {
+        *out++ = LittleLong(portalhot[i].leaf);
+        *out++ = LittleLong(p->winding->numpoints);
+        for (j = 0; j < p->winding->numpoints; j++) {
+            for (k = 0; k < 3; k++) {
+                f = LittleFloat((float)p->winding->points[j][k]);
+                memcpy(out++, &f, sizeof(f));
+            }
+        }
+    }
+
+    mdfour(digest, (byte *)buf, size * sizeof(int32_t));
+    free(buf);
+}
+
+/*
+=============
+WriteVisFile
+
+Saves the portals in bits.  Goes to a temp file first, a crash in
+here leaves the last one alone.
+=============
+*/
+static qboolean WriteVisFile(const char *filename, const byte *bits, int32_t count) {
+    checkpointheader_t header;
+    char tempname[1070];
+    FILE *f;
+    int32_t i, chains;
+    qboolean ok;
+
+    sprintf(tempname, "%s.tmp", filename);
+    f = fopen(tempname, "wb");
+    if (!f)
+        return false;
+
+    memset(&header, 0, sizeof(header));
+    header.ident          = LittleLong(CHECKPOINTHEADER);
+    header.numportals     = LittleLong(numportals);
+    header.portalclusters = LittleLong(portalclusters);
+    header.portalbytes    = LittleLong(portalbytes);
+    header.nosort         = LittleLong(nosort);
+    header.numdone        = LittleLong(count);
+    header.vistime        = LittleLong((int32_t)(vistime * 1000));
+    header.vischains      = LittleLong(vischains);
+    memcpy(header.digest, portaldigest, sizeof(header.digest));
+
+    ok = fwrite(&header, sizeof(header), 1, f) == 1;
+    ok = ok && fwrite(bits, portalbytes, 1, f) == 1;
+    for (i = 0; ok && i < numportals * 2; i++)
+        if (bits[i >> 3] & (1 << (i & 7)))
+            ok = fwrite(portals[i].portalvis, portalbytes, 1, f) == 1;
+    for (i = 0; ok && i < numportals * 2; i++) {
+        if (bits[i >> 3] & (1 << (i & 7))) {
+            chains = LittleLong(portals[i].overbudget);
+            ok     = fwrite(&chains, sizeof(chains), 1, f) == 1;
+        }
+    }
+    if (fclose(f))
+        ok = false;
+
+    if (!ok) {
+        remove(tempname);
+        return false;
+    }
+
+    remove(filename);
+    return !rename(tempname, filename);
+}
+
+/*
+=============
+ReadVisFile
+
+Returns why the file can't be used, or NULL and its done bits and
+the portalvis rows and over budget chains that go with them.
+=============
+*/
+static const char *ReadVisFile(const char *filename, checkpointheader_t *header, byte **bits, byte **vis,
+                               int32_t **overbudget) {
+    FILE *f;
+    int32_t i, count;
+    qboolean ok;
+
+    f = fopen(filename, "rb");
+    if (!f)
+        return nofile;
+
+    if (fread(header, sizeof(*header), 1, f) != 1 || LittleLong(header->ident) != CHECKPOINTHEADER) {
+        fclose(f);
+        return "is not a vis checkpoint";
+    }
+    if (LittleLong(header->numportals) != numportals || LittleLong(header->portalclusters) != portalclusters ||
+        LittleLong(header->portalbytes) != portalbytes || LittleLong(header->nosort) != nosort ||
+        memcmp(header->digest, portaldigest, sizeof(portaldigest))) {
+        fclose(f);
+        return "is from a different portal file";
+    }
+    if (LittleLong(header->vistime) != (int32_t)(vistime * 1000) || LittleLong(header->vischains) != vischains) {
+        fclose(f);
+        return otherlimits;
+    }
+
+    header->numdone = count = LittleLong(header->numdone);
+
+    *bits       = malloc(portalbytes);
+    *vis        = malloc((size_t)count * portalbytes);
+    *overbudget = malloc((size_t)count * sizeof(int32_t));
+    ok          = count >= 0 && count <= numportals * 2 && fread(*bits, portalbytes, 1, f) == 1 &&
+         CountBits(*bits, numportals * 2) == count &&
+         (!count || (fread(*vis, portalbytes, count, f) == (size_t)count &&
+                     fread(*overbudget, sizeof(int32_t), count, f) == (size_t)count));
+    fclose(f);
+
+    if (!ok) {
+        free(*bits);
+        free(*vis);
+        free(*overbudget);
+        return "is truncated";
+    }
+    for (i = 0; i < count; i++)
+        (*overbudget)[i] = LittleLong((*overbudget)[i]);
+    return NULL;
+}
+
+/*
+=============
+WriteCheckpoint
+=============
+*/
+static void WriteCheckpoint(void) {
+    if (!WriteVisFile(checkpointfile, prefixbits, numprefix)) {
+        printf("WARNING: couldn't write %s, no more checkpoints\n", checkpointfile);
+        checkpointtime = 0;
+        return;
+    }
+
+    qprintf("checkpoint: %i of %i portals\n", numprefix, numportals * 2);
+}
+
+/*
+=============
+LoadCheckpoint
+
+Marks the portals the checkpoint has as done.  Anything wrong with
+the file just means starting over, but different limits would mix
+two kinds of answer, so those are refused.
+=============
+*/
+static void LoadCheckpoint(void) {
+    checkpointheader_t header;
+    const char *reason;
+    byte *bits, *vis;
+    int32_t *overbudget;
+    int32_t i, count;
+
+    reason = ReadVisFile(checkpointfile, &header, &bits, &vis, &overbudget);
+    if (reason == nofile) {
+        printf("no checkpoint %s, starting from scratch\n", checkpointfile);
+        return;
+    }
+    if (reason == otherlimits)
+        Error("-resume: %s %s, run with the same limits or without -resume", checkpointfile, reason);
+    if (reason) {
+        printf("WARNING: %s %s, starting from scratch\n", checkpointfile, reason);
+        return;
+    }
+
+    count = 0;
+    for (i = 0; i < numportals * 2; i++) {
+        if (!(bits[i >> 3] & (1 << (i & 7))))
+            continue;
+        memcpy(portals[i].portalvis, vis + (size_t)count * portalbytes, portalbytes);
+        portals[i].overbudget = overbudget[count];
+        portals[i].status     = stat_done;
+        count++;
+    }
+    printf("resuming %s: %i of %i portals done\n", checkpointfile, count, numportals * 2);
+    free(bits);
+    free(vis);
+    free(overbudget);
+}
+
+/*
+=============
+AdvancePrefix
+=============
+*/
+static void AdvancePrefix(void) {
+    int32_t pnum;
+
+    while (numprefix < numportals * 2) {
+        pnum = sorted_portals[numprefix] - portals;
+        if (!(donebits[pnum >> 3] & (1 << (pnum & 7))))
+            break;
+        prefixbits[pnum >> 3] |= 1 << (pnum & 7);
+        numprefix++;
+    }
+}
+
+/*
+=============
+BeginCheckpoints
+
+Call once the portals are sorted, before PortalFlow.  Portals that
+are already done, from -resume or the -incremental cache, count as
+finished.
+=============
+*/
+void BeginCheckpoints(void) {
+    int32_t i;
+
+    donebits   = malloc(portalbytes);
+    prefixbits = malloc(portalbytes);
+    memset(donebits, 0, portalbytes);
+    memset(prefixbits, 0, portalbytes);
+    numprefix = 0;
+
+    if (checkpointtime || resume)
+        DigestPortals(portaldigest);
+    if (resume)
+        LoadCheckpoint();
+
+    for (i = 0; i < numportals * 2; i++)
+        if (portals[i].status == stat_done)
+            donebits[i >> 3] |= 1 << (i & 7);
+    AdvancePrefix();
+
+    lastsave = I_FloatTime();
+    memset(batches, 0, sizeof(batches));
+    for (i = 0; i < MAX_THREADS; i++)
+        batches[i].lastflush = lastsave;
+}
+
+/*
+=============
+CheckpointPortal
+
+PortalFlow is done with p.  Once the thread has a batch of them,
+they are marked done and everything done so far is saved if it's
+been long enough since the last time.
+=============
+*/
+void CheckpointPortal(portal_t *p) {
+    checkpointbatch_t *batch;
+    double now;
+    int32_t i, pnum;
+
+    if (!checkpointtime)
+        return;
+
+    batch                          = &batches[ThreadNum()];
+    batch->portals[batch->count++] = p - portals;
+    now                            = I_FloatTime();
+    if (batch->count < CHECKPOINT_BATCH && now - batch->lastflush < CHECKPOINT_FLUSH)
+        return;
+
+    // the lock also makes the portalvis of every done portal visible here
+    ThreadLock();
+    for (i = 0; i < batch->count; i++) {
+        pnum = batch->portals[i];
+        donebits[pnum >> 3] |= 1 << (pnum & 7);
+    }
+    AdvancePrefix();
+    if (now - lastsave >= checkpointtime) {
+        WriteCheckpoint();
+        lastsave = I_FloatTime();
+    }
+    ThreadUnlock();
+
+    batch->count     = 0;
+    batch->lastflush = now;
+}
+
+/*
+=============
+EndCheckpoints
+
+The vis is all there, the checkpoint isn't needed any more
+=============
+*/
+void EndCheckpoints(void) {
+    free(donebits);
+    free(prefixbits);
+    donebits = prefixbits = NULL;
+    remove(checkpointfile);
+}
+
+/*
+==============================================================================
+
+-visshard SHARDS
+
+Shard k of n flows the sorted portals k, k + n, k + 2n ... and puts
+each one out to name.<k>.vsh as soon as it's done:
+
+header
+int32 portal, int32 over budget chains and portalbytes of portalvis,
+for each portal in the order they got done
+
+The shards are run at the same time.  When a flow comes to a portal
+sorted before its own that isn't done yet, it waits for the shard
+that has it, so every portal sees the same done portals a single full
+vis gives it.  A flow mostly looks at portals sorted not long before
+its own, and dealing them out one at a time keeps the shards level,
+so the waits are short.
+
+One waiting thread at a time reads a shard's file, at most every
+SHARD_READ milliseconds, and only takes the thread lock to hand the
+new portals over.  A shard that's flowing puts out a record with
+portal -1 every SHARD_BEAT seconds, so one that hasn't put anything
+out for SHARD_STALL seconds is taken to be gone, and the portals
+wanted from it are flowed where they are wanted instead.
+
+Whatever is in the files already when a shard starts is taken as
+done, so a killed shard picks up where it was.  -vismerge reads them
+all and flows anything that's missing.
+==============================================================================
+*/
+
+#define SHARDHEADER (('1' << 24) + ('H' << 16) + ('S' << 8) + 'V') // little-endian "VSH1"
+#define SHARD_STALL 30                                               // seconds
+#define SHARD_BEAT  5                                                // seconds
+#define SHARD_POLL  1                                                // milliseconds between looks
+#define SHARD_READ  2                                                // milliseconds between reads of a file
+
+typedef struct
+{
+    int32_t ident;
+    int32_t numportals;
+    int32_t portalclusters;
+    int32_t portalbytes;
+    byte digest[16];
+    int32_t nosort;
+    int32_t vistime; // milliseconds
+    int32_t vischains;
+    int32_t shard;
+    int32_t numshards;
+    int32_t run; // a shard run again starts its file over
+} shardheader_t;
+
+typedef struct
+{
+    char name[1080];
+    int32_t run;
+    long offset;      // where the next record starts, 0 until the header is read
+    qboolean reading; // a thread is reading it, the rest wait
+    double lastread;
+    double lastbeat;  // when it last put a record out
+} shardfile_t;
+
+qboolean visshard; // just flow the sorted portals shardnum, shardnum + numshards ...
+int32_t shardnum, numshards;
+qboolean vismerge;
+qboolean keeporder; // flows wait for and only use the portals sorted before them
+char shardbase[1060]; // name.<k>.vsh without the .<k>.vsh
+
+static shardfile_t *shardfiles; // [numshards]
+static FILE *shardout;
+static byte *shardrecord; // for writing
+static int32_t shardrecordsize;
+static double lastbeat; // when this shard last put a record out
+
+/*
+=============
+MakeShardHeader
+=============
+*/
+static void MakeShardHeader(shardheader_t *header, int32_t shard) {
+    memset(header, 0, sizeof(*header));
+    header->ident          = LittleLong(SHARDHEADER);
+    header->numportals     = LittleLong(numportals);
+    header->portalclusters = LittleLong(portalclusters);
+    header->portalbytes    = LittleLong(portalbytes);
+    header->nosort         = LittleLong(nosort);
+    header->vistime        = LittleLong((int32_t)(vistime * 1000));
+    header->vischains      = LittleLong(vischains);
+    header->shard          = LittleLong(shard);
+    header->numshards      = LittleLong(numshards);
+    memcpy(header->digest, portaldigest, sizeof(header->digest));
+}
+
+/*
+=============
+OpenShards
+=============
+*/
+static void OpenShards(void) {
+    int32_t k;
+    double now;
+
+    now        = I_FloatTime();
+    shardfiles = malloc(numshards * sizeof(*shardfiles));
+    memset(shardfiles, 0, numshards * sizeof(*shardfiles));
+    for (k = 0; k < numshards; k++) {
+        sprintf(shardfiles[k].name, "%s.%i.vsh", shardbase, k);
+        shardfiles[k].lastbeat = now;
+    }
+
+    shardrecordsize = 2 * sizeof(int32_t) + portalbytes;
+    shardrecord     = malloc(shardrecordsize);
+    lastbeat        = now;
+}
+
+/*
+=============
+ReadShard
+
+Takes the portals shard k has put out since the last look.  A file
+that isn't there or is from something else may just not have been
+started yet, so it's looked at again next time.  The file is read
+outside of the thread lock, only one thread may be in here for k.
+=============
+*/
+static void ReadShard(int32_t k) {
+    shardfile_t *sf;
+    shardheader_t header, want;
+    FILE *f;
+    long size;
+    int32_t i, count, pnum;
+    byte *records, *r;
+    portal_t *p;
+
+    sf = &shardfiles[k];
+    f  = fopen(sf->name, "rb");
+    if (!f)
+        return;
+
+    MakeShardHeader(&want, k);
+    if (fread(&header, sizeof(header), 1, f) != 1 || memcmp(&header, &want, offsetof(shardheader_t, numshards))) {
+        fclose(f);
+        return;
+    }
+    if (!sf->offset || header.run != sf->run) { // started over
+        sf->run    = header.run;
+        sf->offset = sizeof(header);
+    }
+
+    fseek(f, 0, SEEK_END);
+    size  = ftell(f);
+    count = size > sf->offset ? (size - sf->offset) / shardrecordsize : 0;
+    if (!count) {
+        fclose(f);
+        return;
+    }
+    records = malloc((size_t)count * shardrecordsize);
+    fseek(f, sf->offset, SEEK_SET);
+    count = fread(records, shardrecordsize, count, f);
+    fclose(f);
+    sf->offset += (long)count * shardrecordsize;
+
+    ThreadLock();
+    if (count)
+        sf->lastbeat = I_FloatTime();
+    for (i = 0, r = records; i < count; i++, r += shardrecordsize) {
+        pnum = LittleLong(((int32_t *)r)[0]);
+        if (pnum < 0 || pnum >= numportals * 2)
+            continue; // still flowing
+        p = &portals[pnum];
+        if (p->status != stat_none)
+            continue; // done or being done here
+        memcpy(p->portalvis, r + 2 * sizeof(int32_t), portalbytes);
+        p->overbudget = LittleLong(((int32_t *)r)[1]);
+        p->status     = stat_done;
+    }
+    ThreadUnlock();
+    free(records);
+}
+
+/*
+=============
+WriteShardRecord
+
+p NULL for a heartbeat.  Call with the thread lock held
+=============
+*/
+static void WriteShardRecord(portal_t *p) {
+    if (p) {
+        ((int32_t *)shardrecord)[0] = LittleLong((int32_t)(p - portals));
+        ((int32_t *)shardrecord)[1] = LittleLong(p->overbudget);
+        memcpy(shardrecord + 2 * sizeof(int32_t), p->portalvis, portalbytes);
+    } else {
+        memset(shardrecord, 0, shardrecordsize);
+        ((int32_t *)shardrecord)[0] = LittleLong(-1);
+    }
+    if (fwrite(shardrecord, shardrecordsize, 1, shardout) != 1 || fflush(shardout))
+        Error("couldn't write %s", shardfiles[shardnum].name);
+    lastbeat = I_FloatTime();
+}
+
+/*
+=============
+PublishPortal
+
+PortalFlow is done with p, the flows waiting on it and the other
+shards can have it
+=============
+*/
+void PublishPortal(portal_t *p) {
+    ThreadLock();
+    p->status = stat_done;
+    if (visshard)
+        WriteShardRecord(p);
+    ThreadUnlock();
+}
+
+/*
+=============
+ShardHeartbeat
+
+Tells the other shards this one is still at it, every SHARD_BEAT
+seconds at most
+=============
+*/
+void ShardHeartbeat(void) {
+    if (!visshard || I_FloatTime() - lastbeat < SHARD_BEAT)
+        return;
+
+    ThreadLock();
+    if (I_FloatTime() - lastbeat >= SHARD_BEAT)
+        WriteShardRecord(NULL);
+    ThreadUnlock();
+}
+
+/*
+=============
+PortalFromShards
+
+p is sorted before the portal being flowed and isn't done yet.
+Returns once it is, or with true if the shard that has it seems to
+be gone and p is now this thread's to flow.
+=============
+*/
+qboolean PortalFromShards(portal_t *p) {
+    shardfile_t *sf;
+    vstatus_t status;
+    qboolean read;
+    double now;
+    int32_t owner;
+
+    // the portals of this shard and of -vismerge are flowed here,
+    // another thread has it
+    owner = visshard ? p->sortrank % numshards : -1;
+    sf    = owner >= 0 && owner != shardnum ? &shardfiles[owner] : NULL;
+
+    while (1) {
+        ShardHeartbeat(); // waiting isn't being gone
+
+        ThreadLock();
+        status = p->status;
+        read   = false;
+        if (status == stat_none && sf && !sf->reading) {
+            now = I_FloatTime();
+            if (now - sf->lastread >= SHARD_READ / 1000.0) {
+                sf->reading  = true;
+                sf->lastread = now;
+                read         = true;
+            }
+        }
+        ThreadUnlock();
+
+        if (status == stat_done)
+            return false;
+        if (!read) {
+            ThreadSleep(SHARD_POLL);
+            continue;
+        }
+
+        ReadShard(owner);
+
+        // just read, so lastbeat is as new as the file
+        ThreadLock();
+        sf->reading = false;
+        if (p->status == stat_none && I_FloatTime() - sf->lastbeat > SHARD_STALL) {
+            p->status = stat_working;
+            ThreadUnlock();
+            return true;
+        }
+        ThreadUnlock();
+    }
+}
+
+/*
+=============
+BeginShard
+
+Call once the portals are sorted, instead of BeginCheckpoints
+=============
+*/
+void BeginShard(void) {
+    shardheader_t header;
+    int32_t i, k, count;
+
+    if (numshards < 1 || shardnum < 0 || shardnum >= numshards)
+        Error("-visshard %i %i: the shard has to be 0 to one less than the number of shards", shardnum, numshards);
+
+    DigestPortals(portaldigest);
+    checkpointtime = 0; // the shard file does the same
+    keeporder      = true;
+    OpenShards();
+
+    // anything already put out, by this shard before it was killed too
+    for (k = 0; k < numshards; k++)
+        ReadShard(k);
+
+    // the file starts over with the portals of this shard that are done
+    shardout = fopen(shardfiles[shardnum].name, "wb");
+    if (!shardout)
+        Error("couldn't write %s", shardfiles[shardnum].name);
+    MakeShardHeader(&header, shardnum);
+    header.run = LittleLong((int32_t)fmod(I_FloatTime() * 1000, 1 << 30));
+    if (fwrite(&header, sizeof(header), 1, shardout) != 1)
+        Error("couldn't write %s", shardfiles[shardnum].name);
+    count = 0;
+    for (i = shardnum; i < numportals * 2; i += numshards) {
+        if (sorted_portals[i]->status != stat_done)
+            continue;
+        WriteShardRecord(sorted_portals[i]);
+        count++;
+    }
+    shardfiles[shardnum].offset = ftell(shardout);
+
+    printf("visshard: shard %i of %i, %i of its %i portals done already\n", shardnum, numshards, count,
+           (numportals * 2 - shardnum + numshards - 1) / numshards);
+}
+
+/*
+=============
+EndShard
+=============
+*/
+void EndShard(void) {
+    if (fclose(shardout))
+        Error("couldn't write %s", shardfiles[shardnum].name);
+    shardout = NULL;
+    printf("wrote %s\n", shardfiles[shardnum].name);
+
+    free(shardfiles);
+    free(shardrecord);
+    shardfiles = NULL;
+}
+
+/*
+=============
+MergeShards
+
+Call before BeginCheckpoints.  The portals the shards put out are
+done, PortalFlow does any that are missing.
+=============
+*/
+void MergeShards(void) {
+    shardheader_t header;
+    char name[1080];
+    FILE *f;
+    int32_t i, k, count;
+
+    DigestPortals(portaldigest);
+    keeporder = true;
+
+    sprintf(name, "%s.0.vsh", shardbase);
+    f = fopen(name, "rb");
+    if (!f || fread(&header, sizeof(header), 1, f) != 1 || LittleLong(header.ident) != SHARDHEADER)
+        Error("-vismerge: %s isn't a vis shard", name);
+    fclose(f);
+    numshards = LittleLong(header.numshards);
+    if (numshards < 1)
+        Error("-vismerge: %s isn't a vis shard", name);
+
+    OpenShards();
+    for (k = 0; k < numshards; k++) {
+        ReadShard(k);
+        if (!shardfiles[k].offset)
+            printf("WARNING: %s is missing or from a different portal file\n", shardfiles[k].name);
+    }
+
+    count = 0;
+    for (i = 0; i < numportals * 2; i++)
+        if (portals[i].status == stat_done)
+            count++;
+    printf("vismerge: %i shards, %i of %i portals, flowing the other %i\n", numshards, count, numportals * 2,
+           numportals * 2 - count);
+
+    free(shardfiles);
+    free(shardrecord);
+    shardfiles = NULL;
+}
@@ -32,8 +32,10 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include <libc.h>
 #endif
 
-#ifdef __unix__
+#if defined(__unix__) || defined(__APPLE__)
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 #endif
 #define PATHSEPERATOR '/'
 
@@ -273,27 +275,12 @@ I_FloatTime
 ================
 */
 double I_FloatTime(void) {
-    time_t t;
+    struct timespec ts;
 
-    time(&t);
+    // qb: time() only has whole seconds, too coarse for -vistime
+    timespec_get(&ts, TIME_UTC);
 
-    return t;
-#if 0
-	// more precise, less portable
-	struct timeval tp;
-	struct timezone tzp;
-	static int32_t		secbase;
-
-	gettimeofday(&tp, &tzp);
-
-	if (!secbase)
-	{
-		secbase = tp.tv_sec;
-		return tp.tv_usec / 1000000.0;
-	}
-
-	return (tp.tv_sec - secbase) + tp.tv_usec / 1000000.0;
-#endif
+    return ts.tv_sec + ts.tv_nsec / 1000000000.0;
 }
 
 void Q_pathslash(char *out) { // qb: added
@@ -584,6 +571,51 @@ int32_t LoadFile(char *filename, void **bufferptr) {
     return length;
 }
 
+/*
+==============
+MapFile
+
+Maps a file copy-on-write, so the buffer may be modified without
+touching the file and pages nobody reads are never loaded.
+Falls back to LoadFile where mmap isn't available.
+==============
+*/
+int32_t MapFile(char *filename, void **bufferptr, qboolean *mapped) {
+#if defined(__unix__) || defined(__APPLE__)
+    int fd;
+    struct stat st;
+    void *buffer;
+
+    fd = open(filename, O_RDONLY);
+    if (fd == -1)
+        Error("Error opening %s: %s", filename, strerror(errno));
+
+    if (fstat(fd, &st) == 0 && st.st_size > 0 && st.st_size <= INT32_MAX) {
+        buffer = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (buffer != MAP_FAILED) {
+            close(fd);
+            *bufferptr = buffer;
+            *mapped    = true;
+            return st.st_size;
+        }
+    }
+    close(fd);
+#endif
+
+    *mapped = false;
+    return LoadFile(filename, bufferptr);
+}
+
+void UnmapFile(void *buffer, int32_t length, qboolean mapped) {
+#if defined(__unix__) || defined(__APPLE__)
+    if (mapped) {
+        munmap(buffer, length);
+        return;
+    }
+#endif
+    free(buffer);
+}
+
 /*
 ==============
 TryLoadFile
@@ -882,10 +914,6 @@ BYTE ORDER FUNCTIONS
 ============================================================================
 */
 
-#ifdef _SGI_SOURCE
-#define __BIG_ENDIAN__
-#endif
-
 #ifdef __BIG_ENDIAN__
 
 short LittleShort(short l) {
@@ -1043,6 +1071,42 @@ void CRC_ProcessByte(uint16_t *crcvalue, byte data) {
 uint16_t CRC_Value(uint16_t crcvalue) {
     return crcvalue ^ CRC_XOR_VALUE;
 }
+
+/*
+============
+Hash64
+
+fnv-1a of size bytes on from h, HASH64_START to begin with
+============
+*/
+uint64_t Hash64(uint64_t h, const void *data, int32_t size) {
+    const byte *b;
+    int32_t i;
+
+    b = data;
+    for (i = 0; i < size; i++) {
+        h ^= b[i];
+        h *= 0x100000001b3ull;
+    }
+
+    return h;
+}
+
+/*
+============
+Mix64
+
+Spreads every bit of h over all of it, for sums and xors of hashes
+============
+*/
+uint64_t Mix64(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+    return h;
+}
 //=============================================================================
 
 /*
@@ -32,6 +32,10 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include <stdarg.h>
 #include <stdint.h>
 
+#ifdef _SGI_SOURCE
+#define __BIG_ENDIAN__
+#endif
+
 #ifndef __BYTEBOOL__
 #define __BYTEBOOL__
 typedef enum { false,
@@ -78,6 +82,8 @@ void SafeRead(FILE *f, void *buffer, int32_t count);
 void SafeWrite(FILE *f, void *buffer, int32_t count);
 
 int32_t LoadFile(char *filename, void **bufferptr);
+int32_t MapFile(char *filename, void **bufferptr, qboolean *mapped);
+void UnmapFile(void *buffer, int32_t length, qboolean mapped);
 int32_t TryLoadFile(char *filename, void **bufferptr, int32_t print_error);
 int32_t TryLoadFileFromPak(char *filename, void **bufferptr, char *gamedir);
 void SaveFile(char *filename, void *buffer, int32_t count);
@@ -111,6 +117,11 @@ void CRC_Init(uint16_t *crcvalue);
 void CRC_ProcessByte(uint16_t *crcvalue, byte data);
 uint16_t CRC_Value(uint16_t crcvalue);
 
+#define HASH64_START 0xcbf29ce484222325ull
+
+uint64_t Hash64(uint64_t h, const void *data, int32_t size);
+uint64_t Mix64(uint64_t h);
+
 void CreatePath(char *path);
 void QCopyFile(char *from, char *to);
 
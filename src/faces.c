@@ -146,6 +146,7 @@ int32_t GetVertexnum(vec3_t in) {
     } else if (numvertexes == MAX_MAP_VERTS)
         Error("MAX_MAP_VERTS");
 
+    ReserveLump(dvertexes, numvertexes + 1);
     dvertexes[numvertexes].point[0] = vert[0];
     dvertexes[numvertexes].point[1] = vert[1];
     dvertexes[numvertexes].point[2] = vert[2];
@@ -231,6 +232,7 @@ void EmitFaceVertexes(node_t *node, face_t *f) {
             } else if (numvertexes == MAX_MAP_VERTS)
                 Error("MAX_MAP_VERTS");
             superverts[i] = numvertexes;
+            ReserveLump(dvertexes, numvertexes + 1);
             VectorCopy(w->p[i], dvertexes[numvertexes].point);
             numvertexes++;
             c_uniqueverts++;
@@ -476,9 +478,9 @@ int32_t c_faces;
 face_t *AllocFace(void) {
     face_t *f;
 
-    f = malloc(sizeof(face_t));
-    memset(f, 0, sizeof(face_t));
-    c_faces++;
+    f = AllocBlock(sizeof(face_t));
+    if (numthreads == 1)
+        c_faces++;
 
     return f;
 }
@@ -497,8 +499,9 @@ face_t *NewFaceFromFace(face_t *f) {
 void FreeFace(face_t *f) {
     if (f->w)
         FreeWinding(f->w);
-    free(f);
-    c_faces--;
+    FreeBlock(f);
+    if (numthreads == 1)
+        c_faces--;
 }
 
 //========================================================
@@ -532,6 +535,7 @@ int32_t GetEdge(int32_t v1, int32_t v2, face_t *f) {
             // emit an edge
             if (numedges >= MAX_MAP_EDGES_QBSP)
                 Error("numedges == MAX_MAP_EDGES_QBSP");
+            ReserveLump(dedgesX, numedges + 1);
             edge = &dedgesX[numedges];
             numedges++;
             edge->v[0] = v1;
@@ -552,6 +556,7 @@ int32_t GetEdge(int32_t v1, int32_t v2, face_t *f) {
             // emit an edge
             if (numedges >= MAX_MAP_EDGES)
                 Error("numedges == MAX_MAP_EDGES");
+            ReserveLump(dedges, numedges + 1);
             edge = &dedges[numedges];
             numedges++;
             edge->v[0] = v1;
@@ -700,7 +705,8 @@ face_t *TryMerge(face_t *f1, face_t *f2, vec3_t planenormal) {
     if (!nw)
         return NULL;
 
-    c_merge++;
+    if (numthreads == 1)
+        c_merge++;
     newf = NewFaceFromFace(f1);
     newf->w = nw;
 
@@ -802,7 +808,8 @@ void SubdivideFace(node_t *node, face_t *f) {
             }
 
             // split it
-            c_subdivide++;
+            if (numthreads == 1)
+                c_subdivide++;
 
             ClipWindingEpsilon(w, temp, dist, ON_EPSILON, &frontw, &backw);
             if (!frontw || !backw)
@@ -922,7 +929,8 @@ void MakeFaces_r(node_t *node) {
 
         p->face[s] = FaceFromPortal(p, s);
         if (p->face[s]) {
-            c_nodefaces++;
+            if (numthreads == 1)
+                c_nodefaces++;
             p->face[s]->next = p->onnode->faces;
             p->onnode->faces = p->face[s];
         }
@@ -936,9 +944,11 @@ MakeFaces
 */
 void MakeFaces(node_t *node) {
     qprintf("--- MakeFaces ---\n");
-    c_merge = 0;
-    c_subdivide = 0;
-    c_nodefaces = 0;
+    if (numthreads == 1) {
+        c_merge     = 0;
+        c_subdivide = 0;
+        c_nodefaces = 0;
+    }
 
     MakeFaces_r(node);
 
@@ -18,6 +18,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 ===========================================================================
 */
 #include "vis.h"
+#include "threads.h"
 
 /*
 
@@ -38,18 +39,6 @@ with this program; if not, write to the Free Software Foundation, Inc.,
   void CalcMightSee (leaf_t *leaf,
 */
 
-int32_t CountBits(byte *bits, int32_t numbits) {
-    int32_t i;
-    int32_t c;
-
-    c = 0;
-    for (i = 0; i < numbits; i++)
-        if (bits[i >> 3] & (1 << (i & 7)))
-            c++;
-
-    return c;
-}
-
 int32_t c_fullskip;
 int32_t c_portalskip, c_leafskip;
 int32_t c_vistest, c_mighttest;
@@ -201,143 +190,175 @@ winding_t *ChopWinding_flow(winding_t *in, pstack_t *stack, plane_t *split) // q
 
 /*
 ==============
-ClipToSeperators
-
-Source, pass, and target are an ordering of portals.
+NextSeperator
 
 Generates seperating planes canidates by taking two points from source and one
-point from pass, and clips target by them.
-
-If target is totally clipped away, that portal can not be seen through.
+point from pass.  EdgeSeparators does every point of pass for one edge of
+source at a time, the planes come out in the same order either way.  False
+when there are no more.
 
 Normal clip keeps target on the same side as pass, which is correct if the
 order goes source, pass, target.  If the order goes pass, source, target then
 flipclip should be set.
 ==============
 */
-winding_t *ClipToSeperators(winding_t *source, winding_t *pass, winding_t *target, qboolean flipclip, pstack_t *stack) {
-    int32_t i, j, k, l;
-    plane_t plane;
-    vec3_t v1, v2;
-    float d;
-    vec_t length;
-    int32_t counts[3];
-    qboolean fliptest;
+typedef struct
+{
+    soawinding_t source, pass;
+    qboolean flipclip;
+    int32_t edge; // next edge of source to search
+    int32_t numplanes, nextplane;
+    vec_t planes[MAX_SOA_POINTS][4];
+} seperators_t;
+
+static void BeginSeperators(seperators_t *s, winding_t *source, winding_t *pass, qboolean flipclip) {
+    SoAWinding(source->points, source->numpoints, &s->source);
+    SoAWinding(pass->points, pass->numpoints, &s->pass);
+    s->flipclip  = flipclip;
+    s->edge      = 0;
+    s->numplanes = s->nextplane = 0;
+}
 
-    // check all combinations
-    for (i = 0; i < source->numpoints; i++) {
-        l = (i + 1) % source->numpoints;
-        VectorSubtract(source->points[l], source->points[i], v1);
+static qboolean NextSeperator(seperators_t *s, plane_t *out) {
+    vec_t *p;
 
-        // fing a vertex of pass that makes a plane that puts all of the
-        // vertexes of pass on the front side and all of the vertexes of
-        // source on the back side
-        for (j = 0; j < pass->numpoints; j++) {
-            VectorSubtract(pass->points[j], source->points[i], v2);
+    while (s->nextplane == s->numplanes) {
+        if (s->edge == s->source.numpoints)
+            return false;
+        s->numplanes = EdgeSeparators(&s->source, &s->pass, s->edge++, ON_EPSILON, s->flipclip, s->planes);
+        s->nextplane = 0;
+    }
 
-            plane.normal[0] = v1[1] * v2[2] - v1[2] * v2[1];
-            plane.normal[1] = v1[2] * v2[0] - v1[0] * v2[2];
-            plane.normal[2] = v1[0] * v2[1] - v1[1] * v2[0];
+    p = s->planes[s->nextplane++];
+    VectorCopy(p, out->normal);
+    out->dist = p[3];
+    return true;
+}
 
-            // if points don't make a valid plane, skip it
+/*
+==============
+ClipToSeperators
 
-            length          = plane.normal[0] * plane.normal[0] + plane.normal[1] * plane.normal[1] + plane.normal[2] * plane.normal[2];
+Source, pass, and target are an ordering of portals.
 
-            if (length < ON_EPSILON)
-                continue;
+Clips target by the seperating planes of source and pass.
+If target is totally clipped away, that portal can not be seen through.
+==============
+*/
+winding_t *ClipToSeperators(winding_t *source, winding_t *pass, winding_t *target, qboolean flipclip, pstack_t *stack) {
+    seperators_t s;
+    plane_t plane;
 
-            length = 1 / sqrt(length);
+    BeginSeperators(&s, source, pass, flipclip);
+    while (NextSeperator(&s, &plane)) {
+        //
+        // clip target by the seperating plane
+        //
+        target = ChopWinding_flow(target, stack, &plane);
+        if (!target)
+            return NULL; // target is not visible
+    }
 
-            plane.normal[0] *= length;
-            plane.normal[1] *= length;
-            plane.normal[2] *= length;
+    return target;
+}
 
-            plane.dist = DotProduct(pass->points[j], plane.normal);
+/*
+==============
+ClipToCachedSeperators
 
-            //
-            // find out which side of the generated seperating plane has the
-            // source portal
-            //
-#if 1
-            fliptest = false;
-            for (k = 0; k < source->numpoints; k++) {
-                if (k == i || k == l)
-                    continue;
-                d = DotProduct(source->points[k], plane.normal) - plane.dist;
-                if (d < -ON_EPSILON) { // source is on the negative side, so we want all
-                    // pass and target on the positive side
-                    fliptest = false;
-                    break;
-                } else if (d > ON_EPSILON) { // source is on the positive side, so we want all
-                    // pass and target on the negative side
-                    fliptest = true;
-                    break;
-                }
-            }
-            if (k == source->numpoints)
-                continue; // planar with source portal
-#else
-            fliptest = flipclip;
-#endif
-            //
-            // flip the normal if the source portal is backwards
-            //
-            if (fliptest) {
-                VectorSubtract(vec3_origin, plane.normal, plane.normal);
-                plane.dist = -plane.dist;
-            }
-#if 1
-            //
-            // if all of the pass portal points are now on the positive side,
-            // this is the seperating plane
-            //
-            counts[0] = counts[1] = counts[2] = 0;
-            for (k = 0; k < pass->numpoints; k++) {
-                if (k == j)
-                    continue;
-                d = DotProduct(pass->points[k], plane.normal) - plane.dist;
-                if (d < -ON_EPSILON)
-                    break;
-                else if (d > ON_EPSILON)
-                    counts[0]++;
-                else
-                    counts[2]++;
+Same as ClipToSeperators, for the source and pass of the previous frame.
+Those stay put while the frame goes through the portals of its leaf, so
+their separators are found once and kept in the frame.
+==============
+*/
+static winding_t *ClipToCachedSeperators(winding_t *source, winding_t *pass, winding_t *target, qboolean flipclip, pstack_t *stack) {
+    int32_t i, n;
+    seperators_t s;
+    plane_t plane, *planes;
+
+    planes = stack->separators[flipclip];
+    if (stack->numseparators[flipclip] == -1) {
+        n = 0;
+        BeginSeperators(&s, source, pass, flipclip);
+        while (NextSeperator(&s, &plane)) {
+            if (n == MAX_SEPARATORS) {
+                n = -2; // too many to keep
+                break;
             }
-            if (k != pass->numpoints)
-                continue; // points on negative side, not a seperating plane
+            planes[n++] = plane;
+        }
+        stack->numseparators[flipclip] = n;
+    }
 
-            if (!counts[0])
-                continue; // planar with seperating plane
-#else
-            k        = (j + 1) % pass->numpoints;
-            d        = DotProduct(pass->points[k], plane.normal) - plane.dist;
-            if (d < -ON_EPSILON)
-                continue;
-            k = (j + pass->numpoints - 1) % pass->numpoints;
-            d = DotProduct(pass->points[k], plane.normal) - plane.dist;
-            if (d < -ON_EPSILON)
-                continue;
-#endif
-            //
-            // flip the normal if we want the back side
-            //
-            if (flipclip) {
-                VectorSubtract(vec3_origin, plane.normal, plane.normal);
-                plane.dist = -plane.dist;
-            }
+    if (stack->numseparators[flipclip] == -2)
+        return ClipToSeperators(source, pass, target, flipclip, stack);
 
-            //
-            // clip target by the seperating plane
-            //
-            target = ChopWinding_flow(target, stack, &plane);
-            if (!target)
-                return NULL; // target is not visible
-        }
+    for (i = 0; i < stack->numseparators[flipclip]; i++) {
+        target = ChopWinding_flow(target, stack, &planes[i]);
+        if (!target)
+            return NULL; // target is not visible
     }
 
     return target;
 }
 
+static flowstack_t flowstacks[MAX_THREADS];
+
+static void SetFlowStackRow(threaddata_t *thread, pstack_t *s) {
+    flowstack_t *fs;
+
+    fs               = thread->flowstack;
+    s->mightsee      = fs->bits + (size_t)(s->depth - 1) * portalbytes;
+    s->separators[0] = fs->separators + (size_t)(s->depth - 1) * 2 * MAX_SEPARATORS;
+    s->separators[1] = s->separators[0] + MAX_SEPARATORS;
+}
+
+/*
+==================
+GrowFlowStack
+
+Makes room for the frame at depth and moves the frames already
+on the stack over to the new rows
+==================
+*/
+static void GrowFlowStack(threaddata_t *thread, int32_t depth) {
+    flowstack_t *fs;
+    pstack_t *s;
+
+    fs = thread->flowstack;
+    while (fs->depth < depth)
+        fs->depth = fs->depth ? fs->depth * 2 : 64;
+    fs->bits       = realloc(fs->bits, (size_t)fs->depth * portalbytes);
+    fs->separators = realloc(fs->separators, (size_t)fs->depth * 2 * MAX_SEPARATORS * sizeof(plane_t));
+    if (!fs->bits || !fs->separators)
+        Error("GrowFlowStack: out of memory at depth %i", depth);
+
+    for (s = thread->pstack_head.next; s; s = s->next)
+        SetFlowStackRow(thread, s);
+}
+
+/*
+==================
+FreeFlowStacks
+==================
+*/
+static void FreeFlowStack(flowstack_t *fs) {
+    free(fs->bits);
+    free(fs->separators);
+    fs->bits       = NULL;
+    fs->separators = NULL;
+    fs->depth      = 0;
+}
+
+void FreeFlowStacks(void) {
+    int32_t i;
+
+    for (i = 0; i < MAX_THREADS; i++)
+        FreeFlowStack(&flowstacks[i]);
+}
+
+static void WaitForPortal(portal_t *p, threaddata_t *thread);
+
 /*
 ==================
 RecursiveLeafFlow
@@ -349,14 +370,27 @@ If src_portal is NULL, this is the originating leaf
 void RecursiveLeafFlow(int32_t leafnum, threaddata_t *thread, pstack_t *prevstack) {
     pstack_t stack;
     portal_t *p;
+    portalhot_t *ph, *base;
     plane_t backplane;
     leaf_t *leaf;
-    int32_t i, j;
-    long *test, *might, *vis, more;
+    int32_t i;
+    byte *test;
     int32_t pnum;
 
+    if (thread->overbudget)
+        return; // unwinding, FlowPortal throws the rest away
+
     thread->c_chains++;
 
+    // check the clock every so often, it's not free
+    if ((vischains && thread->c_chains > vischains) ||
+        (vistime > 0 && !(thread->c_chains & 1023) && I_FloatTime() - thread->starttime > vistime)) {
+        thread->overbudget = true;
+        return;
+    }
+    if (visshard && !(thread->c_chains & 1023))
+        ShardHeartbeat();
+
     leaf            = &leafs[leafnum];
     //	CheckStack (leaf, thread);
 
@@ -365,41 +399,50 @@ void RecursiveLeafFlow(int32_t leafnum, threaddata_t *thread, pstack_t *prevstac
     stack.next      = NULL;
     stack.leaf      = leaf;
     stack.portal    = NULL;
+    stack.depth     = prevstack->depth + 1;
 
-    might           = (long *)stack.mightsee;
-    vis             = (long *)thread->base->portalvis;
+    // qb: mightsee is sized to the map, not MAX_PORTALS_QBSP, and lives off the C stack
+    if (stack.depth > thread->flowstack->depth)
+        GrowFlowStack(thread, stack.depth);
+    SetFlowStackRow(thread, &stack);
+    stack.numseparators[0] = stack.numseparators[1] = -1;
+
+    base                   = &portalhot[thread->base - portals];
 
     // check all portals for flowing into other leafs
     for (i = 0; i < leaf->numportals; i++) {
-        p    = leaf->portals[i];
-        pnum = p - portals;
+        pnum = leafportals[leaf->firstportal + i];
 
         if (!(prevstack->mightsee[pnum >> 3] & (1 << (pnum & 7)))) {
             continue; // can't possibly see it
         }
 
+        p  = &portals[pnum];
+        ph = &portalhot[pnum];
+
+        // a single full vis has every portal sorted before this one done
+        if (keeporder && p->sortrank < thread->base->sortrank && p->status != stat_done)
+            WaitForPortal(p, thread);
+
         // if the portal can't see anything we haven't allready seen, skip it
-        if (p->status == stat_done) {
-            test = (long *)p->portalvis;
+        // a portal from the -incremental cache or another shard only helps
+        // the ones a full vis would have done after it, so the answer is the same
+        if (p->status == stat_done && (p->sortrank < thread->base->sortrank || !(p->cached || keeporder))) {
+            test = p->portalvis;
         } else {
-            test = (long *)p->portalflood;
-        }
-
-        more = 0;
-        for (j = 0; j < portallongs; j++) {
-            might[j] = ((long *)prevstack->mightsee)[j] & test[j];
-            more |= (might[j] & ~vis[j]);
+            test = p->portalflood;
         }
 
-        if (!more &&
+        // stack.mightsee is read again here, a deeper frame may have moved the stack
+        if (!AndBits(stack.mightsee, prevstack->mightsee, test, thread->base->portalvis, portalbytes) &&
             (thread->base->portalvis[pnum >> 3] & (1 << (pnum & 7)))) { // can't see anything new
             continue;
         }
 
         // get plane of portal, point normal into the neighbor leaf
-        stack.portalplane = p->plane;
-        VectorSubtract(vec3_origin, p->plane.normal, backplane.normal);
-        backplane.dist        = -p->plane.dist;
+        stack.portalplane = ph->plane;
+        VectorSubtract(vec3_origin, ph->plane.normal, backplane.normal);
+        backplane.dist        = -ph->plane.dist;
 
         //		c_portalcheck++;
 
@@ -413,11 +456,11 @@ void RecursiveLeafFlow(int32_t leafnum, threaddata_t *thread, pstack_t *prevstac
         {
             float d;
 
-            d = DotProduct(p->origin, thread->pstack_head.portalplane.normal);
+            d = DotProduct(ph->origin, thread->pstack_head.portalplane.normal);
             d -= thread->pstack_head.portalplane.dist;
-            if (d < -p->radius) {
+            if (d < -ph->radius) {
                 continue;
-            } else if (d > p->radius) {
+            } else if (d > ph->radius) {
                 stack.pass = p->winding;
             } else {
                 stack.pass = ChopWinding_flow(p->winding, &stack, &thread->pstack_head.portalplane);
@@ -435,14 +478,14 @@ void RecursiveLeafFlow(int32_t leafnum, threaddata_t *thread, pstack_t *prevstac
         {
             float d;
 
-            d = DotProduct(thread->base->origin, p->plane.normal);
-            d -= p->plane.dist;
+            d = DotProduct(base->origin, ph->plane.normal);
+            d -= ph->plane.dist;
             //	if (d > p->radius) qb: GDD tools fix
-            if (d > thread->base->radius) {
+            if (d > base->radius) {
                 continue;
             }
             //	else if (d < -p->radius)
-            else if (d < -thread->base->radius) {
+            else if (d < -base->radius) {
                 stack.source = prevstack->source;
             } else {
                 stack.source = ChopWinding_flow(prevstack->source, &stack, &backplane);
@@ -461,62 +504,139 @@ void RecursiveLeafFlow(int32_t leafnum, threaddata_t *thread, pstack_t *prevstac
             // mark the portal as visible
             thread->base->portalvis[pnum >> 3] |= (1 << (pnum & 7));
 
-            RecursiveLeafFlow(p->leaf, thread, &stack);
+            RecursiveLeafFlow(ph->leaf, thread, &stack);
+            if (thread->overbudget)
+                return;
             continue;
         }
 
-        stack.pass = ClipToSeperators(stack.source, prevstack->pass, stack.pass, false, &stack);
-        if (!stack.pass)
-            continue;
+        // the source is only cut by some of the portals, the separators
+        // of an uncut one can be kept for the rest of the leaf
+        if (stack.source == prevstack->source) {
+            stack.pass = ClipToCachedSeperators(stack.source, prevstack->pass, stack.pass, false, &stack);
+            if (!stack.pass)
+                continue;
 
-        stack.pass = ClipToSeperators(prevstack->pass, stack.source, stack.pass, true, &stack);
-        if (!stack.pass)
-            continue;
+            stack.pass = ClipToCachedSeperators(prevstack->pass, stack.source, stack.pass, true, &stack);
+            if (!stack.pass)
+                continue;
+        } else {
+            stack.pass = ClipToSeperators(stack.source, prevstack->pass, stack.pass, false, &stack);
+            if (!stack.pass)
+                continue;
+
+            stack.pass = ClipToSeperators(prevstack->pass, stack.source, stack.pass, true, &stack);
+            if (!stack.pass)
+                continue;
+        }
 
         // mark the portal as visible
         thread->base->portalvis[pnum >> 3] |= (1 << (pnum & 7));
 
         // flow through it for real
-        RecursiveLeafFlow(p->leaf, thread, &stack);
+        RecursiveLeafFlow(ph->leaf, thread, &stack);
+        if (thread->overbudget)
+            return;
     }
 }
 
 /*
 ===============
-PortalFlow
+FlowPortal
 
-generates the portalvis bit vector
+generates the portalvis bit vector, with the frames of flowstack
 ===============
 */
-void PortalFlow(int32_t portalnum) {
+static void FlowPortal(portal_t *p, flowstack_t *flowstack) {
     threaddata_t data;
-    int32_t i;
-    portal_t *p;
     int32_t c_might, c_can;
-
-    p         = sorted_portals[portalnum];
-    p->status = stat_working;
-
-    c_might   = CountBits(p->portalflood, numportals * 2);
+    double seconds;
 
     memset(&data, 0, sizeof(data));
     data.base                    = p;
 
     data.pstack_head.portal      = p;
     data.pstack_head.source      = p->winding;
-    data.pstack_head.portalplane = p->plane;
-    for (i = 0; i < portallongs; i++)
-        ((long *)data.pstack_head.mightsee)[i] = ((long *)p->portalflood)[i];
-    RecursiveLeafFlow(p->leaf, &data, &data.pstack_head);
+    data.pstack_head.portalplane = portalhot[p - portals].plane;
+    data.pstack_head.mightsee    = p->portalflood;
+    data.flowstack               = flowstack;
+    if (vistime > 0 || visprofile)
+        data.starttime = I_FloatTime();
+
+    c_might = CountBits(data.pstack_head.mightsee, numportals * 2);
+
+    RecursiveLeafFlow(portalhot[p - portals].leaf, &data, &data.pstack_head);
 
-    p->status = stat_done;
+    // out of time, everything the flood reaches is a safe answer
+    if (data.overbudget) {
+        memcpy(p->portalvis, data.pstack_head.mightsee, portalbytes);
+        p->overbudget = data.c_chains;
+    }
+
+    // the flow's own time, not the saves
+    if (visprofile)
+        seconds = I_FloatTime() - data.starttime;
 
-    c_can     = CountBits(p->portalvis, numportals * 2);
+    // flows waiting on p look at it under the lock
+    if (keeporder)
+        PublishPortal(p);
+    else
+        p->status = stat_done;
+    CheckpointPortal(p);
+
+    c_can = CountBits(p->portalvis, numportals * 2);
+    if (visprofile)
+        ProfilePortal(p, seconds, data.c_chains, c_might, c_can);
 
     qprintf("portal:%4i  mightsee:%4i  cansee:%4i (%i chains)\n",
             (int32_t)(p - portals), c_might, c_can, data.c_chains);
 }
 
+/*
+===============
+WaitForPortal
+
+-visshard and -vismerge keep the order of a single full vis, p is
+sorted before thread's portal and has to be done first.  The time
+spent waiting isn't thread's.
+===============
+*/
+static void WaitForPortal(portal_t *p, threaddata_t *thread) {
+    flowstack_t flowstack;
+    double start;
+
+    start = I_FloatTime();
+    if (PortalFromShards(p)) {
+        // its shard is gone, the frames in use can't be shared
+        memset(&flowstack, 0, sizeof(flowstack));
+        FlowPortal(p, &flowstack);
+        FreeFlowStack(&flowstack);
+    }
+    thread->starttime += I_FloatTime() - start;
+}
+
+/*
+===============
+PortalFlow
+
+generates the portalvis bit vector
+===============
+*/
+void PortalFlow(int32_t portalnum) {
+    portal_t *p;
+
+    // a -visshard shard leaves the rest to the other shards
+    if (visshard && portalnum % numshards != shardnum)
+        return;
+
+    p = sorted_portals[portalnum];
+    if (p->status == stat_done)
+        return; // from a -resume checkpoint or another shard
+
+    p->status = stat_working;
+    FlowPortal(p, &flowstacks[ThreadNum()]);
+}
+
 /*
 ===============================================================================
 
@@ -567,29 +687,226 @@ char test_leaf[MAX_MAP_LEAFS_QBSP];
 ==================
 SimpleFlood
 
+Every front portal that can be reached from leafnum through front
+portals goes in the flood.  A leaf only needs to be looked at once,
+so this runs off a queue of leafs instead of recursing per portal.
 ==================
 */
 void SimpleFlood(portal_t *srcportal, int32_t leafnum) {
     int32_t i;
     leaf_t *leaf;
-    portal_t *p;
-    int32_t pnum;
+    int32_t pnum, next;
+    int32_t *queue, head, tail;
+    byte *leafseen;
 
-    leaf = &leafs[leafnum];
+    queue    = malloc(portalclusters * sizeof(*queue));
+    leafseen = malloc(leafbytes);
+    memset(leafseen, 0, leafbytes);
 
-    for (i = 0; i < leaf->numportals; i++) {
-        p    = leaf->portals[i];
-        pnum = p - portals;
-        if (!(srcportal->portalfront[pnum >> 3] & (1 << (pnum & 7))))
-            continue;
+    head = tail   = 0;
+    queue[tail++] = leafnum;
+    leafseen[leafnum >> 3] |= (1 << (leafnum & 7));
 
-        if (srcportal->portalflood[pnum >> 3] & (1 << (pnum & 7)))
-            continue;
+    while (head < tail) {
+        leaf = &leafs[queue[head++]];
 
-        srcportal->portalflood[pnum >> 3] |= (1 << (pnum & 7));
+        for (i = 0; i < leaf->numportals; i++) {
+            pnum = leafportals[leaf->firstportal + i];
+            if (!(srcportal->portalfront[pnum >> 3] & (1 << (pnum & 7))))
+                continue;
 
-        SimpleFlood(srcportal, p->leaf);
+            srcportal->portalflood[pnum >> 3] |= (1 << (pnum & 7));
+
+            next = portalhot[pnum].leaf;
+            if (leafseen[next >> 3] & (1 << (next & 7)))
+                continue;
+            leafseen[next >> 3] |= (1 << (next & 7));
+            queue[tail++] = next;
+        }
     }
+
+    free(queue);
+    free(leafseen);
+}
+
+/*
+===============================================================================
+
+A tree of boxes around the portal spheres, so BasePortalVis only does the
+point tests on portals that can reach in front of its plane.
+
+===============================================================================
+*/
+
+// slack on the sphere tests, the point tests are done in float
+#define SPHERE_EPSILON 1.0
+#define PORTALS_ON_NODE 8
+
+typedef struct
+{
+    vec3_t mins, maxs;
+    int32_t children[2]; // node numbers, or -1 on a leaf
+    int32_t first, count; // range of spheres on a leaf
+} spherenode_t;
+
+// the portal spheres in tree order, so a leaf's are next to each other
+typedef struct
+{
+    vec3_t origin;
+    vec_t radius;
+    plane_t plane;
+    portal_t *portal;
+} sphere_t;
+
+static spherenode_t *spherenodes;
+static int32_t numspherenodes;
+static int32_t *sphereportals;
+static sphere_t *spheres;
+static int32_t sortaxis;
+
+static int32_t ComparePortalCenters(const void *a, const void *b) {
+    vec_t d;
+
+    d = portalhot[*(int32_t *)a].origin[sortaxis] - portalhot[*(int32_t *)b].origin[sortaxis];
+    if (d < 0)
+        return -1;
+    if (d > 0)
+        return 1;
+    return *(int32_t *)a - *(int32_t *)b;
+}
+
+static int32_t BuildSphereNode_r(int32_t first, int32_t count) {
+    spherenode_t *node;
+    portalhot_t *p;
+    vec3_t cmins, cmaxs;
+    int32_t i, j, nodenum, half;
+
+    nodenum = numspherenodes++;
+    node    = &spherenodes[nodenum];
+
+    ClearBounds(node->mins, node->maxs);
+    ClearBounds(cmins, cmaxs);
+    for (i = first; i < first + count; i++) {
+        p = &portalhot[sphereportals[i]];
+        for (j = 0; j < 3; j++) {
+            if (p->origin[j] - p->radius < node->mins[j])
+                node->mins[j] = p->origin[j] - p->radius;
+            if (p->origin[j] + p->radius > node->maxs[j])
+                node->maxs[j] = p->origin[j] + p->radius;
+        }
+        AddPointToBounds(p->origin, cmins, cmaxs);
+    }
+
+    if (count <= PORTALS_ON_NODE) {
+        node->children[0] = node->children[1] = -1;
+        node->first                           = first;
+        node->count                           = count;
+        return nodenum;
+    }
+
+    // split the centers in half along the longest side
+    sortaxis = 0;
+    for (j = 1; j < 3; j++)
+        if (cmaxs[j] - cmins[j] > cmaxs[sortaxis] - cmins[sortaxis])
+            sortaxis = j;
+    qsort(sphereportals + first, count, sizeof(int32_t), ComparePortalCenters);
+
+    half              = count / 2;
+    node->first       = node->count = 0;
+    node->children[0] = BuildSphereNode_r(first, half);
+    node->children[1] = BuildSphereNode_r(first + half, count - half);
+
+    return nodenum;
+}
+
+/*
+==================
+BuildPortalSphereTree
+==================
+*/
+void BuildPortalSphereTree(void) {
+    int32_t i, n;
+
+    n             = numportals * 2;
+    sphereportals = malloc(n * sizeof(*sphereportals));
+    // a leaf holds at least half of PORTALS_ON_NODE, so this is plenty
+    spherenodes   = malloc((n / (PORTALS_ON_NODE / 2) * 2 + 1) * sizeof(*spherenodes));
+    if (!sphereportals || !spherenodes)
+        Error("BuildPortalSphereTree: out of memory");
+
+    for (i = 0; i < n; i++)
+        sphereportals[i] = i;
+    numspherenodes = 0;
+    if (n)
+        BuildSphereNode_r(0, n);
+
+    spheres = malloc(n * sizeof(*spheres));
+    if (!spheres)
+        Error("BuildPortalSphereTree: out of memory");
+    for (i = 0; i < n; i++) {
+        VectorCopy(portalhot[sphereportals[i]].origin, spheres[i].origin);
+        spheres[i].radius = portalhot[sphereportals[i]].radius;
+        spheres[i].plane  = portalhot[sphereportals[i]].plane;
+        spheres[i].portal = &portals[sphereportals[i]];
+    }
+    free(sphereportals);
+    sphereportals = NULL;
+}
+
+/*
+==================
+FreePortalSphereTree
+==================
+*/
+void FreePortalSphereTree(void) {
+    free(spherenodes);
+    free(spheres);
+    spherenodes    = NULL;
+    spheres        = NULL;
+    numspherenodes = 0;
+}
+
+/*
+==================
+BasePortalTest
+
+Sets tp in the portalfront of p if a point of tp is in front of p
+and a point of p is behind tp.  The spheres already reach, infront
+and inback are set if they are all the way over.
+==================
+*/
+static void BasePortalTest(portal_t *p, portal_t *tp, qboolean infront, qboolean inback) {
+    int32_t j, k;
+    float d;
+    winding_t *w;
+    plane_t *plane;
+
+    if (!infront) {
+        w     = tp->winding;
+        plane = &portalhot[p - portals].plane;
+        for (k = 0; k < w->numpoints; k++) {
+            d = DotProduct(w->points[k], plane->normal) - plane->dist;
+            if (d > ON_EPSILON)
+                break;
+        }
+        if (k == w->numpoints)
+            return; // no points on front
+    }
+
+    if (!inback) {
+        w     = p->winding;
+        plane = &portalhot[tp - portals].plane;
+        for (k = 0; k < w->numpoints; k++) {
+            d = DotProduct(w->points[k], plane->normal) - plane->dist;
+            if (d < -ON_EPSILON)
+                break;
+        }
+        if (k == w->numpoints)
+            return; // no points on back
+    }
+
+    j = tp - portals;
+    p->portalfront[j >> 3] |= (1 << (j & 7));
 }
 
 /*
@@ -598,12 +915,16 @@ BasePortalVis
 ==============
 */
 void BasePortalVis(int32_t portalnum) {
-    int32_t j, k;
-    portal_t *tp, *p;
-    float d;
-    winding_t *w;
+    int32_t j;
+    portal_t *p;
+    portalhot_t *ph;
+    spherenode_t *node;
+    sphere_t *s, *end;
+    vec_t d, back;
+    int32_t stack[64], depth;
 
     p              = portals + portalnum;
+    ph             = portalhot + portalnum;
 
     p->portalfront = malloc(portalbytes);
     memset(p->portalfront, 0, portalbytes);
@@ -614,31 +935,45 @@ void BasePortalVis(int32_t portalnum) {
     p->portalvis = malloc(portalbytes);
     memset(p->portalvis, 0, portalbytes);
 
-    for (j = 0, tp = portals; j < numportals * 2; j++, tp++) {
-        if (j == portalnum)
-            continue;
-        w = tp->winding;
-        for (k = 0; k < w->numpoints; k++) {
-            d = DotProduct(w->points[k], p->plane.normal) - p->plane.dist;
-            if (d > ON_EPSILON)
-                break;
+    // skip every box that is all behind the plane
+    depth = 0;
+    if (numspherenodes)
+        stack[depth++] = 0;
+    while (depth) {
+        node = &spherenodes[stack[--depth]];
+
+        d    = -ph->plane.dist;
+        for (j = 0; j < 3; j++) {
+            if (ph->plane.normal[j] > 0)
+                d += ph->plane.normal[j] * node->maxs[j];
+            else
+                d += ph->plane.normal[j] * node->mins[j];
         }
-        if (k == w->numpoints)
-            continue; // no points on front
+        if (d < ON_EPSILON - SPHERE_EPSILON)
+            continue;
 
-        w = p->winding;
-        for (k = 0; k < w->numpoints; k++) {
-            d = DotProduct(w->points[k], tp->plane.normal) - tp->plane.dist;
-            if (d < -ON_EPSILON)
-                break;
+        if (node->children[0] == -1) {
+            // the spheres settle most pairs without looking at the points
+            end = spheres + node->first + node->count;
+            for (s = spheres + node->first; s < end; s++) {
+                d = DotProduct(s->origin, ph->plane.normal) - ph->plane.dist;
+                if (d + s->radius < ON_EPSILON - SPHERE_EPSILON || s->portal == p)
+                    continue; // no points on front
+                back = DotProduct(ph->origin, s->plane.normal) - s->plane.dist;
+                if (back - ph->radius > -ON_EPSILON + SPHERE_EPSILON)
+                    continue; // no points on back
+                BasePortalTest(p, s->portal, d - s->radius > ON_EPSILON + SPHERE_EPSILON,
+                               back + ph->radius < -ON_EPSILON - SPHERE_EPSILON);
+            }
+            continue;
         }
-        if (k == w->numpoints)
-            continue; // no points on front
-
-        p->portalfront[j >> 3] |= (1 << (j & 7));
+        if (depth + 2 > 64)
+            Error("BasePortalVis: sphere tree too deep");
+        stack[depth++] = node->children[0];
+        stack[depth++] = node->children[1];
     }
 
-    SimpleFlood(p, p->leaf);
+    SimpleFlood(p, ph->leaf);
 
     p->nummightsee = CountBits(p->portalflood, numportals * 2);
     //	printf ("portal %i: %i mightsee\n", portalnum, p->nummightsee);
@@ -666,8 +1001,7 @@ RecursiveLeafBitFlow
 void RecursiveLeafBitFlow(int32_t leafnum, byte *mightsee, byte *cansee) {
     portal_t *p;
     leaf_t *leaf;
-    int32_t i, j;
-    long more;
+    int32_t i;
     int32_t pnum;
     byte newmight[MAX_MAP_PORTALS_QBSP / 8];
 
@@ -675,26 +1009,20 @@ void RecursiveLeafBitFlow(int32_t leafnum, byte *mightsee, byte *cansee) {
 
     // check all portals for flowing into other leafs
     for (i = 0; i < leaf->numportals; i++) {
-        p    = leaf->portals[i];
-        pnum = p - portals;
+        pnum = leafportals[leaf->firstportal + i];
+        p    = &portals[pnum];
 
         // if some previous portal can't see it, skip
         if (!(mightsee[pnum >> 3] & (1 << (pnum & 7))))
             continue;
 
         // if this portal can see some portals we mightsee, recurse
-        more = 0;
-        for (j = 0; j < portallongs; j++) {
-            ((long *)newmight)[j] = ((long *)mightsee)[j] & ((long *)p->portalflood)[j];
-            more |= ((long *)newmight)[j] & ~((long *)cansee)[j];
-        }
-
-        if (!more)
+        if (!AndBits(newmight, mightsee, p->portalflood, cansee, portalbytes))
             continue; // can't see anything new
 
         cansee[pnum >> 3] |= (1 << (pnum & 7));
 
-        RecursiveLeafBitFlow(p->leaf, newmight, cansee);
+        RecursiveLeafBitFlow(portalhot[pnum].leaf, newmight, cansee);
     }
 }
 
@@ -708,7 +1036,7 @@ void BetterPortalVis(int32_t portalnum) {
 
     p = portals + portalnum;
 
-    RecursiveLeafBitFlow(p->leaf, p->portalflood, p->portalvis);
+    RecursiveLeafBitFlow(portalhot[portalnum].leaf, p->portalflood, p->portalvis);
 
     // build leaf vis information
     p->nummightsee = CountBits(p->portalvis, numportals * 2);
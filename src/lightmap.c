@@ -37,12 +37,12 @@ typedef struct
     vec3_t vertex_normal[2];
 } edgeshare_t;
 
-edgeshare_t edgeshare[MAX_MAP_EDGES_QBSP];
+edgeshare_t *edgeshare;
 
-int32_t facelinks[MAX_MAP_FACES_QBSP];
-int32_t planelinks[2][MAX_MAP_PLANES_QBSP];
+int32_t *facelinks;
+int32_t *planelinks[2];
 int32_t maxdata = DEFAULT_MAP_LIGHTING, step = LMSTEP;
-vec3_t face_texnormals[MAX_MAP_FACES_QBSP];
+vec3_t *face_texnormals;
 float sunradscale = 0.5;
 byte *dlightdata_ptr;
 
@@ -53,7 +53,7 @@ typedef struct face_extents_s {
     vec_t st_mins[2], st_maxs[2];
 } face_extents_t;
 
-static face_extents_t face_extents[MAX_MAP_FACES_QBSP];
+static face_extents_t *face_extents;
 
 const dplane_t *getPlaneFromFaceNumber(const uint32_t faceNumber) {
     if (use_qbsp) {
@@ -94,6 +94,8 @@ void BuildFaceExtents(void) {
     const dvertex_t *v;
     int32_t i, j, k;
 
+    face_extents = AllocRadArray(face_extents, numfaces, sizeof(face_extents[0]));
+
     if (use_qbsp)
         for (k = 0; k < numfaces; k++) {
 
@@ -233,6 +235,10 @@ LinkPlaneFaces
 void LinkPlaneFaces(void) {
     int32_t i;
 
+    facelinks     = AllocRadArray(facelinks, numfaces, sizeof(facelinks[0]));
+    planelinks[0] = AllocRadArray(planelinks[0], numplanes, sizeof(planelinks[0][0]));
+    planelinks[1] = AllocRadArray(planelinks[1], numplanes, sizeof(planelinks[1][0]));
+
     if (use_qbsp) {
         dface_tx *f;
         f = dfacesX;
@@ -360,7 +366,7 @@ int32_t AddFaceForVertexNormalX(const int32_t edgeabs, int32_t edgeabsnext, cons
 
 int32_t AddFaceForVertexNormal(const int32_t edgeabs, int32_t edgeabsnext, const int32_t edgeend, int32_t edgeendnext, dface_t *const f, dface_t *fnext, vec_t angle, vec3_t normal) {
     VectorCopy(getPlaneFromFace(f)->normal, normal);
-    int32_t vnum = dedgesX[edgeabs].v[edgeend];
+    int32_t vnum = dedges[edgeabs].v[edgeend];
     int32_t edge = 0, edgenext = 0;
     int32_t i, e, count1, count2;
     vec_t dot;
@@ -430,7 +436,8 @@ void PairEdges() {
     int32_t i, j, k;
     edgeshare_t *e;
 
-    memset(&edgeshare, 0, sizeof(edgeshare));
+    edgeshare       = AllocRadArray(edgeshare, numedges, sizeof(edgeshare[0]));
+    face_texnormals = AllocRadArray(face_texnormals, numfaces, sizeof(face_texnormals[0]));
 
     if (use_qbsp) {
         dface_tx *f;
@@ -585,13 +592,9 @@ void PairEdges() {
         vec_t angle = 0, angles = 0;
         vec3_t normal, normals;
         vec3_t edgenormal;
-        int32_t r, count, mme;
-        if (use_qbsp)
-            mme = MAX_MAP_EDGES_QBSP;
-        else
-            mme = MAX_MAP_EDGES;
+        int32_t r, count;
 
-        for (edgeabs = 0; edgeabs < mme; edgeabs++) {
+        for (edgeabs = 0; edgeabs < numedges; edgeabs++) {
             e = &edgeshare[edgeabs];
             if (!e->smooth)
                 continue;
@@ -1091,7 +1094,6 @@ typedef struct
     vec3_t facenormal;
 
     int32_t numsurfpt;
-    vec3_t surfpt[QBSP_SINGLEMAP];
 
     vec3_t modelorg; // for origined bmodels
 
@@ -1105,6 +1107,8 @@ typedef struct
     int32_t surfnum;
     dface_t *face;
     dface_tx *faceX;
+
+    vec3_t surfpt[QBSP_SINGLEMAP]; // last so it isn't cleared, CalcPoints fills numsurfpt of them
 } lightinfo_t;
 
 /*
@@ -1292,11 +1296,11 @@ void CalcFaceVectors(lightinfo_t *l) {
 =================
 CalcPoints
 
-For each texture aligned grid point, back project onto the plane
-to get the world xyz value of the sample point
+For each texture aligned grid point in rows firstrow..endrow-1, back
+project onto the plane to get the world xyz value of the sample point
 =================
 */
-void CalcPoints(lightinfo_t *l, float sofs, float tofs) {
+void CalcPoints(lightinfo_t *l, float sofs, float tofs, int32_t firstrow, int32_t endrow) {
     int32_t i;
     int32_t s, t, j;
     int32_t w, h;
@@ -1305,7 +1309,6 @@ void CalcPoints(lightinfo_t *l, float sofs, float tofs) {
     vec_t mids, midt;
     vec3_t facemid;
 
-    surf = l->surfpt[0];
     mids = (l->exactmaxs[0] + l->exactmins[0]) / 2;
     midt = (l->exactmaxs[1] + l->exactmins[1]) / 2;
 
@@ -1319,7 +1322,8 @@ void CalcPoints(lightinfo_t *l, float sofs, float tofs) {
     starts       = l->texmins[0] * step;
     startt       = l->texmins[1] * step;
 
-    for (t = 0; t < h; t++) {
+    surf         = l->surfpt[firstrow * w];
+    for (t = firstrow; t < endrow; t++) {
         for (s = 0; s < w; s++, surf += 3) {
             us = starts + (s + sofs) * step;
             ut = startt + (t + tofs) * step;
@@ -1375,20 +1379,37 @@ void CalcPoints(lightinfo_t *l, float sofs, float tofs) {
 
 //==============================================================
 
-#define MAX_STYLES 32
-typedef struct
-{
-    int32_t numsamples;
-    float *origins;
-    int32_t numstyles;
-    int32_t stylenums[MAX_STYLES];
-    float *samples[MAX_STYLES];
-} facelight_t;
-
-directlight_t *directlights[MAX_MAP_LEAFS_QBSP];
-facelight_t facelight[MAX_MAP_FACES_QBSP];
+directlight_t **directlights;
+facelight_t *facelight;
 int32_t numdlights;
 
+/*
+=============
+AllocFacelights
+=============
+*/
+void AllocFacelights(void) {
+    facelight = AllocRadArray(facelight, numfaces, sizeof(facelight[0]));
+}
+
+/*
+=============
+ReserveLightData
+
+Sizes dlightdata for the facelights before FinalLightFace
+hands out offsets into it from the threads.
+=============
+*/
+void ReserveLightData(void) {
+    int32_t i, total = 0;
+
+    for (i = 0; i < numfaces; i++)
+        total += facelight[i].numstyles * (facelight[i].numsamples * 3);
+
+    ReserveLump(dlightdata, total);
+    dlightdata_ptr = dlightdata;
+}
+
 /*
 ==================
 FindTargetEntity
@@ -1432,6 +1453,8 @@ void CreateDirectLights(void) {
     char *sun_target = NULL;
     char *proc_num;
 
+    directlights = AllocRadArray(directlights, numleafs, sizeof(directlights[0]));
+
     //
     // entities
     //
@@ -1517,8 +1540,10 @@ void CreateDirectLights(void) {
             cluster = leaf->cluster;
         }
 
-        dl->next              = directlights[cluster];
-        directlights[cluster] = dl;
+        if (cluster >= 0) { // in solid, no cluster would ever reach it
+            dl->next              = directlights[cluster];
+            directlights[cluster] = dl;
+        }
 
         proc_num              = ValueForKey(e, "_wait");
         if (strlen(proc_num) > 0)
@@ -1622,8 +1647,10 @@ void CreateDirectLights(void) {
             cluster  = leaf->cluster;
             dl->leaf = leaf;
         }
-        dl->next              = directlights[cluster];
-        directlights[cluster] = dl;
+        if (cluster >= 0) { // in solid, no cluster would ever reach it
+            dl->next              = directlights[cluster];
+            directlights[cluster] = dl;
+        }
 
         VectorCopy(p->plane->normal, dl->normal);
 
@@ -1709,9 +1736,12 @@ re_test:
 /*
 =============
 LightContributionToPoint
+
+Returns how bright the light would have been if something
+weren't in the way of it, 0 if nothing is
 =============
 */
-static void LightContributionToPoint(directlight_t *l, vec3_t pos, int32_t nodenum,
+static float LightContributionToPoint(directlight_t *l, vec3_t pos, int32_t nodenum,
                                      vec3_t normal, vec3_t color,
                                      float lightscale2,
                                      qboolean *sun_main_once,
@@ -1723,22 +1753,23 @@ static void LightContributionToPoint(directlight_t *l, vec3_t pos, int32_t noden
     float main_val;
     int32_t i;
     int32_t lcn;
-    qboolean set_main;
+    qboolean set_main, occluder;
+    float blocked;
 
     VectorClear(color);
+    blocked = 0.0f;
 
     VectorSubtract(l->origin, pos, delta);
     dist = VectorNormalize(delta, delta);
     dot  = DotProduct(delta, normal);
 
     if ((l->type != emit_sky) && (dot <= EQUAL_EPSILON)) // qb: nothing is behind light surface of sky
-        return;                                          // behind sample surface
+        return 0.0f;                                     // behind sample surface
 
-    lcn = lowestCommonNode(nodenum, l->nodenum);
-    if (!noblock && TestLine_color(lcn, pos, l->origin, occluded))
-        return; // occluded
+    lcn      = lowestCommonNode(nodenum, l->nodenum);
+    occluder = l->type == emit_sky && !noblock && TestLine_color(lcn, pos, l->origin, occluded);
 
-    if (l->type == emit_sky) {
+    if (l->type == emit_sky && !occluder) {
         // this might be the sun ambient and it might be directional
         set_main = false;
         dot2     = -DotProduct(delta, l->normal);
@@ -1760,6 +1791,9 @@ static void LightContributionToPoint(directlight_t *l, vec3_t pos, int32_t noden
                     if (!RayPlaneIntersect(
                             l->plane->normal, l->plane->dist, pos, sun_pos, target) ||
                         TestLine_color(0, pos, target, occluded)) {
+                        blocked  = main_val * MAX(MAX(l->color[0], l->color[1]), l->color[2]);
+                        if (sun_alt_color)
+                            blocked = main_val * MAX(MAX(sun_color[0], sun_color[1]), sun_color[2]);
                         set_main = *sun_main_once;
                         main_val = 0.0f;
                     } else {
@@ -1820,7 +1854,7 @@ static void LightContributionToPoint(directlight_t *l, vec3_t pos, int32_t noden
         case emit_surface:
             dot2 = -DotProduct(delta, l->normal);
             if (dot2 <= EQUAL_EPSILON)
-                return; // behind light surface
+                return 0.0f; // behind light surface
 
             if (!noedgefix) {
                 if (use_qbsp) {    // qb: 4x lightmap res
@@ -1847,7 +1881,7 @@ static void LightContributionToPoint(directlight_t *l, vec3_t pos, int32_t noden
             // linear falloff
             dot2 = -DotProduct(delta, l->normal);
             if (dot2 <= l->stopdot)
-                return; // outside light cone
+                return 0.0f; // outside light cone
             scale = (l->intensity - l->wait * dist) * dot * powf(dot2, 25.0f) * 15;
             // spot center to surface point attenuation
             // dot2 range is limited, so exponent is big.
@@ -1863,12 +1897,85 @@ static void LightContributionToPoint(directlight_t *l, vec3_t pos, int32_t noden
     if (scale > 0.0f) {
         scale *= lightscale2;                       // adjust for multisamples, -extra cmd line arg
         VectorScale(l->color, scale * 0.25, color); // qb: scale hack for intensity similar to original rad
+    } else if (l->type != emit_sky)
+        return 0.0f;
+
+    // the other lights only need the trace if they reach this far
+    if (l->type != emit_sky)
+        occluder = !noblock && TestLine_color(lcn, pos, l->origin, occluded);
+    if (occluder) {
+        blocked = MAX(MAX(color[0], color[1]), color[2]);
+        VectorClear(color);
+        return blocked; // occluded
     }
 
     for (i = 0; i < 3; i++) {
         color[i] += colorsky[i];
         color[i] *= occluded[i];
     }
+
+    return blocked;
+}
+
+/*
+=============
+SampleLights
+
+The samples of a face nearly all land in one or two clusters, so the
+lights a cluster can see are listed once and kept in the cache for as
+long as the samples stay in that cluster.  The clusters it looks in are
+or'ed into reach, if there is one.  False if pos is in solid.
+=============
+*/
+typedef struct
+{
+    int32_t cluster; // the lights are for this cluster, -2 for none yet
+    int32_t numlights, maxlights;
+    directlight_t **lights;
+} lightcache_t;
+
+static qboolean SampleLights(lightcache_t *cache, vec3_t pos, byte *reach, int32_t *nodenum) {
+    int32_t i, leafnum, cluster;
+    directlight_t *l;
+    byte pvs[(MAX_MAP_LEAFS_QBSP + 7) / 8];
+
+    leafnum = PointInLeafnum(pos);
+    if (use_qbsp)
+        cluster = dleafsX[leafnum].cluster;
+    else
+        cluster = dleafs[leafnum].cluster;
+    if (!visdatasize)
+        cluster = -1; // every sample sees all of it
+    else if (cluster == -1)
+        return false; // in solid leaf
+    *nodenum = leafparents[leafnum]; // same as PointInNodenum
+
+    if (cluster == cache->cluster)
+        return true;
+
+    // get the PVS for the pos to limit the number of checks
+    PvsForOrigin(pos, pvs);
+
+    if (reach)
+        for (i = 0; i < (dvis->numclusters + 7) >> 3; i++)
+            reach[i] |= pvs[i];
+
+    cache->cluster   = cluster;
+    cache->numlights = 0;
+    for (i = 0; i < dvis->numclusters; i++) {
+        if (!(pvs[i >> 3] & (1 << (i & 7))))
+            continue;
+
+        for (l = directlights[i]; l; l = l->next) {
+            if (cache->numlights == cache->maxlights) {
+                cache->maxlights = cache->maxlights ? cache->maxlights * 2 : 64;
+                cache->lights    = realloc(cache->lights, cache->maxlights * sizeof(*cache->lights));
+            }
+            cache->lights[cache->numlights++] = l;
+        }
+    }
+
+    return true;
 }
 
 /*
@@ -1876,48 +1983,199 @@ static void LightContributionToPoint(directlight_t *l, vec3_t pos, int32_t noden
 GatherSampleLight
 
 Lightscale2 is the normalizer for multisampling, -extra cmd line arg
+SampleLights has the lights for pos in the cache, and the lights blocked
+by more than adaptive_threshold are hashed into shadows
 =============
 */
 
 void GatherSampleLight(vec3_t pos, vec3_t normal,
                        float **styletable, int32_t offset, int32_t mapsize, float lightscale2,
-                       qboolean *sun_main_once, qboolean *sun_ambient_once, byte *pvs) {
+                       qboolean *sun_main_once, qboolean *sun_ambient_once, lightcache_t *cache,
+                       int32_t nodenum, uint32_t *shadows) {
     int32_t i;
     directlight_t *l;
     float *dest;
     vec3_t color;
-    int32_t nodenum;
 
-    // get the PVS for the pos to limit the number of checks
-    if (!PvsForOrigin(pos, pvs)) {
-        return;
-    }
-    nodenum = PointInNodenum(pos);
+    for (i = 0; i < cache->numlights; i++) {
+        l = cache->lights[i];
+        if (LightContributionToPoint(l, pos, nodenum, normal, color, lightscale2,
+                                     sun_main_once, sun_ambient_once) > adaptive_threshold &&
+            shadows)
+            *shadows = (*shadows ^ (uint32_t)(size_t)l) * 0x01000193;
 
-    for (i = 0; i < dvis->numclusters; i++) {
-        if (!(pvs[i >> 3] & (1 << (i & 7))))
+        // no contribution
+        if (VectorCompare(color, vec3_origin))
             continue;
 
-        for (l = directlights[i]; l; l = l->next) {
-            LightContributionToPoint(l, pos, nodenum, normal, color, lightscale2,
-                                     sun_main_once, sun_ambient_once);
+        // if this style doesn't have a table yet, allocate one
+        if (!styletable[l->style]) {
+            styletable[l->style] = malloc(mapsize);
+            memset(styletable[l->style], 0, mapsize);
+        }
 
-            // no contribution
-            if (VectorCompare(color, vec3_origin))
-                continue;
+        dest = styletable[l->style] + offset;
+        dest[0] += color[0];
+        dest[1] += color[1];
+        dest[2] += color[2];
+    }
+}
+
+/*
+=============
+Patch grid
+
+The patches of a face are binned on a grid over the two axes that
+lie along its plane, with their bounds worked out once, so a sample
+only tests the few patches of its own cell.  The light is summed in
+the grid and handed to the patches when the face is done.
+=============
+*/
+#define PATCHGRID_MAX 64 // cells on a side
+
+typedef struct
+{
+    int32_t numpatches;
+    patch_t **patches;
+    vec3_t *mins, *maxs;
+    vec3_t *samplelight;
+    int32_t *samples;
+    int32_t axis[2];
+    int32_t size[2];
+    float origin[2], cellsize[2];
+    int32_t *cellstart; // size[0] * size[1] + 1, into celllist
+    int32_t *celllist;
+} patchgrid_t;
+
+/*
+=============
+PatchGridCell
+=============
+*/
+static inline int32_t PatchGridCell(patchgrid_t *grid, int32_t k, float v) {
+    int32_t c;
+
+    c = (int32_t)floor((v - grid->origin[k]) / grid->cellsize[k]);
+    if (c < 0)
+        return 0;
+    if (c >= grid->size[k])
+        return grid->size[k] - 1;
+    return c;
+}
+
+/*
+=============
+MakePatchGrid
+=============
+*/
+static void MakePatchGrid(patchgrid_t *grid, int32_t facenum) {
+    patch_t *patch;
+    vec3_t normal;
+    float lo[2], hi[2];
+    int32_t i, j, k, x, y, n, lx[2], hx[2];
+
+    memset(grid, 0, sizeof(*grid));
+    for (patch = face_patches[facenum]; patch; patch = patch->next)
+        grid->numpatches++;
+
+    grid->patches     = malloc(grid->numpatches * sizeof(*grid->patches));
+    grid->mins        = malloc(grid->numpatches * sizeof(vec3_t));
+    grid->maxs        = malloc(grid->numpatches * sizeof(vec3_t));
+    grid->samplelight = malloc(grid->numpatches * sizeof(vec3_t));
+    grid->samples     = malloc(grid->numpatches * sizeof(int32_t));
+    memset(grid->samplelight, 0, grid->numpatches * sizeof(vec3_t));
+    memset(grid->samples, 0, grid->numpatches * sizeof(int32_t));
+
+    // the grid axes are the two the plane is least tilted from
+    VectorCopy(face_patches[facenum]->plane->normal, normal);
+    j = 0;
+    for (i = 1; i < 3; i++)
+        if (fabs(normal[i]) > fabs(normal[j]))
+            j = i;
+    grid->axis[0] = (j + 1) % 3;
+    grid->axis[1] = (j + 2) % 3;
+
+    for (i = 0, patch = face_patches[facenum]; patch; i++, patch = patch->next) {
+        grid->patches[i] = patch;
+        WindingBounds(patch->winding, grid->mins[i], grid->maxs[i]);
+        for (k = 0; k < 2; k++) {
+            if (!i || grid->mins[i][grid->axis[k]] < lo[k])
+                lo[k] = grid->mins[i][grid->axis[k]];
+            if (!i || grid->maxs[i][grid->axis[k]] > hi[k])
+                hi[k] = grid->maxs[i][grid->axis[k]];
+        }
+    }
+
+    // patches are about subdiv across, so aim for one a cell
+    for (k = 0; k < 2; k++) {
+        lo[k] -= step + 1;
+        hi[k] += step + 1;
+        grid->size[k] = (int32_t)ceil((hi[k] - lo[k]) / subdiv);
+        if (grid->size[k] < 1)
+            grid->size[k] = 1;
+        if (grid->size[k] > PATCHGRID_MAX)
+            grid->size[k] = PATCHGRID_MAX;
+        grid->origin[k]   = lo[k];
+        grid->cellsize[k] = (hi[k] - lo[k]) / grid->size[k];
+    }
 
-            // if this style doesn't have a table yet, allocate one
-            if (!styletable[l->style]) {
-                styletable[l->style] = malloc(mapsize);
-                memset(styletable[l->style], 0, mapsize);
+    // count the patches touching each cell, then fill in
+    n               = grid->size[0] * grid->size[1];
+    grid->cellstart = malloc((n + 1) * sizeof(int32_t));
+    memset(grid->cellstart, 0, (n + 1) * sizeof(int32_t));
+    for (j = 0; j < 2; j++) {
+        for (i = 0; i < grid->numpatches; i++) {
+            for (k = 0; k < 2; k++) {
+                lx[k] = PatchGridCell(grid, k, grid->mins[i][grid->axis[k]] - step - 1);
+                hx[k] = PatchGridCell(grid, k, grid->maxs[i][grid->axis[k]] + step + 1);
             }
+            for (y = lx[1]; y <= hx[1]; y++)
+                for (x = lx[0]; x <= hx[0]; x++) {
+                    if (j)
+                        grid->celllist[grid->cellstart[y * grid->size[0] + x]++] = i;
+                    else
+                        grid->cellstart[y * grid->size[0] + x + 1]++;
+                }
+        }
+        if (!j) {
+            for (i = 0; i < n; i++)
+                grid->cellstart[i + 1] += grid->cellstart[i];
+            grid->celllist = malloc(grid->cellstart[n] * sizeof(int32_t));
+        }
+    }
+    // the fill moved each start up to the next one
+    for (i = n; i > 0; i--)
+        grid->cellstart[i] = grid->cellstart[i - 1];
+    grid->cellstart[0] = 0;
+}
+
+/*
+=============
+FreePatchGrid
+
+Averages the summed light into the patches
+=============
+*/
+static void FreePatchGrid(patchgrid_t *grid) {
+    patch_t *patch;
+    int32_t i;
 
-            dest = styletable[l->style] + offset;
-            dest[0] += color[0];
-            dest[1] += color[1];
-            dest[2] += color[2];
+    for (i = 0; i < grid->numpatches; i++) {
+        patch          = grid->patches[i];
+        patch->samples = grid->samples[i];
+        VectorCopy(grid->samplelight[i], patch->samplelight);
+        if (patch->samples) {
+            VectorScale(patch->samplelight, 1.0 / patch->samples, patch->samplelight);
         }
     }
+
+    free(grid->patches);
+    free(grid->mins);
+    free(grid->maxs);
+    free(grid->samplelight);
+    free(grid->samples);
+    free(grid->cellstart);
+    free(grid->celllist);
 }
 
 /*
@@ -1934,29 +2192,26 @@ doesn't generate extra light.
 =============
 */
 
-void AddSampleToPatch(vec3_t pos, vec3_t color, int32_t facenum) {
-    patch_t *patch;
-    vec3_t mins, maxs;
-    int32_t i;
+static void AddSampleToPatch(patchgrid_t *grid, vec3_t pos, vec3_t color) {
+    int32_t i, j, n, cell;
 
-    if (numbounce == 0)
-        return;
     if (color[0] + color[1] + color[2] < 1.0) // qb: was 3
         return;
 
-    for (patch = face_patches[facenum]; patch; patch = patch->next) {
+    cell = PatchGridCell(grid, 1, pos[grid->axis[1]]) * grid->size[0] + PatchGridCell(grid, 0, pos[grid->axis[0]]);
+    for (j = grid->cellstart[cell]; j < grid->cellstart[cell + 1]; j++) {
+        n = grid->celllist[j];
         // see if the point is in this patch (roughly)
-        WindingBounds(patch->winding, mins, maxs);
         for (i = 0; i < 3; i++) {
-            if (mins[i] > pos[i] + step)
+            if (grid->mins[n][i] > pos[i] + step)
                 goto nextpatch;
-            if (maxs[i] < pos[i] - step)
+            if (grid->maxs[n][i] < pos[i] - step)
                 goto nextpatch;
         }
 
         // add the sample to the patch
-        patch->samples++;
-        VectorAdd(patch->samplelight, color, patch->samplelight);
+        grid->samples[n]++;
+        VectorAdd(grid->samplelight[n], color, grid->samplelight[n]);
     nextpatch:;
     }
 }
@@ -2144,11 +2399,10 @@ void GetPhongNormal(int32_t facenum, vec3_t spot, vec3_t phongnormal) {
 
 /**
  * @brief Move the incoming sample position towards the surface center and along the
- * surface normal to reduce false-positive traces. Test the PVS at the new
- * position, returning true if the new point is valid, false otherwise.
+ * surface normal to reduce false-positive traces.
  */
-static qboolean NudgeSamplePosition(const vec3_t in, const vec3_t normal, const vec3_t center,
-                                    vec3_t out, byte *pvs) {
+static void NudgeSamplePosition(const vec3_t in, const vec3_t normal, const vec3_t center,
+                                vec3_t out) {
     vec3_t dir;
 
     VectorCopy(in, out);
@@ -2159,8 +2413,6 @@ static qboolean NudgeSamplePosition(const vec3_t in, const vec3_t normal, const
 
     VectorMA(out, sample_nudge, dir, out);
     VectorMA(out, sample_nudge, normal, out);
-
-    return PvsForOrigin(out, pvs);
 }
 
 /*
@@ -2171,38 +2423,188 @@ BuildFacelights
 float sampleofs[5][2] =
     {{0, 0}, {-0.25, -0.25}, {0.25, -0.25}, {0.25, 0.25}, {-0.25, 0.25}};
 
-void BuildFacelights(int32_t facenum) {
-    lightinfo_t * liteinfo;//[5];
-    float **styletable;//[MAX_LSTYLES];
-    int32_t i, j;
-    float *spot;
-    patch_t *patch;
-    int32_t numsamples;
-    int32_t tablesize;
-    facelight_t *fl;
-    qboolean sun_main_once, sun_ambient_once;
-    vec_t *center;
+int32_t adaptive_texels, adaptive_refined; // -adaptive totals for the report
+
+/*
+=============
+GatherTexelSamples
+
+Gathers samples first..last-1 of texel i into slot of styletable, each
+at weight.  False if none of them were valid.
+=============
+*/
+static qboolean GatherTexelSamples(lightinfo_t *liteinfo, int32_t facenum, int32_t i, int32_t slot,
+                                   int32_t first, int32_t last, float weight,
+                                   float **styletable, int32_t tablesize, vec_t *center,
+                                   lightcache_t *cache, byte *reach, uint32_t *shadows) {
+    int32_t j, nodenum;
     vec3_t pos;
     vec3_t pointnormal;
+    qboolean valid;
+    qboolean sun_main_once, sun_ambient_once;
 
-    liteinfo = malloc(sizeof(*liteinfo) * 5);
-    styletable = malloc(sizeof(*styletable) * MAX_LSTYLES);
+    valid            = false;
+    sun_ambient_once = false;
+    sun_main_once    = false;
+
+    for (j = first; j < last; j++) {
+        if (extrasamples)
+            NudgeSamplePosition(liteinfo[j].surfpt[i], liteinfo[0].facenormal, center, pos);
+        else
+            VectorCopy(liteinfo[j].surfpt[i], pos);
+
+        if (!SampleLights(cache, pos, reach, &nodenum))
+            continue; // not a valid point
+
+        if (smoothing_threshold > 0.0)
+            GetPhongNormal(facenum, pos, pointnormal); // qb: VHLT
+        else
+            VectorCopy(liteinfo[0].facenormal, pointnormal);
+
+        GatherSampleLight(pos, pointnormal, styletable, slot * 3, tablesize, weight,
+                          &sun_main_once, &sun_ambient_once, cache, nodenum, shadows);
+        valid = true;
+    }
+
+    return valid;
+}
+
+/*
+=============
+AdaptiveTexels
+
+-adaptive: every texel gets the center sample at full weight first.  Where
+a neighbor differs by more than adaptive_threshold, or doesn't have the
+same lights blocked, both texels are gathered again with all five -extra
+samples.  The center samples of the rows on either side of firstrow..
+endrow-1 are taken as well, so a tile refines the same texels the whole
+face would.  Returns how many texels were refined.
+
+The threshold is in styletable units, before FinalLightFace puts on
+the ambient, the bounces and lightscale.
+=============
+*/
+static int32_t AdaptiveTexels(lightinfo_t *liteinfo, int32_t facenum, int32_t firstrow, int32_t endrow,
+                              float **styletable, vec_t *center, lightcache_t *cache, byte *reach) {
+    int32_t i, s, t, w, h, k, n, st, lo, hi, count, refined;
+    int32_t styles[MAX_LSTYLES], numstyles;
+    int32_t basesize, tablesize;
+    float **basetable;
+    uint32_t *shadows;
+    byte *refine;
+    float *a, *b;
+
+    w         = liteinfo[0].texsize[0] + 1;
+    h         = liteinfo[0].texsize[1] + 1;
+    lo        = firstrow > 0 ? firstrow - 1 : 0;
+    hi        = endrow < h ? endrow + 1 : h;
+    count     = (hi - lo) * w;
+    basesize  = count * sizeof(vec3_t);
+    tablesize = (endrow - firstrow) * w * sizeof(vec3_t);
+    basetable = malloc(sizeof(*basetable) * MAX_LSTYLES);
+    shadows   = malloc(count * sizeof(*shadows));
+    refine    = malloc(count);
+    memset(basetable, 0, sizeof(*basetable) * MAX_LSTYLES);
+
+    // center samples, indexed from row lo
+    for (i = 0; i < count; i++) {
+        shadows[i] = 0x811c9dc5;
+        refine[i]  = !GatherTexelSamples(liteinfo, facenum, lo * w + i, i, 0, 1, 1.0, basetable,
+                                         basesize, center, cache, reach, &shadows[i]);
+    }
+
+    numstyles = 0;
+    for (st = 0; st < MAX_LSTYLES; st++)
+        if (basetable[st])
+            styles[numstyles++] = st;
+
+    // compare each texel with the one to the right and the one below
+    for (t = lo; t < hi; t++) {
+        for (s = 0; s < w; s++) {
+            i = (t - lo) * w + s;
+            if (refine[i] == 1)
+                continue; // no center sample to compare with
+            for (n = 0; n < 2; n++) {
+                if (n ? t + 1 >= hi : s + 1 >= w)
+                    continue;
+                k = n ? i + w : i + 1;
+                if (refine[k] == 1)
+                    continue;
+
+                if (shadows[i] != shadows[k]) {
+                    refine[i] = refine[k] = 2;
+                    continue;
+                }
+                for (st = 0; st < numstyles; st++) {
+                    a = basetable[styles[st]] + i * 3;
+                    b = basetable[styles[st]] + k * 3;
+                    if (fabs(a[0] - b[0]) > adaptive_threshold ||
+                        fabs(a[1] - b[1]) > adaptive_threshold ||
+                        fabs(a[2] - b[2]) > adaptive_threshold) {
+                        refine[i] = refine[k] = 2;
+                        break;
+                    }
+                }
+            }
+        }
+    }
+
+    // the rest keep their center sample
+    for (i = (firstrow - lo) * w; i < (endrow - lo) * w && !refine[i]; i++)
+        ;
+    if (i < (endrow - lo) * w)
+        for (n = 1; n < 5; n++)
+            CalcPoints(&liteinfo[n], sampleofs[n][0], sampleofs[n][1], firstrow, endrow);
+
+    refined = 0;
+    for (i = (firstrow - lo) * w; i < (endrow - lo) * w; i++) {
+        k = i - (firstrow - lo) * w;
+        if (refine[i]) {
+            refined++;
+            GatherTexelSamples(liteinfo, facenum, lo * w + i, k, 0, 5, 1.0 / 5, styletable,
+                               tablesize, center, cache, reach, NULL);
+            continue;
+        }
+        for (st = 0; st < numstyles; st++) {
+            a = basetable[styles[st]] + i * 3;
+            if (VectorCompare(a, vec3_origin))
+                continue;
+            if (!styletable[styles[st]]) {
+                styletable[styles[st]] = malloc(tablesize);
+                memset(styletable[styles[st]], 0, tablesize);
+            }
+            VectorCopy(a, (styletable[styles[st]] + k * 3));
+        }
+    }
+
+    for (st = 0; st < numstyles; st++)
+        free(basetable[styles[st]]);
+    free(basetable);
+    free(shadows);
+    free(refine);
+    return refined;
+}
+
+/*
+=============
+InitLightinfo
+
+Sets up the face vectors and extents of the numsamples lightinfos of a
+face, without the points.  False if the face isn't lit.
+=============
+*/
+static qboolean InitLightinfo(int32_t facenum, lightinfo_t *liteinfo, int32_t numsamples) {
+    int32_t i;
 
     if (use_qbsp) {
         dface_tx *this_face;
         this_face = &dfacesX[facenum];
 
         if (texinfo[this_face->texinfo].flags & (SURF_WARP | SURF_SKY))
-            goto cleanup; // non-lit texture
+            return false; // non-lit texture
 
-        memset(styletable, 0, sizeof(*styletable) * MAX_LSTYLES);
-
-        if (extrasamples) // set with -extra option
-            numsamples = 5;
-        else
-            numsamples = 1;
         for (i = 0; i < numsamples; i++) {
-            memset(&liteinfo[i], 0, sizeof(liteinfo[i]));
+            memset(&liteinfo[i], 0, offsetof(lightinfo_t, surfpt));
             liteinfo[i].surfnum = facenum;
             liteinfo[i].faceX   = this_face;
             VectorCopy(dplanes[this_face->planenum].normal, liteinfo[i].facenormal);
@@ -2217,23 +2619,16 @@ void BuildFacelights(int32_t facenum) {
 
             CalcFaceVectors(&liteinfo[i]);
             CalcFaceExtents(&liteinfo[i]);
-            CalcPoints(&liteinfo[i], sampleofs[i][0], sampleofs[i][1]);
         }
     } else {
         dface_t *this_face;
         this_face = &dfaces[facenum];
 
         if (texinfo[this_face->texinfo].flags & (SURF_WARP | SURF_SKY))
-            goto cleanup; // non-lit texture
+            return false; // non-lit texture
 
-        memset(styletable, 0, sizeof(*styletable) * MAX_LSTYLES);
-
-        if (extrasamples) // set with -extra option
-            numsamples = 5;
-        else
-            numsamples = 1;
         for (i = 0; i < numsamples; i++) {
-            memset(&liteinfo[i], 0, sizeof(liteinfo[i]));
+            memset(&liteinfo[i], 0, offsetof(lightinfo_t, surfpt));
             liteinfo[i].surfnum = facenum;
             liteinfo[i].face    = this_face;
             VectorCopy(dplanes[this_face->planenum].normal, liteinfo[i].facenormal);
@@ -2248,53 +2643,238 @@ void BuildFacelights(int32_t facenum) {
 
             CalcFaceVectors(&liteinfo[i]);
             CalcFaceExtents(&liteinfo[i]);
-            CalcPoints(&liteinfo[i], sampleofs[i][0], sampleofs[i][1]);
         }
     }
-    tablesize     = liteinfo[0].numsurfpt * sizeof(vec3_t);
+    return true;
+}
+
+/*
+=============
+Light tiles
+
+A big face can have tens of thousands of samples, and as one work item it
+would be the last thing every thread waits on.  The samples of each face
+are lit in tiles of whole rows, which BuildFacelights puts back together
+in order, so the result is the same however they are split.  The thread
+that finishes the last tile of a face does that right away, so only the
+faces still being lit hold on to their tiles.
+=============
+*/
+#define TILE_SAMPLES 4096 // faces with more samples than this are split
+
+typedef struct
+{
+    int32_t facenum;
+    int32_t firstrow, endrow;
+    int32_t numsamples;
+    float **styletable; // MAX_LSTYLES, for the samples of these rows
+    vec3_t *origins;
+    byte *reach;
+} lighttile_t;
+
+static lighttile_t *lighttiles;
+int32_t numlighttiles;
+static int32_t *facetiles; // first tile of each face, and the end of the last
+static int32_t *tilesleft; // [numfaces] tiles of the face not lit yet
+
+static void BuildFacelights(int32_t facenum);
+
+/*
+=============
+MakeLightTiles
+=============
+*/
+void MakeLightTiles(void) {
+    int32_t i, w, h, rows, row;
+    lightinfo_t *liteinfo;
+
+    liteinfo  = malloc(sizeof(*liteinfo));
+    facetiles = AllocRadArray(facetiles, numfaces + 1, sizeof(facetiles[0]));
+
+    // count, then fill in
+    for (i = 0, numlighttiles = 0; i < numfaces; i++) {
+        facetiles[i] = numlighttiles;
+        if (facecached && facecached[i])
+            continue; // LoadRadCache filled it in
+        if (!InitLightinfo(i, liteinfo, 1))
+            continue;
+        w    = liteinfo->texsize[0] + 1;
+        h    = liteinfo->texsize[1] + 1;
+        rows = TILE_SAMPLES / w > 0 ? TILE_SAMPLES / w : 1;
+        numlighttiles += (h + rows - 1) / rows;
+    }
+    facetiles[numfaces] = numlighttiles;
+
+    lighttiles = AllocRadArray(lighttiles, numlighttiles, sizeof(lighttiles[0]));
+    tilesleft  = AllocRadArray(tilesleft, numfaces, sizeof(tilesleft[0]));
+    for (i = 0; i < numfaces; i++) {
+        tilesleft[i] = facetiles[i + 1] - facetiles[i];
+        if (!tilesleft[i])
+            continue;
+        InitLightinfo(i, liteinfo, 1);
+        w    = liteinfo->texsize[0] + 1;
+        h    = liteinfo->texsize[1] + 1;
+        rows = TILE_SAMPLES / w > 0 ? TILE_SAMPLES / w : 1;
+        for (row = 0; row < h; row += rows) {
+            lighttile_t *tile = &lighttiles[facetiles[i] + row / rows];
+
+            tile->facenum  = i;
+            tile->firstrow = row;
+            tile->endrow   = row + rows < h ? row + rows : h;
+        }
+    }
+
+    free(liteinfo);
+    qprintf("%i light tiles for %i faces\n", numlighttiles, numfaces);
+}
+
+/*
+=============
+BuildFacelightTile
+
+Lights the samples of one tile into its own styletable, and the
+face if it was the last of its tiles
+=============
+*/
+void BuildFacelightTile(int32_t tilenum) {
+    lighttile_t *tile = &lighttiles[tilenum];
+    lightinfo_t *liteinfo; //[5];
+    float **styletable;    //[MAX_LSTYLES];
+    int32_t i, j, w, h, lo, hi, left;
+    int32_t numsamples;
+    int32_t tablesize;
+    vec_t *center;
+    lightcache_t cache;
+
+    if (extrasamples) // set with -extra option
+        numsamples = 5;
+    else
+        numsamples = 1;
+
+    liteinfo = malloc(sizeof(*liteinfo) * 5);
+    InitLightinfo(tile->facenum, liteinfo, numsamples);
+
+    // -adaptive looks one row past the tile for neighbors
+    w  = liteinfo[0].texsize[0] + 1;
+    h  = liteinfo[0].texsize[1] + 1;
+    lo = tile->firstrow;
+    hi = tile->endrow;
+    if (adaptive_threshold > 0) {
+        lo = lo > 0 ? lo - 1 : 0;
+        hi = hi < h ? hi + 1 : h;
+    }
+    for (i = 0; i < numsamples; i++)
+        if (i == 0 || adaptive_threshold <= 0) // AdaptiveTexels does the rest if it needs them
+            CalcPoints(&liteinfo[i], sampleofs[i][0], sampleofs[i][1], lo, hi);
+
+    tile->numsamples = (tile->endrow - tile->firstrow) * w;
+    tablesize        = tile->numsamples * sizeof(vec3_t);
+    styletable       = malloc(sizeof(*styletable) * MAX_LSTYLES);
+    memset(styletable, 0, sizeof(*styletable) * MAX_LSTYLES);
     styletable[0] = malloc(tablesize);
     memset(styletable[0], 0, tablesize);
 
-    fl             = &facelight[facenum];
-    fl->numsamples = liteinfo[0].numsurfpt;
-    fl->origins    = malloc(tablesize);
+    tile->origins = malloc(tablesize);
+    memcpy(tile->origins, liteinfo[0].surfpt[tile->firstrow * w], tablesize);
+    center = face_extents[tile->facenum].center; // center of the face
 
-    memcpy(fl->origins, liteinfo[0].surfpt, tablesize);
-    center = face_extents[facenum].center; // center of the face
+    // the clusters the samples look in, for the rad cache
+    tile->reach = NULL;
+    if (facecached) {
+        tile->reach = malloc((dvis->numclusters + 7) >> 3);
+        memset(tile->reach, 0, (dvis->numclusters + 7) >> 3);
+    }
+    memset(&cache, 0, sizeof(cache));
+    cache.cluster = -2;
+
+    if (adaptive_threshold > 0) {
+        j = AdaptiveTexels(liteinfo, tile->facenum, tile->firstrow, tile->endrow, styletable, center,
+                           &cache, tile->reach);
+        ThreadLock();
+        adaptive_texels += tile->numsamples;
+        adaptive_refined += j;
+        ThreadUnlock();
+    } else {
+        for (i = tile->firstrow * w; i < tile->endrow * w; i++)
+            GatherTexelSamples(liteinfo, tile->facenum, i, i - tile->firstrow * w, 0, numsamples,
+                               1.0 / numsamples, styletable, tablesize, center, &cache, tile->reach,
+                               NULL);
+    }
 
-    for (i = 0; i < liteinfo[0].numsurfpt; i++) {
-        sun_ambient_once = false;
-        sun_main_once    = false;
+    tile->styletable = styletable;
+    free(cache.lights);
+    free(liteinfo);
 
-        for (j = 0; j < numsamples; j++) {
-            byte pvs[(MAX_MAP_LEAFS_QBSP + 7) / 8];
+    ThreadLock();
+    left = --tilesleft[tile->facenum];
+    ThreadUnlock();
+    if (!left)
+        BuildFacelights(tile->facenum);
+}
 
-            if (numsamples > 1) {
-                if (!NudgeSamplePosition(liteinfo[j].surfpt[i], liteinfo[0].facenormal, center, pos, pvs)) {
-                    continue; // not a valid point
-                }
-            } else
+/*
+=============
+BuildFacelights
 
-                VectorCopy(liteinfo[j].surfpt[i], pos);
+Puts the tiles of a face back together into its facelight, and
+adds its direct light to the patches
+=============
+*/
+static void BuildFacelights(int32_t facenum) {
+    float **styletable; //[MAX_LSTYLES];
+    int32_t i, n, ofs;
+    float *spot;
+    int32_t tablesize;
+    facelight_t *fl;
+    lighttile_t *tile;
+    byte *reach;
+    patchgrid_t grid;
 
-            if (smoothing_threshold > 0.0)
-                GetPhongNormal(facenum, pos, pointnormal); // qb: VHLT
-            else
-                VectorCopy(liteinfo[0].facenormal, pointnormal);
+    fl             = &facelight[facenum];
+    fl->numsamples = 0;
+    for (n = facetiles[facenum]; n < facetiles[facenum + 1]; n++)
+        fl->numsamples += lighttiles[n].numsamples;
+    tablesize   = fl->numsamples * sizeof(vec3_t);
+    fl->origins = malloc(tablesize);
 
-            GatherSampleLight(pos, pointnormal, styletable, i * 3, tablesize, 1.0 / numsamples,
-                              &sun_main_once, &sun_ambient_once, pvs);
-        }
+    styletable = malloc(sizeof(*styletable) * MAX_LSTYLES);
+    memset(styletable, 0, sizeof(*styletable) * MAX_LSTYLES);
+    reach = NULL;
+    if (facecached) {
+        reach = malloc((dvis->numclusters + 7) >> 3);
+        memset(reach, 0, (dvis->numclusters + 7) >> 3);
+    }
 
-        // contribute the sample to one or more patches
-        AddSampleToPatch(liteinfo[0].surfpt[i], styletable[0] + i * 3, facenum);
+    for (n = facetiles[facenum], ofs = 0; n < facetiles[facenum + 1]; n++) {
+        tile = &lighttiles[n];
+        memcpy(fl->origins + ofs * 3, tile->origins, tile->numsamples * sizeof(vec3_t));
+        for (i = 0; i < MAX_LSTYLES; i++) {
+            if (!tile->styletable[i])
+                continue;
+            if (!styletable[i]) {
+                styletable[i] = malloc(tablesize);
+                memset(styletable[i], 0, tablesize);
+            }
+            memcpy(styletable[i] + ofs * 3, tile->styletable[i], tile->numsamples * sizeof(vec3_t));
+            free(tile->styletable[i]);
+        }
+        if (reach)
+            for (i = 0; i < (dvis->numclusters + 7) >> 3; i++)
+                reach[i] |= tile->reach[i];
+        ofs += tile->numsamples;
+
+        free(tile->styletable);
+        free(tile->origins);
+        free(tile->reach);
     }
 
+    // contribute the samples to one or more patches, and
     // average up the direct light on each patch for radiosity
-    for (patch = face_patches[facenum]; patch; patch = patch->next) {
-        if (patch->samples) {
-            VectorScale(patch->samplelight, 1.0 / patch->samples, patch->samplelight);
-        }
+    if (numbounce > 0) {
+        MakePatchGrid(&grid, facenum);
+        for (i = 0; i < fl->numsamples; i++)
+            AddSampleToPatch(&grid, fl->origins + i * 3, styletable[0] + i * 3);
+        FreePatchGrid(&grid);
     }
 
     for (i = 0; i < MAX_LSTYLES; i++) {
@@ -2313,13 +2893,16 @@ void BuildFacelights(int32_t facenum) {
         face_patches[facenum]->baselight[1] >= DIRECT_LIGHT ||
         face_patches[facenum]->baselight[2] >= DIRECT_LIGHT) {
         spot = fl->samples[0];
-        for (i = 0; i < liteinfo[0].numsurfpt; i++, spot += 3) {
+        for (i = 0; i < fl->numsamples; i++, spot += 3) {
             VectorAdd(spot, face_patches[facenum]->baselight, spot);
         }
     }
 
-cleanup:
-    free(liteinfo);
+    if (reach) {
+        KeepFaceReach(facenum, reach);
+        free(reach);
+    }
+
     free(styletable);
 }
 
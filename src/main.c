@@ -22,6 +22,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "mathlib.h"
 #include "qfiles.h"
 #include "threads.h"
+#include "memlib.h"
 
 static char *help_string =
     "\n<<<<<<<<<<<<<<<<<<<<<<<<<<<<<< q2tool HELP >>>>>>>>>>>>>>>>>>>>>>>>>>>>>>\n"
@@ -31,9 +32,12 @@ static char *help_string =
     "    -basedir [path]: Set the directory for assets not in moddir. Default is moddir.\n"
     "    -gamedir [path]: Set game directory, the folder with game executable.\n"
     "    -v: Display more verbose output.\n"
-    "    -threads #: number of CPU threads to use\n\n"
+    "    -threads #: number of CPU threads to use\n"
+    "    -keepstages: Write the .bsp and .prt between stages of a combined run.\n"
+    "        By default they are handed on in memory.\n\n"
     "BSP pass:\n"
     "    -bsp: enable bsp pass, requires a .map file as input\n"
+    "    -binprt: Write a binary (PRT1-BIN) portal file. Faster for vis to load.\n"
     "    -chop #: Subdivide size.\n"
     "        Default: 240  Range: 32-1024\n"
     "    -choplight #: Subdivide size for surface lights.\n"
@@ -49,6 +53,8 @@ static char *help_string =
     "    -blocksize: map cube size for processing. Default: 1024\n"
     "    -fulldetail: Change most brushes to detail.\n"
     "    -leaktest: Perform leak test only.\n"
+    "    -memdebug: Never reuse freed windings, brushes, nodes, portals or faces,\n"
+    "        fill them with 0xdeaddead to catch double frees and stale pointers.\n"
     "    -nocsg: No constructive solid geometry.\n"
     "    -nodetail: No detail brushes.\n"
     "    -nomerge: Don't merge visible faces per node.\n"
@@ -62,7 +68,23 @@ static char *help_string =
     "    -onlyents: Grab the entites and resave.\n\n"
     "VIS pass:\n"
     "    -vis: enable vis pass, requires a .bsp file as input or bsp pass enabled\n"
-    "    -fast: fast single vis pass\n\n"
+    "    -fast: fast single vis pass\n"
+    "    -bitkernel [c|sse2|avx2|avx512]: Bit string and separator code to use. Default is the best the cpu has.\n"
+    "    -bitbench: Time the bit string and separator code on the map's portals before the full vis.\n"
+    "    -checkpoint #: Seconds between saves of the finished portals to a .vck file. Default is 300, 0 never saves.\n"
+    "    -resume: Skip the portals a .vck file from a killed full vis has already done.\n"
+    "    -incremental: Keep the full vis of each portal in a .vic file and reuse it next time\n"
+    "        for the portals whose part of the map hasn't changed.\n"
+    "    -vistime #: Seconds the full vis may spend on one portal before it settles for the\n"
+    "        rough -fast answer for that portal. Default is no limit.\n"
+    "    -vischains #: Same, counted in flow steps instead. Unlike -vistime, it gives the same\n"
+    "        result every run.\n"
+    "    -visshard # #: Shard k of n shards of the full vis, run at the same time as the\n"
+    "        others. Writes a .<k>.vsh file instead of the .bsp.\n"
+    "    -vismerge: Read the .vsh files of the shards and write the .bsp, flowing any portals\n"
+    "        they don't have.\n"
+    "    -visprofile [csv|json]: Write the flow steps, seconds, mightsee and cansee of every portal\n"
+    "        of the full vis to a .vis.csv or .vis.json file and list the ten slowest.\n\n"
     "RAD pass:\n"
     "    -rad: enable rad pass, requires a .bsp file as input or bsp and vis passes enabled\n"
     "    -ambient #: Minimum light level.\n"
@@ -70,6 +92,9 @@ static char *help_string =
     "    -moddir [path]: Set a mod directory. Default is parent dir of map file.\n"
     "    -basedir [path]: Set the directory for assets not in moddir. Default is moddir.\n"
     "    -gamedir [path]: Set game directory, the folder with game executable.\n"
+    "    -adaptive #: -extra, but only where the direct light of neighboring texels differs by\n"
+    "        more than #, or a light worth more than # is blocked from some of them. # is raw light,\n"
+    "        before -scale, -ambient and the bounces.\n"
     "    -bounce #: Max number of light bounces for radiosity.\n"
     "    -dice: Subdivide patches with a global grid rather than per patch.\n"
     "    -direct #: Direct light scale factor.\n"
@@ -81,6 +106,8 @@ static char *help_string =
     "         range:  0 to 255.\n"
     "    -noedgefix: disable dark edges at sky fix. More of a hack, really.\n"
     "    -nudge #: Nudge factor for samples. Distance fraction from center.\n"
+    "    -radincremental: Keep the direct light of each face in a .ric file and reuse it next\n"
+    "        time for the faces whose lights haven't changed.\n"
     "    -saturate #: Saturation factor of light bounced off surfaces.\n"
     "    -scale #: Light intensity multiplier.\n"
     "    -smooth #: Threshold angle (# and 180deg - #) for phong smoothing.\n"
@@ -103,6 +130,10 @@ extern qboolean nowater;
 extern qboolean noprune;
 extern qboolean nomerge;
 extern qboolean nosubdiv;
+extern qboolean binportals;
+extern qboolean keepstages;
+extern qboolean bsp_frommemory;
+extern qboolean bsp_tomemory;
 extern qboolean nodetail;
 extern qboolean fulldetail;
 extern qboolean onlyents;
@@ -111,6 +142,7 @@ extern qboolean leaktest;
 extern qboolean use_qbsp;
 extern int32_t max_entities;
 extern int32_t max_bounds;
+extern int32_t bspthreads;
 extern int32_t block_size;
 extern qboolean noskipfix;
 extern float subdivide_size;
@@ -126,9 +158,22 @@ extern char outbase[32];
 extern qboolean fastvis;
 
 extern qboolean nosort;
+extern qboolean bitbench;
+extern int32_t checkpointtime;
+extern qboolean resume;
+extern qboolean incremental;
+extern qboolean radincremental;
+extern double vistime;
+extern int32_t vischains;
+extern qboolean visshard;
+extern int32_t shardnum, numshards;
+extern qboolean vismerge;
+extern char *visprofile;
+extern char *bitkernelname;
 extern qboolean dumppatches;
 extern int32_t numbounce;
 extern qboolean extrasamples;
+extern float adaptive_threshold;
 extern qboolean noedgefix;
 extern int32_t maxdata;
 extern float lightscale;
@@ -174,6 +219,7 @@ int main(int argc, char *argv[]) {
     qboolean do_vis  = false;
     qboolean do_rad  = false;
     qboolean do_data = false;
+    qboolean run_vis;
 
     ThreadSetDefault();
 
@@ -192,6 +238,9 @@ int main(int argc, char *argv[]) {
         } else if (!strcmp(argv[i], "-v")) {
             printf("verbose = true\n");
             verbose = true;
+        } else if (!strcmp(argv[i], "-memdebug")) {
+            printf("memdebug = true\n");
+            memdebug = true;
         } else if (!strcmp(argv[i], "-help")) {
             printf("%s\n", help_string);
             exit(1);
@@ -223,6 +272,12 @@ int main(int argc, char *argv[]) {
         } else if (!strcmp(argv[i], "-nosubdiv")) {
             printf("nosubdiv = true\n");
             nosubdiv = true;
+        } else if (!strcmp(argv[i], "-keepstages")) {
+            printf("keepstages = true\n");
+            keepstages = true;
+        } else if (!strcmp(argv[i], "-binprt")) {
+            printf("binportals = true\n");
+            binportals = true;
         } else if (!strcmp(argv[i], "-nodetail")) {
             printf("nodetail = true\n");
             nodetail = true;
@@ -322,6 +377,49 @@ int main(int argc, char *argv[]) {
         } else if (!strcmp(argv[i], "-fast")) {
             printf("fastvis = true\n");
             fastvis = true;
+        } else if (!strcmp(argv[i], "-bitkernel")) {
+            bitkernelname = argv[i + 1];
+            printf("bitkernel = %s\n", bitkernelname);
+            i++;
+        } else if (!strcmp(argv[i], "-bitbench")) {
+            printf("bitbench = true\n");
+            bitbench = true;
+        } else if (!strcmp(argv[i], "-checkpoint")) {
+            checkpointtime = atoi(argv[i + 1]);
+            printf("checkpoint = %i\n", checkpointtime);
+            i++;
+        } else if (!strcmp(argv[i], "-vistime")) {
+            vistime = atof(argv[i + 1]);
+            printf("vistime = %g\n", vistime);
+            i++;
+        } else if (!strcmp(argv[i], "-vischains")) {
+            vischains = atoi(argv[i + 1]);
+            printf("vischains = %i\n", vischains);
+            i++;
+        } else if (!strcmp(argv[i], "-incremental")) {
+            printf("incremental = true\n");
+            incremental = true;
+        } else if (!strcmp(argv[i], "-radincremental")) {
+            printf("radincremental = true\n");
+            radincremental = true;
+        } else if (!strcmp(argv[i], "-visshard")) {
+            visshard  = true;
+            shardnum  = atoi(argv[i + 1]);
+            numshards = atoi(argv[i + 2]);
+            printf("visshard = %i of %i\n", shardnum, numshards);
+            i += 2;
+        } else if (!strcmp(argv[i], "-vismerge")) {
+            printf("vismerge = true\n");
+            vismerge = true;
+        } else if (!strcmp(argv[i], "-visprofile")) {
+            visprofile = argv[i + 1];
+            if (strcmp(visprofile, "csv") && strcmp(visprofile, "json"))
+                Error("-visprofile takes csv or json, not %s", visprofile);
+            printf("visprofile = %s\n", visprofile);
+            i++;
+        } else if (!strcmp(argv[i], "-resume")) {
+            printf("resume = true\n");
+            resume = true;
         } else if (!strcmp(argv[i], "-nosort")) {
             printf("nosort = true\n");
             nosort = true;
@@ -334,6 +432,13 @@ int main(int argc, char *argv[]) {
         } else if (!strcmp(argv[i], "-extra")) {
             extrasamples = true;
             printf("extrasamples = true\n");
+        } else if (!strcmp(argv[i], "-adaptive")) {
+            adaptive_threshold = atof(argv[i + 1]);
+            if (adaptive_threshold <= 0)
+                Error("-adaptive needs a threshold above 0, not %s", argv[i + 1]);
+            extrasamples = true;
+            printf("adaptive extrasamples = %f\n", adaptive_threshold);
+            i++;
         } else if (!strcmp(argv[i], "-h2tex")) {
             h2tex = true;
             printf("use Heretic II texture format = true\n");
@@ -495,23 +600,38 @@ int main(int argc, char *argv[]) {
         printf("basedir = %s\n", basedir);
         printf("gamedir = %s\n\n", gamedir);
 
+        // each stage hands its lumps on to the next one in memory
+        run_vis        = do_vis || (do_bsp && do_rad);
+        bsp_frommemory = false;
+
+        // a shard only writes its .vsh, -vismerge makes the .bsp for rad
+        if (visshard && do_rad)
+            Error("-visshard can't be run with -rad, run -rad after -vismerge");
+
         if (do_bsp) {
             int32_t old_numthreads = numthreads;
             // qb: below is from original source release.  On Windows, multi threads cause false leak errors.
             numthreads             = 1; // multiple threads aren't helping...
+            bspthreads             = old_numthreads; // but brush construction and submodels can use them
             printf("<<<<<<<<<<<<<<<<<<<<<<<<<<<<<< BEGIN bsp >>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>\n");
+            bsp_tomemory           = run_vis && !visshard; // -vismerge reads the .bsp and .prt
             BSP_ProcessArgument(argv[i]);
-            numthreads = old_numthreads;
+            numthreads     = old_numthreads;
+            bsp_frommemory = bsp_tomemory;
         }
-        if (do_vis || (do_bsp && do_rad)) {
+        if (run_vis) {
             printf("<<<<<<<<<<<<<<<<<<<<<<<<<<<<<< BEGIN vis >>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>\n");
+            bsp_tomemory = do_rad;
             VIS_ProcessArgument(argv[i]);
+            bsp_frommemory = bsp_tomemory;
         }
 
         if (do_rad) {
             printf("<<<<<<<<<<<<<<<<<<<<<<<<<<<<<< BEGIN rad >>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>\n");
+            bsp_tomemory = false;
             RAD_ProcessArgument(argv[i]);
         }
+        bsp_frommemory = bsp_tomemory = false;
 
         if (do_data) {
             printf("<<<<<<<<<<<<<<<<<<<<<<<<<<<<< BEGIN data >>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>\n");
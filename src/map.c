@@ -37,7 +37,72 @@ plane_t *planehash[PLANE_HASHES];
 
 vec3_t map_mins, map_maxs;
 
+/*
+The map is loaded in steps.  The text is tokenized serially into raw brush
+records and PredictBrushPlanes looks up the plane of every side, without the
+bevels, to know the exact values the plane table will hand out.  Then
+BuildBrushGeometry runs on all brushes in parallel to make the windings and
+edge bevel candidates against those values.  Last, the brushes are committed
+serially in map order, so the plane table is filled in exactly the order the
+single pass parser used and the plane numbers don't depend on the thread
+count.  A brush whose committed planes differ from the predicted ones is
+rebuilt serially.
+*/
+typedef struct
+{
+    vec3_t planepts[3];
+    brush_texture_t td;
+    vec_t UVaxis[6];
+    int32_t contents;
+    int32_t surf;
+    int32_t line;
+
+    // set by PredictBrushPlanes
+    int32_t planenum;
+    plane_t plane;     // normal and dist of planenum
+    plane_t backplane; // normal and dist of planenum ^ 1
+    qboolean keep;     // not a duplicate or mirrored plane
+
+    // set by BuildBrushGeometry
+    winding_t *winding;
+} rawside_t;
+
+typedef struct
+{
+    vec3_t normal;
+    vec_t dist;
+} bevelplane_t;
+
+typedef struct
+{
+    int32_t firstside;
+    int32_t numsides;
+    int32_t line;
+    int32_t mapversion;
+
+    // set by BuildBrushGeometry
+    vec3_t mins, maxs;
+    int32_t numbevels;
+    bevelplane_t *bevels; // edge bevels on the hull, not yet checked against the plane table
+} rawbrush_t;
+
+typedef struct
+{
+    int32_t firstbrush;
+    int32_t numbrushes;
+    int32_t mapversion;
+} rawentity_t;
+
+int32_t numrawsides, maxrawsides;
+rawside_t *rawsides;
+
+int32_t numrawbrushes, maxrawbrushes;
+rawbrush_t *rawbrushes;
+
+rawentity_t rawentities[MAX_MAP_ENTITIES_QBSP];
+
 void TestExpandBrushes(void);
+void CheckBrushBounds(mapbrush_t *ob);
 
 int32_t c_boxbevels;
 int32_t c_edgebevels;
@@ -46,6 +111,8 @@ int32_t c_areaportals;
 
 int32_t c_clipbrushes;
 
+int32_t c_rebuiltbrushes;
+
 int32_t g_nMapFileVersion = 0; // DarkEssence: variable for check #mapversion
 // #mapversion in search to find in code
 /*
@@ -102,6 +169,17 @@ qboolean PlaneEqual(plane_t *p, vec3_t normal, vec_t dist) {
     return false;
 }
 
+/*
+================
+PlaneExactlyEqual
+
+Bit for bit, so a -0 dist doesn't match a 0 dist
+================
+*/
+qboolean PlaneExactlyEqual(plane_t *p1, plane_t *p2) {
+    return !memcmp(p1->normal, p2->normal, sizeof(vec3_t)) && !memcmp(&p1->dist, &p2->dist, sizeof(vec_t));
+}
+
 /*
 ================
 AddPlaneToHash
@@ -284,25 +362,111 @@ int32_t BrushContents(mapbrush_t *b) {
 
 //============================================================================
 
+/*
+=================
+EdgeBevelCandidates
+
+Tries the six slanted axials from every non-axial edge of the side windings
+past the first six (the axial sides) and keeps the planes that have all the
+windings behind them.  windings[] is in the final side order of the brush.
+=================
+*/
+static int32_t EdgeBevelCandidates(winding_t **windings, int32_t numwindings, bevelplane_t **bevels) {
+    int32_t axis, dir;
+    int32_t i, j, k, l;
+    int32_t numbevels, maxbevels;
+    vec3_t normal;
+    vec_t dist;
+    winding_t *w, *w2;
+    vec3_t vec, vec2;
+    vec_t d;
+
+    numbevels = maxbevels = 0;
+    *bevels               = NULL;
+
+    for (i = 6; i < numwindings; i++) {
+        w = windings[i];
+        if (!w)
+            continue;
+        for (j = 0; j < w->numpoints; j++) {
+            k = (j + 1) % w->numpoints;
+            VectorSubtract(w->p[j], w->p[k], vec);
+            if (VectorNormalize(vec, vec) < 0.5)
+                continue;
+            SnapVector(vec);
+            for (k = 0; k < 3; k++)
+                if (vec[k] == -1 || vec[k] == 1)
+                    break; // axial
+            if (k != 3)
+                continue; // only test non-axial edges
+
+            // try the six possible slanted axials from this edge
+            for (axis = 0; axis < 3; axis++) {
+                for (dir = -1; dir <= 1; dir += 2) {
+                    // construct a plane
+                    VectorClear(vec2);
+                    vec2[axis] = dir;
+                    CrossProduct(vec, vec2, normal);
+                    if (VectorNormalize(normal, normal) < 0.5)
+                        continue;
+                    dist = DotProduct(w->p[j], normal);
+
+                    // if all the points on all the sides are
+                    // behind this plane, it is a proper edge bevel
+                    for (k = 0; k < numwindings; k++) {
+                        w2 = windings[k];
+                        if (!w2)
+                            continue;
+                        for (l = 0; l < w2->numpoints; l++) {
+                            d = DotProduct(w2->p[l], normal) - dist;
+                            if (d > 0.1)
+                                break; // point in front
+                        }
+                        if (l != w2->numpoints)
+                            break;
+                    }
+
+                    if (k != numwindings)
+                        continue; // wasn't part of the outer hull
+
+                    if (numbevels == maxbevels) {
+                        maxbevels = maxbevels ? maxbevels * 2 : 16;
+                        *bevels   = realloc(*bevels, maxbevels * sizeof(**bevels));
+                        if (!*bevels)
+                            Error("EdgeBevelCandidates: out of memory");
+                    }
+                    VectorCopy(normal, (*bevels)[numbevels].normal);
+                    (*bevels)[numbevels].dist = dist;
+                    numbevels++;
+                }
+            }
+        }
+    }
+
+    return numbevels;
+}
+
 /*
 =================
 AddBrushBevels
 
 Adds any additional planes necessary to allow the brush to be expanded
 against axial bounding boxes
+
+If numbevels is -1 the edge bevel candidates are found here, otherwise
+they were already found by BuildBrushGeometry.
 =================
 */
-void AddBrushBevels(mapbrush_t *b) {
+void AddBrushBevels(mapbrush_t *b, bevelplane_t *bevels, int32_t numbevels) {
     int32_t axis, dir;
-    int32_t i, j, k, l, order;
+    int32_t i, j, k, order;
     side_t sidetemp;
     brush_texture_t tdtemp;
     side_t *s, *s2;
     vec3_t normal;
     vec_t dist;
-    winding_t *w, *w2;
-    vec3_t vec, vec2;
-    vec_t d;
+    winding_t **windings;
+    qboolean freebevels;
 
     //
     // add the axial planes
@@ -358,76 +522,44 @@ void AddBrushBevels(mapbrush_t *b) {
     if (b->numsides == 6)
         return; // pure axial
 
-    // test the non-axial plane edges
-    for (i = 6; i < b->numsides; i++) {
-        s = b->original_sides + i;
-        w = s->winding;
-        if (!w)
-            continue;
-        for (j = 0; j < w->numpoints; j++) {
-            k = (j + 1) % w->numpoints;
-            VectorSubtract(w->p[j], w->p[k], vec);
-            if (VectorNormalize(vec, vec) < 0.5)
-                continue;
-            SnapVector(vec);
-            for (k = 0; k < 3; k++)
-                if (vec[k] == -1 || vec[k] == 1)
-                    break; // axial
-            if (k != 3)
-                continue; // only test non-axial edges
-
-            // try the six possible slanted axials from this edge
-            for (axis = 0; axis < 3; axis++) {
-                for (dir = -1; dir <= 1; dir += 2) {
-                    // construct a plane
-                    VectorClear(vec2);
-                    vec2[axis] = dir;
-                    CrossProduct(vec, vec2, normal);
-                    if (VectorNormalize(normal, normal) < 0.5)
-                        continue;
-                    dist = DotProduct(w->p[j], normal);
-
-                    // if all the points on all the sides are
-                    // behind this plane, it is a proper edge bevel
-                    for (k = 0; k < b->numsides; k++) {
-                        // if this plane has allready been used, skip it
-                        if (PlaneEqual(&mapplanes[b->original_sides[k].planenum], normal, dist))
-                            break;
+    freebevels = false;
+    if (numbevels == -1) {
+        windings = malloc(b->numsides * sizeof(*windings));
+        for (i = 0; i < b->numsides; i++)
+            windings[i] = b->original_sides[i].winding;
+        numbevels = EdgeBevelCandidates(windings, b->numsides, &bevels);
+        free(windings);
+        freebevels = true;
+    }
 
-                        w2 = b->original_sides[k].winding;
-                        if (!w2)
-                            continue;
-                        for (l = 0; l < w2->numpoints; l++) {
-                            d = DotProduct(w2->p[l], normal) - dist;
-                            if (d > 0.1)
-                                break; // point in front
-                        }
-                        if (l != w2->numpoints)
-                            break;
-                    }
+    for (i = 0; i < numbevels; i++) {
+        // if this plane has allready been used, skip it
+        for (k = 0; k < b->numsides; k++) {
+            if (PlaneEqual(&mapplanes[b->original_sides[k].planenum], bevels[i].normal, bevels[i].dist))
+                break;
+        }
+        if (k != b->numsides)
+            continue;
 
-                    if (k != b->numsides)
-                        continue; // wasn't part of the outer hull
+        // add this plane
+        if (use_qbsp) {
+            if (nummapbrushsides == MAX_MAP_BRUSHSIDES_QBSP)
+                Error("MAX_MAP_BRUSHSIDES_QBSP");
+        } else if (nummapbrushsides == MAX_MAP_BRUSHSIDES)
+            Error("MAX_MAP_BRUSHSIDES");
 
-                    // add this plane
-                    if (use_qbsp) {
-                        if (nummapbrushsides == MAX_MAP_BRUSHSIDES_QBSP)
-                            Error("MAX_MAP_BRUSHSIDES_QBSP");
-                    } else if (nummapbrushsides == MAX_MAP_BRUSHSIDES)
-                        Error("MAX_MAP_BRUSHSIDES");
-
-                    nummapbrushsides++;
-                    s2           = &b->original_sides[b->numsides];
-                    s2->planenum = FindFloatPlane(normal, dist, b->brushnum);
-                    s2->texinfo  = b->original_sides[0].texinfo;
-                    s2->contents = b->original_sides[0].contents;
-                    s2->bevel    = true;
-                    c_edgebevels++;
-                    b->numsides++;
-                }
-            }
-        }
+        nummapbrushsides++;
+        s2           = &b->original_sides[b->numsides];
+        s2->planenum = FindFloatPlane(bevels[i].normal, bevels[i].dist, b->brushnum);
+        s2->texinfo  = b->original_sides[0].texinfo;
+        s2->contents = b->original_sides[0].contents;
+        s2->bevel    = true;
+        c_edgebevels++;
+        b->numsides++;
     }
+
+    if (freebevels)
+        free(bevels);
 }
 
 /*
@@ -439,6 +571,7 @@ makes basewindigs for sides and mins / maxs for the brush
 */
 void MakeBrushWindings(mapbrush_t *ob) {
     int32_t i, j;
+    fixedwinding_t fw;
     winding_t *w;
     side_t *side;
     plane_t *plane;
@@ -447,16 +580,18 @@ void MakeBrushWindings(mapbrush_t *ob) {
 
     for (i = 0; i < ob->numsides; i++) {
         plane = &mapplanes[ob->original_sides[i].planenum];
-        w     = BaseWindingForPlane(plane->normal, plane->dist);
-        for (j = 0; j < ob->numsides && w; j++) {
+        BaseFixedWindingForPlane(&fw, plane->normal, plane->dist);
+        for (j = 0; j < ob->numsides; j++) {
             if (i == j)
                 continue;
             if (ob->original_sides[j].bevel)
                 continue;
             plane = &mapplanes[ob->original_sides[j].planenum ^ 1];
-            ChopWindingInPlace(&w, plane->normal, plane->dist, 0);
+            if (!ChopFixedWindingInPlace(&fw, plane->normal, plane->dist, 0))
+                break;
         }
 
+        w             = CopyFixedWinding(&fw);
         side          = &ob->original_sides[i];
         side->winding = w;
         if (w) {
@@ -466,6 +601,19 @@ void MakeBrushWindings(mapbrush_t *ob) {
         }
     }
 
+    CheckBrushBounds(ob);
+}
+
+/*
+================
+CheckBrushBounds
+
+Warns about brushes outside max_bounds
+================
+*/
+void CheckBrushBounds(mapbrush_t *ob) {
+    int32_t i;
+
     for (i = 0; i < 3; i++) {
         if (ob->mins[i] < -max_bounds || ob->maxs[i] > max_bounds) {
             printf("Entity %i, Brush %i, Line %i: bounds out of range\n", ob->entitynum, ob->brushnum, scriptline + 1); // qb: add scriptline
@@ -480,35 +628,32 @@ void MakeBrushWindings(mapbrush_t *ob) {
             return;
         }
     }
-
-    return;
 }
 
 /*
 =================
-ParseBrush
+TokenizeBrush
+
+Reads the text of a brush into a raw brush record
 =================
 */
-void ParseBrush(entity_t *mapent) {
-    mapbrush_t *b;
-    int32_t i, j, k;
+void TokenizeBrush(void) {
+    rawbrush_t *rb;
+    rawside_t *side;
+    int32_t i, j;
     int32_t mt;
-    side_t *side, *s2;
-    int32_t planenum;
-    brush_texture_t td;
-    vec3_t planepts[3];
-    vec_t UVaxis[6]; // DarkEssence: UV axis in 220 #mapversion
 
-    if (use_qbsp) {
-        if (nummapbrushes == MAX_MAP_BRUSHES_QBSP)
-            Error("nummapbrushes == MAX_MAP_BRUSHES_QBSP  (%i)", MAX_MAP_BRUSHES_QBSP);
-    } else if (nummapbrushes == MAX_MAP_BRUSHES)
-        Error("nummapbrushes == MAX_MAP_BRUSHES  (%i)", MAX_MAP_BRUSHES);
+    if (numrawbrushes == maxrawbrushes) {
+        maxrawbrushes = maxrawbrushes ? maxrawbrushes * 2 : 1024;
+        rawbrushes    = realloc(rawbrushes, maxrawbrushes * sizeof(*rawbrushes));
+        if (!rawbrushes)
+            Error("TokenizeBrush: out of memory");
+    }
 
-    b                 = &mapbrushes[nummapbrushes];
-    b->original_sides = &brushsides[nummapbrushsides];
-    b->entitynum      = num_entities - 1;
-    b->brushnum       = nummapbrushes - mapent->firstbrush;
+    rb = &rawbrushes[numrawbrushes];
+    memset(rb, 0, sizeof(*rb));
+    rb->firstside  = numrawsides;
+    rb->mapversion = g_nMapFileVersion;
 
     do {
         if (!GetToken(true))
@@ -516,12 +661,14 @@ void ParseBrush(entity_t *mapent) {
         if (!strcmp(token, "}"))
             break;
 
-        if (use_qbsp) {
-            if (nummapbrushsides == MAX_MAP_BRUSHSIDES_QBSP)
-                Error("MAX_MAP_BRUSHSIDES_QBSP");
-        } else if (nummapbrushsides == MAX_MAP_BRUSHSIDES)
-            Error("MAX_MAP_BRUSHSIDES");
-        side = &brushsides[nummapbrushsides];
+        if (numrawsides == maxrawsides) {
+            maxrawsides = maxrawsides ? maxrawsides * 2 : 8192;
+            rawsides    = realloc(rawsides, maxrawsides * sizeof(*rawsides));
+            if (!rawsides)
+                Error("TokenizeBrush: out of memory");
+        }
+        side = &rawsides[numrawsides];
+        memset(side, 0, sizeof(*side));
 
         // read the three point plane definition
         for (i = 0; i < 3; i++) {
@@ -532,7 +679,7 @@ void ParseBrush(entity_t *mapent) {
 
             for (j = 0; j < 3; j++) {
                 GetToken(false);
-                planepts[i][j] = atof(token);
+                side->planepts[i][j] = atof(token);
             }
 
             GetToken(false);
@@ -547,15 +694,15 @@ void ParseBrush(entity_t *mapent) {
         if (!strcmp(token, "__TB_empty")) {
             printf("Face without texture ( %s ) at line %i\n", token, scriptline + 1);
         }
-        strcpy(td.name, token);
+        strcpy(side->td.name, token);
 
         // DarkEssence: take parms according to mapversion
         if (g_nMapFileVersion < 220) // old #mapversion
         {
             GetToken(false);
-            td.shift[0] = atoi(token);
+            side->td.shift[0] = atoi(token);
             GetToken(false);
-            td.shift[1] = atoi(token);
+            side->td.shift[1] = atoi(token);
         } else // new #mapversion
         {
             GetToken(false);
@@ -564,13 +711,13 @@ void ParseBrush(entity_t *mapent) {
             }
 
             GetToken(false);
-            UVaxis[0] = atof(token);
+            side->UVaxis[0] = atof(token);
             GetToken(false);
-            UVaxis[1] = atof(token);
+            side->UVaxis[1] = atof(token);
             GetToken(false);
-            UVaxis[2] = atof(token);
+            side->UVaxis[2] = atof(token);
             GetToken(false);
-            td.shift[0] = atof(token);
+            side->td.shift[0] = atof(token);
 
             GetToken(false);
             if (strcmp(token, "]")) {
@@ -584,13 +731,13 @@ void ParseBrush(entity_t *mapent) {
             }
 
             GetToken(false);
-            UVaxis[3] = atof(token);
+            side->UVaxis[3] = atof(token);
             GetToken(false);
-            UVaxis[4] = atof(token);
+            side->UVaxis[4] = atof(token);
             GetToken(false);
-            UVaxis[5] = atof(token);
+            side->UVaxis[5] = atof(token);
             GetToken(false);
-            td.shift[1] = atof(token);
+            side->td.shift[1] = atof(token);
 
             GetToken(false);
             if (strcmp(token, "]")) {
@@ -599,26 +746,26 @@ void ParseBrush(entity_t *mapent) {
         }
 
         GetToken(false);
-        td.rotate = atoi(token);
+        side->td.rotate = atoi(token);
         GetToken(false);
-        td.scale[0] = atof(token);
+        side->td.scale[0] = atof(token);
         GetToken(false);
-        td.scale[1]    = atof(token);
+        side->td.scale[1] = atof(token);
 
         // find default flags and values
-        mt             = FindMiptex(td.name);
-        td.flags       = textureref[mt].flags;
-        td.value       = textureref[mt].value;
-        side->contents = textureref[mt].contents;
-        side->surf = td.flags = textureref[mt].flags;
+        mt                = FindMiptex(side->td.name);
+        side->td.flags    = textureref[mt].flags;
+        side->td.value    = textureref[mt].value;
+        side->contents    = textureref[mt].contents;
+        side->surf = side->td.flags = textureref[mt].flags;
 
         if (TokenAvailable()) {
             GetToken(false);
             side->contents = atoi(token);
             GetToken(false);
-            side->surf = td.flags = atoi(token);
+            side->surf = side->td.flags = atoi(token);
             GetToken(false);
-            td.value = atoi(token);
+            side->td.value = atoi(token);
         }
 
         // translucent objects are automatically classified as detail
@@ -645,12 +792,241 @@ void ParseBrush(entity_t *mapent) {
             }
         }
 
+        side->line = scriptline;
+        numrawsides++;
+        rb->numsides++;
+    } while (true);
+
+    rb->line = scriptline;
+    numrawbrushes++;
+}
+
+/*
+=================
+PredictBrushPlanes
+
+Looks up the planes of all raw brushes in map order and drops the sides that
+will come out as duplicated or mirrored.  The plane table is put back the way
+it was afterwards; the bevels CommitBrush adds can still change what a later
+lookup finds, which CommitBrush checks for.
+=================
+*/
+void PredictBrushPlanes(void) {
+    rawbrush_t *rb;
+    rawside_t *side, *s2;
+    int32_t i, j, k;
+    int32_t oldnumplanes;
+    plane_t **oldplanehash;
+    vec3_t t1, t2, normal;
+    vec_t dist;
+
+    oldnumplanes = nummapplanes;
+    oldplanehash = malloc(sizeof(planehash));
+    memcpy(oldplanehash, planehash, sizeof(planehash));
+
+    for (i = 0; i < numrawbrushes; i++) {
+        rb = &rawbrushes[i];
+        for (j = 0; j < rb->numsides; j++) {
+            side = &rawsides[rb->firstside + j];
+
+            VectorSubtract(side->planepts[0], side->planepts[1], t1);
+            VectorSubtract(side->planepts[2], side->planepts[1], t2);
+            CrossProduct(t1, t2, normal);
+            VectorNormalize(normal, normal);
+            dist = DotProduct(side->planepts[0], normal);
+
+            // leave bad planes and table overflows to CommitBrush, so
+            // the error comes out at the same point it always did
+            if (VectorLength(normal) < 0.5 || nummapplanes + 2 > (use_qbsp ? MAX_MAP_PLANES_QBSP : MAX_MAP_PLANES)) {
+                side->planenum = -1;
+                continue;
+            }
+
+            side->planenum  = FindFloatPlane(normal, dist, i);
+            side->plane     = mapplanes[side->planenum];
+            side->backplane = mapplanes[side->planenum ^ 1];
+
+            for (k = 0; k < j; k++) {
+                s2 = &rawsides[rb->firstside + k];
+                if (s2->keep && (s2->planenum == side->planenum || s2->planenum == (side->planenum ^ 1)))
+                    break;
+            }
+            side->keep = (k == j);
+        }
+    }
+
+    nummapplanes = oldnumplanes;
+    memcpy(planehash, oldplanehash, sizeof(planehash));
+    free(oldplanehash);
+}
+
+/*
+=================
+BuildBrushGeometry
+
+Threaded.  Makes the windings, bounds and edge bevel candidates for a raw
+brush from the planes PredictBrushPlanes found.  Nothing global is touched.
+=================
+*/
+void BuildBrushGeometry(int32_t brushnum) {
+    rawbrush_t *rb;
+    rawside_t *side, **kept;
+    int32_t i, j, numkept;
+    int32_t axis, dir, order, numorder;
+    vec_t *tempnormal;
+    vec_t **ordnormals;
+    winding_t **ordwindings, *w;
+    fixedwinding_t fw;
+    vec3_t axials[6];
+
+    rb      = &rawbrushes[brushnum];
+    kept    = malloc((rb->numsides + 6) * sizeof(*kept));
+
+    numkept = 0;
+    for (i = 0; i < rb->numsides; i++) {
+        side = &rawsides[rb->firstside + i];
+        if (side->keep)
+            kept[numkept++] = side;
+    }
+
+    //
+    // windings and bounds, as in MakeBrushWindings
+    //
+    ClearBounds(rb->mins, rb->maxs);
+    for (i = 0; i < numkept; i++) {
+        BaseFixedWindingForPlane(&fw, kept[i]->plane.normal, kept[i]->plane.dist);
+        for (j = 0; j < numkept; j++) {
+            if (i == j)
+                continue;
+            if (!ChopFixedWindingInPlace(&fw, kept[j]->backplane.normal, kept[j]->backplane.dist, 0))
+                break;
+        }
+
+        w                = CopyFixedWinding(&fw);
+        kept[i]->winding = w;
+        if (w) {
+            for (j = 0; j < w->numpoints; j++)
+                AddPointToBounds(w->p[j], rb->mins, rb->maxs);
+        }
+    }
+
+    //
+    // put the sides in the order the axial bevels of AddBrushBevels
+    // will leave them in, then find the edge bevels
+    //
+    ordnormals  = malloc((numkept + 6) * sizeof(*ordnormals));
+    ordwindings = malloc((numkept + 6) * sizeof(*ordwindings));
+    for (i = 0; i < numkept; i++) {
+        ordnormals[i]  = kept[i]->plane.normal;
+        ordwindings[i] = kept[i]->winding;
+    }
+    numorder = numkept;
+
+    order    = 0;
+    for (axis = 0; axis < 3; axis++) {
+        for (dir = -1; dir <= 1; dir += 2, order++) {
+            for (i = 0; i < numorder; i++) {
+                if (ordnormals[i][axis] == dir)
+                    break;
+            }
+
+            if (i == numorder) {
+                VectorClear(axials[order]);
+                axials[order][axis] = dir;
+                ordnormals[i]       = axials[order];
+                ordwindings[i]      = NULL;
+                numorder++;
+            }
+
+            if (i != order) {
+                tempnormal         = ordnormals[order];
+                ordnormals[order]  = ordnormals[i];
+                ordnormals[i]      = tempnormal;
+
+                w                  = ordwindings[order];
+                ordwindings[order] = ordwindings[i];
+                ordwindings[i]     = w;
+            }
+        }
+    }
+
+    if (numorder != 6)
+        rb->numbevels = EdgeBevelCandidates(ordwindings, numorder, &rb->bevels);
+
+    free(ordnormals);
+    free(ordwindings);
+    free(kept);
+}
+
+/*
+=================
+FreeRawBrush
+=================
+*/
+void FreeRawBrush(rawbrush_t *rb) {
+    int32_t i;
+
+    for (i = 0; i < rb->numsides; i++) {
+        if (rawsides[rb->firstside + i].winding)
+            FreeWinding(rawsides[rb->firstside + i].winding);
+        rawsides[rb->firstside + i].winding = NULL;
+    }
+    if (rb->bevels)
+        free(rb->bevels);
+    rb->bevels    = NULL;
+    rb->numbevels = 0;
+}
+
+/*
+=================
+CommitBrush
+
+Adds a raw brush to mapbrushes.  The planes are looked up in map order,
+and the geometry from BuildBrushGeometry is used if the planes came out
+the same, otherwise it is rebuilt here.
+=================
+*/
+void CommitBrush(entity_t *mapent, rawbrush_t *rb) {
+    mapbrush_t *b;
+    int32_t i, k;
+    rawside_t *raw;
+    side_t *side, *s2;
+    int32_t planenum;
+    qboolean prebuilt;
+
+    if (use_qbsp) {
+        if (nummapbrushes == MAX_MAP_BRUSHES_QBSP)
+            Error("nummapbrushes == MAX_MAP_BRUSHES_QBSP  (%i)", MAX_MAP_BRUSHES_QBSP);
+    } else if (nummapbrushes == MAX_MAP_BRUSHES)
+        Error("nummapbrushes == MAX_MAP_BRUSHES  (%i)", MAX_MAP_BRUSHES);
+
+    b                 = &mapbrushes[nummapbrushes];
+    b->original_sides = &brushsides[nummapbrushsides];
+    b->entitynum      = num_entities - 1;
+    b->brushnum       = nummapbrushes - mapent->firstbrush;
+
+    g_nMapFileVersion = rb->mapversion;
+    prebuilt          = true;
+
+    for (raw = &rawsides[rb->firstside]; raw < &rawsides[rb->firstside + rb->numsides]; raw++) {
+        scriptline = raw->line; // for messages
+
+        if (use_qbsp) {
+            if (nummapbrushsides == MAX_MAP_BRUSHSIDES_QBSP)
+                Error("MAX_MAP_BRUSHSIDES_QBSP");
+        } else if (nummapbrushsides == MAX_MAP_BRUSHSIDES)
+            Error("MAX_MAP_BRUSHSIDES");
+        side           = &brushsides[nummapbrushsides];
+        side->contents = raw->contents;
+        side->surf     = raw->surf;
+
         //
         // find the plane number
         //
-        planenum = PlaneFromPoints(planepts[0], planepts[1], planepts[2], b);
+        planenum = PlaneFromPoints(raw->planepts[0], raw->planepts[1], raw->planepts[2], b);
         if (planenum == -1) {
             printf("Entity %i, Brush %i, Line %i: plane with no normal\n", b->entitynum, b->brushnum, scriptline + 1); // qb: add scriptline
+            prebuilt = false;
             continue;
         }
 
@@ -669,8 +1045,17 @@ void ParseBrush(entity_t *mapent) {
             }
         }
 
-        if (k != b->numsides)
+        if (k != b->numsides) {
+            if (raw->keep)
+                prebuilt = false;
             continue; // duplicated
+        }
+
+        // the prebuilt windings are only good if this plane, and its
+        // flip side, are exactly the ones they were clipped with
+        if (!raw->keep || !PlaneExactlyEqual(&mapplanes[planenum], &raw->plane) ||
+            !PlaneExactlyEqual(&mapplanes[planenum ^ 1], &raw->backplane))
+            prebuilt = false;
 
         //
         // keep this side
@@ -679,16 +1064,18 @@ void ParseBrush(entity_t *mapent) {
         side           = b->original_sides + b->numsides;
         side->planenum = planenum;
         if (g_nMapFileVersion < 220) // DarkEssence: texinfo #mapversion
-            side->texinfo = TexinfoForBrushTexture(&mapplanes[planenum], &td, vec3_origin);
+            side->texinfo = TexinfoForBrushTexture(&mapplanes[planenum], &raw->td, vec3_origin);
         else // texinfo for #mapversion 220
-            side->texinfo = TexinfoForBrushTexture_UV(&td, UVaxis);
+            side->texinfo = TexinfoForBrushTexture_UV(&raw->td, raw->UVaxis);
 
         // save the td off in case there is an origin brush and we have to recalculate the texinfo
-        side_brushtextures[nummapbrushsides] = td;
+        side_brushtextures[nummapbrushsides] = raw->td;
 
         nummapbrushsides++;
         b->numsides++;
-    } while (true);
+    }
+
+    scriptline  = rb->line;
 
     // get the content for the entire brush
     b->contents = BrushContents(b);
@@ -696,17 +1083,37 @@ void ParseBrush(entity_t *mapent) {
     // allow detail brushes to be removed
     if (nodetail && (b->contents & CONTENTS_DETAIL)) {
         b->numsides = 0;
+        FreeRawBrush(rb);
         return;
     }
 
     // allow water brushes to be removed
     if (nowater && (b->contents & (CONTENTS_LAVA | CONTENTS_SLIME | CONTENTS_WATER))) {
         b->numsides = 0;
+        FreeRawBrush(rb);
         return;
     }
 
     // create windings for sides and bounds for brush
-    MakeBrushWindings(b);
+    if (prebuilt) {
+        side = b->original_sides;
+        for (raw = &rawsides[rb->firstside]; raw < &rawsides[rb->firstside + rb->numsides]; raw++) {
+            if (!raw->keep)
+                continue;
+            side->winding = raw->winding;
+            if (side->winding)
+                side->visible = true;
+            raw->winding = NULL;
+            side++;
+        }
+        VectorCopy(rb->mins, b->mins);
+        VectorCopy(rb->maxs, b->maxs);
+        CheckBrushBounds(b);
+    } else {
+        FreeRawBrush(rb);
+        MakeBrushWindings(b);
+        c_rebuiltbrushes++;
+    }
 
     // brushes that will not be visible at all will never be
     // used as bsp splitters
@@ -740,10 +1147,12 @@ void ParseBrush(entity_t *mapent) {
         // don't keep this brush
         b->numsides = 0;
 
+        FreeRawBrush(rb);
         return;
     }
 
-    AddBrushBevels(b);
+    AddBrushBevels(b, rb->bevels, prebuilt ? rb->numbevels : -1);
+    FreeRawBrush(rb);
 
     nummapbrushes++;
     mapent->numbrushes++;
@@ -798,11 +1207,13 @@ void MoveBrushesToWorld(entity_t *mapent) {
 
 /*
 ================
-ParseMapEntity
+TokenizeMapEntity
+
+Reads the key/value pairs of an entity and its brushes as raw brush records
 ================
 */
-qboolean ParseMapEntity(void) {
-    mapbrush_t *b;
+qboolean TokenizeMapEntity(void) {
+    rawentity_t *re;
 
     if (!GetToken(true))
         return false;
@@ -823,12 +1234,12 @@ qboolean ParseMapEntity(void) {
     }
 
     entity_t *mapent = &entities[num_entities];
+    re               = &rawentities[num_entities];
     num_entities++;
     memset(mapent, 0, sizeof(*mapent));
-    mapent->firstbrush = nummapbrushes;
-    mapent->numbrushes = 0;
     //	mapent->portalareas[0] = -1;
     //	mapent->portalareas[1] = -1;
+    re->firstbrush = numrawbrushes;
 
     do {
         if (!GetToken(true))
@@ -837,7 +1248,7 @@ qboolean ParseMapEntity(void) {
             break;
 
         if (!strcmp(token, "{")) {
-            ParseBrush(mapent);
+            TokenizeBrush();
         } else {
             epair_t *e     = ParseEpair();
             e->next        = mapent->epairs;
@@ -851,6 +1262,35 @@ qboolean ParseMapEntity(void) {
         }
     } while (true);
 
+    re->numbrushes = numrawbrushes - re->firstbrush;
+    re->mapversion = g_nMapFileVersion;
+
+    return true;
+}
+
+/*
+================
+FinishMapEntity
+
+Commits the brushes of a tokenized entity, in map order
+================
+*/
+void FinishMapEntity(int32_t entitynum) {
+    mapbrush_t *b;
+    rawentity_t *re;
+    int32_t i;
+
+    entity_t *mapent   = &entities[entitynum];
+    re                 = &rawentities[entitynum];
+    num_entities       = entitynum + 1; // as it was when the entity was parsed
+    mapent->firstbrush = nummapbrushes;
+    mapent->numbrushes = 0;
+
+    for (i = 0; i < re->numbrushes; i++)
+        CommitBrush(mapent, &rawbrushes[re->firstbrush + i]);
+
+    g_nMapFileVersion = re->mapversion;
+
     GetVectorForKey(mapent, "origin", mapent->origin);
 
     //
@@ -879,7 +1319,7 @@ qboolean ParseMapEntity(void) {
     if (!strcmp("func_group", ValueForKey(mapent, "classname"))) {
         MoveBrushesToWorld(mapent);
         mapent->numbrushes = 0;
-        return true;
+        return;
     }
 
     // areaportal entities move their brushes, but don't eliminate
@@ -898,10 +1338,7 @@ qboolean ParseMapEntity(void) {
         sprintf(str, "%i", c_areaportals);
         SetKeyValue(mapent, "style", str);
         MoveBrushesToWorld(mapent);
-        return true;
     }
-
-    return true;
 }
 
 //===================================================================
@@ -913,6 +1350,9 @@ LoadMapFile
 */
 void LoadMapFile(char *filename) {
     int32_t i;
+    int32_t numentities_read;
+    int32_t numthreads_saved;
+    int32_t line;
 
     qprintf("--- LoadMapFile ---\n");
 
@@ -920,10 +1360,33 @@ void LoadMapFile(char *filename) {
 
     nummapbrushsides = 0;
     num_entities     = 0;
+    numrawsides      = 0;
+    numrawbrushes    = 0;
 
-    while (ParseMapEntity()) {
+    while (TokenizeMapEntity()) {
     }
 
+    PredictBrushPlanes();
+
+    // planes, windings and bevels for all brushes
+    numthreads_saved = numthreads;
+    numthreads       = bspthreads;
+    RunThreadsOnIndividual(numrawbrushes, false, BuildBrushGeometry);
+    numthreads       = numthreads_saved;
+
+    numentities_read = num_entities;
+    line             = scriptline;
+    for (i = 0; i < numentities_read; i++)
+        FinishMapEntity(i);
+    scriptline = line;
+
+    free(rawsides);
+    free(rawbrushes);
+    rawsides      = NULL;
+    rawbrushes    = NULL;
+    maxrawsides   = 0;
+    maxrawbrushes = 0;
+
     ClearBounds(map_mins, map_maxs);
     for (i = 0; i < entities[0].numbrushes; i++) {
         if (mapbrushes[i].mins[0] > max_bounds)
@@ -934,6 +1397,7 @@ void LoadMapFile(char *filename) {
 
     qprintf("%5i brushes\n", nummapbrushes);
     qprintf("%5i clipbrushes\n", c_clipbrushes);
+    qprintf("%5i rebuilt brushes\n", c_rebuiltbrushes);
     qprintf("%5i total sides\n", nummapbrushsides);
     qprintf("%5i boxbevels\n", c_boxbevels);
     qprintf("%5i edgebevels\n", c_edgebevels);
@@ -0,0 +1,231 @@
+/*
+===========================================================================
+Copyright (C) 1997-2006 Id Software, Inc.
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+===========================================================================
+*/
+
+#include "cmdlib.h"
+#include "threads.h"
+#include "memlib.h"
+
+#define BLOCK_GRANULE   16
+#define MAX_BLOCK_SIZE  4096 // bigger blocks go straight to malloc
+#define NUM_BLOCK_SIZES (MAX_BLOCK_SIZE / BLOCK_GRANULE + 1)
+#define CHUNK_SIZE      0x40000
+
+#define BLOCK_INUSE     0x1b10c0de
+#define BLOCK_FREE      0xdeaddead
+
+typedef struct blockheader_s {
+    struct blockheader_s *next; // on a free list
+    int32_t sizeclass;          // -1 if it came straight from malloc
+    uint32_t state;
+} blockheader_t;
+
+// keeps the blocks aligned for doubles
+#define HEADER_SIZE ((sizeof(blockheader_t) + 15) & ~15)
+
+typedef struct chunk_s {
+    struct chunk_s *next;
+} chunk_t;
+
+#define CHUNK_HEADER ((sizeof(chunk_t) + 15) & ~15)
+
+// sits in front of the header of a block bigger than MAX_BLOCK_SIZE,
+// so FreeAllBlocks can find the ones that are still in use
+typedef struct bigblock_s {
+    struct bigblock_s *next;
+    struct bigblock_s **link; // whatever points at this one
+    int32_t size;
+} bigblock_t;
+
+#define BIG_HEADER ((sizeof(bigblock_t) + 15) & ~15)
+
+typedef struct
+{
+    blockheader_t *free[NUM_BLOCK_SIZES];
+    byte *chunk_p, *chunk_end;
+    chunk_t *chunks;
+    bigblock_t *big;
+    int32_t allocs, mallocs;
+} blockslot_t;
+
+// each thread only ever touches its own slot, so nothing here needs a lock,
+// except the big lists: a big block can be freed by another thread
+static blockslot_t blockslots[MAX_THREADS];
+
+qboolean memdebug = false;
+
+static void NewChunk(blockslot_t *slot) {
+    chunk_t *c;
+
+    c = malloc(CHUNK_SIZE);
+    if (!c)
+        Error("AllocBlock: out of memory");
+    slot->mallocs++;
+
+    c->next         = slot->chunks;
+    slot->chunks    = c;
+    slot->chunk_p   = (byte *)c + CHUNK_HEADER;
+    slot->chunk_end = (byte *)c + CHUNK_SIZE;
+}
+
+/*
+=============
+AllocBlock
+=============
+*/
+void *AllocBlock(int32_t size) {
+    blockslot_t *slot;
+    blockheader_t *b;
+    bigblock_t *big;
+    int32_t sizeclass, total;
+
+    slot = &blockslots[ThreadNum()];
+    slot->allocs++;
+
+    if (size > MAX_BLOCK_SIZE) {
+        big = malloc(BIG_HEADER + HEADER_SIZE + size);
+        if (!big)
+            Error("AllocBlock: out of memory on %i bytes", size);
+        slot->mallocs++;
+        big->size = size;
+
+        ThreadLock();
+        big->next = slot->big;
+        if (big->next)
+            big->next->link = &big->next;
+        big->link = &slot->big;
+        slot->big = big;
+        ThreadUnlock();
+
+        b            = (blockheader_t *)((byte *)big + BIG_HEADER);
+        b->sizeclass = -1;
+    } else {
+        sizeclass = (size + BLOCK_GRANULE - 1) / BLOCK_GRANULE;
+        if (!sizeclass)
+            sizeclass = 1;
+
+        b = slot->free[sizeclass];
+        if (b)
+            slot->free[sizeclass] = b->next;
+        else {
+            total = HEADER_SIZE + sizeclass * BLOCK_GRANULE;
+            if (slot->chunk_end - slot->chunk_p < total)
+                NewChunk(slot);
+            b = (blockheader_t *)slot->chunk_p;
+            slot->chunk_p += total;
+        }
+        b->sizeclass = sizeclass;
+    }
+
+    b->state = BLOCK_INUSE;
+    memset((byte *)b + HEADER_SIZE, 0, size);
+
+    return (byte *)b + HEADER_SIZE;
+}
+
+/*
+=============
+FreeBlock
+
+Puts the block on the free list of the calling thread
+=============
+*/
+void FreeBlock(void *block) {
+    blockslot_t *slot;
+    blockheader_t *b;
+    bigblock_t *big;
+    uint32_t *fill;
+    int32_t i, size;
+
+    b = (blockheader_t *)((byte *)block - HEADER_SIZE);
+    if (b->state == BLOCK_FREE)
+        Error("FreeBlock: freed a freed block");
+    if (b->state != BLOCK_INUSE)
+        Error("FreeBlock: not an allocated block");
+    b->state = BLOCK_FREE;
+
+    if (memdebug) {
+        // keep it out of circulation so a second free or a stale pointer shows up
+        // and FreeAllBlocks still gets the big ones back
+        if (b->sizeclass < 0)
+            size = ((bigblock_t *)((byte *)b - BIG_HEADER))->size;
+        else
+            size = b->sizeclass * BLOCK_GRANULE;
+        fill = (uint32_t *)block;
+        for (i = 0; i < size / 4; i++)
+            fill[i] = BLOCK_FREE;
+        return;
+    }
+
+    if (b->sizeclass < 0) {
+        big = (bigblock_t *)((byte *)b - BIG_HEADER);
+        ThreadLock();
+        *big->link = big->next;
+        if (big->next)
+            big->next->link = big->link;
+        ThreadUnlock();
+        free(big);
+        return;
+    }
+
+    slot                     = &blockslots[ThreadNum()];
+    b->next                  = slot->free[b->sizeclass];
+    slot->free[b->sizeclass] = b;
+}
+
+/*
+=============
+FreeAllBlocks
+
+Hands every chunk and big block back at once, blocks still in use included
+=============
+*/
+void FreeAllBlocks(void) {
+    blockslot_t *slot;
+    chunk_t *c, *next;
+    bigblock_t *big, *nextbig;
+
+    for (slot = blockslots; slot < blockslots + MAX_THREADS; slot++) {
+        for (c = slot->chunks; c; c = next) {
+            next = c->next;
+            free(c);
+        }
+        for (big = slot->big; big; big = nextbig) {
+            nextbig = big->next;
+            free(big);
+        }
+        slot->big       = NULL;
+        memset(slot->free, 0, sizeof(slot->free));
+        slot->chunks    = NULL;
+        slot->chunk_p   = NULL;
+        slot->chunk_end = NULL;
+    }
+}
+
+void PrintBlockStats(void) {
+    int32_t i, allocs = 0, mallocs = 0;
+
+    for (i = 0; i < MAX_THREADS; i++) {
+        allocs += blockslots[i].allocs;
+        mallocs += blockslots[i].mallocs;
+    }
+
+    qprintf("%9i blocks allocated\n", allocs);
+    qprintf("%9i mallocs for them\n", mallocs);
+}
@@ -0,0 +1,32 @@
+/*
+===========================================================================
+Copyright (C) 1997-2006 Id Software, Inc.
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+===========================================================================
+*/
+
+// memlib.h -- small object blocks for windings, brushes, nodes, portals and faces
+
+// blocks come out of per thread chunks and go back on per thread free lists
+// sorted by size, so the tools don't hit malloc for every small object.
+// a block may be freed by a different thread than the one that allocated it.
+
+extern qboolean memdebug; // never reuse a freed block, fill it with 0xdeaddead instead
+
+void *AllocBlock(int32_t size); // zero filled
+void FreeBlock(void *block);
+void FreeAllBlocks(void); // only when no threads are running and no block is in use
+void PrintBlockStats(void);
@@ -20,11 +20,17 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #include "qrad.h"
 
-vec3_t texture_reflectivity[MAX_MAP_TEXINFO_QBSP];
+vec3_t *texture_reflectivity;
 
 int32_t cluster_neg_one = 0;
-float *texture_data[MAX_MAP_TEXINFO_QBSP];
-int32_t texture_sizes[MAX_MAP_TEXINFO_QBSP][2];
+float **texture_data;
+int32_t (*texture_sizes)[2];
+
+static void AllocTextureArrays(void) {
+    texture_reflectivity = AllocRadArray(texture_reflectivity, numtexinfo, sizeof(texture_reflectivity[0]));
+    texture_data         = AllocRadArray(texture_data, numtexinfo, sizeof(texture_data[0]));
+    texture_sizes        = AllocRadArray(texture_sizes, numtexinfo, sizeof(texture_sizes[0]));
+}
 /*
 ===================================================================
 
@@ -49,6 +55,7 @@ void CalcTextureReflectivity_Heretic2( void ){
 	miptex_m32_t        *mt32;
 	byte            *pos;
 
+	AllocTextureArrays();
 
 	// allways set index 0 even if no textures
 	texture_reflectivity[0][0] = 0.5;
@@ -133,6 +140,8 @@ void CalcTextureReflectivity(void) {
     float c;
     byte *pbuffer = NULL; // mxd. "potentially uninitialized local pointer variable" in VS2017 if uninitialized
 
+    AllocTextureArrays();
+
     byte *palette_frompak = NULL;
     byte *ptexel;
     byte *palette;
@@ -623,6 +632,17 @@ void MakePatches(void) {
 
     qprintf("%i faces\n", numfaces);
 
+    face_patches = AllocRadArray(face_patches, numfaces, sizeof(face_patches[0]));
+    face_entity  = AllocRadArray(face_entity, numfaces, sizeof(face_entity[0]));
+    face_offset  = AllocRadArray(face_offset, numfaces, sizeof(face_offset[0]));
+
+    // patches link to each other by pointer so they can't move once made,
+    // untouched pages of the calloc cost nothing
+    patches = AllocRadArray(patches, use_qbsp ? MAX_PATCHES_QBSP : MAX_PATCHES, sizeof(patches[0]));
+
+    // room for one fake plane per face, patch planes point into dplanes
+    ReserveLump(dplanes, numplanes + numfaces);
+
     for (i = 0; i < nummodels; i++) {
         mod = &dmodels[i];
         ent = EntityForModel(i);
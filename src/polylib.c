@@ -21,8 +21,9 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "cmdlib.h"
 #include "mathlib.h"
 #include "polylib.h"
+#include "threads.h"
+#include "memlib.h"
 
-extern int32_t numthreads;
 
 // counters are only bumped when running single threaded,
 // because they are an awefull coherence problem
@@ -53,20 +54,16 @@ winding_t *AllocWinding(int32_t points) {
         if (c_active_windings > c_peak_windings)
             c_peak_windings = c_active_windings;
     }
-    s = sizeof(vec_t) * 3 * points + sizeof(int32_t);
-    w = malloc(s);
-    memset(w, 0, s);
+    s = (intptr_t) & (((winding_t *)0)->p[points]);
+    w = AllocBlock(s);
     return w;
 }
 
 void FreeWinding(winding_t *w) {
-    if (*(unsigned *)w == 0xdeaddead)
-        Error("FreeWinding: freed a freed winding");
-    *(unsigned *)w = 0xdeaddead;
-
+    // FreeBlock catches a winding freed twice
     if (numthreads == 1)
         c_active_windings--;
-    free(w);
+    FreeBlock(w);
 }
 
 /*
@@ -177,14 +174,15 @@ void WindingCenter(winding_t *w, vec3_t center) {
 
 /*
 =================
-BaseWindingForPlane
+BaseWindingPoints
+
+Projects a really big axis aligned box onto the plane
 =================
 */
-winding_t *BaseWindingForPlane(vec3_t normal, vec_t dist) {
+static void BaseWindingPoints(vec3_t normal, vec_t dist, winding_t *w) {
     int32_t i, x;
     vec_t max, v;
     vec3_t org, vright, vup;
-    winding_t *w;
 
     // find the major axis
 
@@ -222,9 +220,6 @@ winding_t *BaseWindingForPlane(vec3_t normal, vec_t dist) {
     VectorScale(vup, BOGUS_RANGE, vup);
     VectorScale(vright, BOGUS_RANGE, vright);
 
-    // project a really big	axis aligned box onto the plane
-    w = AllocWinding(4);
-
     VectorSubtract(org, vright, w->p[0]);
     VectorAdd(w->p[0], vup, w->p[0]);
 
@@ -238,6 +233,18 @@ winding_t *BaseWindingForPlane(vec3_t normal, vec_t dist) {
     VectorSubtract(w->p[3], vup, w->p[3]);
 
     w->numpoints = 4;
+}
+
+/*
+=================
+BaseWindingForPlane
+=================
+*/
+winding_t *BaseWindingForPlane(vec3_t normal, vec_t dist) {
+    winding_t *w;
+
+    w = AllocWinding(4);
+    BaseWindingPoints(normal, dist, w);
 
     return w;
 }
@@ -274,17 +281,84 @@ winding_t *ReverseWinding(winding_t *w) {
     return c;
 }
 
+/*
+==================
+SetFixedWinding
+
+Puts the points in the fixed winding, or in a heap winding if they don't fit.
+points must not be the fixed winding's own.
+==================
+*/
+static void SetFixedWinding(fixedwinding_t *fw, vec3_t *points, int32_t numpoints) {
+    winding_t *w;
+
+    if (fw->spill) {
+        FreeWinding(fw->spill);
+        fw->spill = NULL;
+    }
+    if (numpoints > MAX_POINTS_ON_FIXED_WINDING)
+        fw->spill = AllocWinding(numpoints);
+
+    w            = FixedWindingPoints(fw);
+    w->numpoints = numpoints;
+    memcpy(w->p, points, numpoints * sizeof(vec3_t));
+    fw->numpoints = numpoints;
+}
+
+/*
+==================
+BaseFixedWindingForPlane
+==================
+*/
+void BaseFixedWindingForPlane(fixedwinding_t *fw, vec3_t normal, vec_t dist) {
+    fw->spill = NULL;
+    BaseWindingPoints(normal, dist, (winding_t *)fw);
+}
+
+/*
+==================
+CopyFixedWinding
+==================
+*/
+winding_t *CopyFixedWinding(fixedwinding_t *fw) {
+    winding_t *w;
+
+    w = fw->spill;
+    if (w) // already on the heap, hand it over
+        fw->spill = NULL;
+    else if (fw->numpoints)
+        w = CopyWinding((winding_t *)fw);
+
+    fw->numpoints = 0;
+    return w;
+}
+
+/*
+==================
+FreeFixedWinding
+==================
+*/
+void FreeFixedWinding(fixedwinding_t *fw) {
+    if (fw->spill) {
+        FreeWinding(fw->spill);
+        fw->spill = NULL;
+    }
+    fw->numpoints = 0;
+}
+
 /*
 =============
-ClipWindingEpsilon
+ClipFixedWindingEpsilon
+
+Like ClipWindingEpsilon, but the pieces go into fixed windings
 =============
 */
-void ClipWindingEpsilon(
+void ClipFixedWindingEpsilon(
     const winding_t *in,
     const vec3_t normal,
     const vec_t dist,
     const vec_t epsilon,
-    winding_t **front, winding_t **back) {
+    fixedwinding_t *front, fixedwinding_t *back) {
     vec_t dists[MAX_POINTS_ON_WINDING + 4];
     int32_t sides[MAX_POINTS_ON_WINDING + 4];
     int32_t counts[3];
@@ -292,7 +366,8 @@ void ClipWindingEpsilon(
     int32_t i, j;
     vec_t *p1, *p2;
     vec3_t mid;
-    winding_t *f, *b;
+    vec3_t f[MAX_POINTS_ON_WINDING + 4], b[MAX_POINTS_ON_WINDING + 4];
+    int32_t numf, numb;
     int32_t maxpts;
 
     counts[0] = counts[1] = counts[2] = 0;
@@ -314,40 +389,44 @@ void ClipWindingEpsilon(
     sides[i] = sides[0];
     dists[i] = dists[0];
 
-    *front = *back = NULL;
+    front->numpoints = 0;
+    front->spill     = NULL;
+    if (back) {
+        back->numpoints = 0;
+        back->spill     = NULL;
+    }
 
     if (!counts[0]) {
-        *back = CopyWinding(in);
+        if (back)
+            SetFixedWinding(back, ((winding_t *)in)->p, in->numpoints);
         return;
     }
     if (!counts[1]) {
-        *front = CopyWinding(in);
+        SetFixedWinding(front, ((winding_t *)in)->p, in->numpoints);
         return;
     }
 
     maxpts = in->numpoints + 4; // cant use counts[0]+2 because of fp grouping errors
-
-    *front = f = AllocWinding(maxpts);
-    *back = b = AllocWinding(maxpts);
+    numf = numb = 0;
 
     for (i = 0; i < in->numpoints; i++) {
         p1 = ((winding_t *)in)->p[i];
 
         if (sides[i] == SIDE_ON) {
-            VectorCopy(p1, f->p[f->numpoints]);
-            f->numpoints++;
-            VectorCopy(p1, b->p[b->numpoints]);
-            b->numpoints++;
+            VectorCopy(p1, f[numf]);
+            numf++;
+            VectorCopy(p1, b[numb]);
+            numb++;
             continue;
         }
 
         if (sides[i] == SIDE_FRONT) {
-            VectorCopy(p1, f->p[f->numpoints]);
-            f->numpoints++;
+            VectorCopy(p1, f[numf]);
+            numf++;
         }
         if (sides[i] == SIDE_BACK) {
-            VectorCopy(p1, b->p[b->numpoints]);
-            b->numpoints++;
+            VectorCopy(p1, b[numb]);
+            numb++;
         }
 
         if (sides[i + 1] == SIDE_ON || sides[i + 1] == sides[i])
@@ -367,36 +446,60 @@ void ClipWindingEpsilon(
                 mid[j] = p1[j] + dot * (p2[j] - p1[j]);
         }
 
-        VectorCopy(mid, f->p[f->numpoints]);
-        f->numpoints++;
-        VectorCopy(mid, b->p[b->numpoints]);
-        b->numpoints++;
+        VectorCopy(mid, f[numf]);
+        numf++;
+        VectorCopy(mid, b[numb]);
+        numb++;
     }
 
-    if (f->numpoints > maxpts || b->numpoints > maxpts)
+    if (numf > maxpts || numb > maxpts)
         Error("ClipWinding: points exceeded estimate");
-    if (f->numpoints > MAX_POINTS_ON_WINDING || b->numpoints > MAX_POINTS_ON_WINDING)
+    if (numf > MAX_POINTS_ON_WINDING || numb > MAX_POINTS_ON_WINDING)
         Error("ClipWinding: MAX_POINTS_ON_WINDING");
+
+    SetFixedWinding(front, f, numf);
+    if (back)
+        SetFixedWinding(back, b, numb);
 }
 
 /*
 =============
-ChopWindingInPlace
+ClipWindingEpsilon
 =============
 */
-void ChopWindingInPlace(winding_t **inout, vec3_t normal, vec_t dist, vec_t epsilon) {
-    winding_t *in;
+void ClipWindingEpsilon(
+    const winding_t *in,
+    const vec3_t normal,
+    const vec_t dist,
+    const vec_t epsilon,
+    winding_t **front, winding_t **back) {
+    fixedwinding_t f, b;
+
+    // clip on the stack, only the pieces go to the heap, at their own size
+    ClipFixedWindingEpsilon(in, normal, dist, epsilon, &f, &b);
+    *front = CopyFixedWinding(&f);
+    *back  = CopyFixedWinding(&b);
+}
+
+/*
+=============
+ChopWindingPoints
+
+Front side of in into out, for the two in place choppers.
+Returns the number of points, or -1 if in is all on the front.
+=============
+*/
+static int32_t ChopWindingPoints(const winding_t *in, vec3_t normal, vec_t dist, vec_t epsilon, vec3_t *out) {
     vec_t dists[MAX_POINTS_ON_WINDING + 4];
     int32_t sides[MAX_POINTS_ON_WINDING + 4];
     int32_t counts[3];
     static vec_t dot; // VC 4.2 optimizer bug if not static
     int32_t i, j;
-    vec_t *p1, *p2;
+    const vec_t *p1, *p2;
     vec3_t mid;
-    winding_t *f;
+    int32_t numf;
     int32_t maxpts;
 
-    in        = *inout;
     counts[0] = counts[1] = counts[2] = 0;
 
     // determine sides for each point
@@ -416,30 +519,26 @@ void ChopWindingInPlace(winding_t **inout, vec3_t normal, vec_t dist, vec_t epsi
     sides[i] = sides[0];
     dists[i] = dists[0];
 
-    if (!counts[0]) {
-        FreeWinding(in);
-        *inout = NULL;
-        return;
-    }
+    if (!counts[0])
+        return 0;
     if (!counts[1])
-        return; // inout stays the same
+        return -1; // stays the same
 
     maxpts = in->numpoints + 4; // can't use counts[0]+2 because of fp grouping errors
-
-    f      = AllocWinding(maxpts);
+    numf   = 0;
 
     for (i = 0; i < in->numpoints; i++) {
         p1 = in->p[i];
 
         if (sides[i] == SIDE_ON) {
-            VectorCopy(p1, f->p[f->numpoints]);
-            f->numpoints++;
+            VectorCopy(p1, out[numf]);
+            numf++;
             continue;
         }
 
         if (sides[i] == SIDE_FRONT) {
-            VectorCopy(p1, f->p[f->numpoints]);
-            f->numpoints++;
+            VectorCopy(p1, out[numf]);
+            numf++;
         }
 
         if (sides[i + 1] == SIDE_ON || sides[i + 1] == sides[i])
@@ -459,17 +558,71 @@ void ChopWindingInPlace(winding_t **inout, vec3_t normal, vec_t dist, vec_t epsi
                 mid[j] = p1[j] + dot * (p2[j] - p1[j]);
         }
 
-        VectorCopy(mid, f->p[f->numpoints]);
-        f->numpoints++;
+        VectorCopy(mid, out[numf]);
+        numf++;
     }
 
-    if (f->numpoints > maxpts)
+    if (numf > maxpts)
         Error("ClipWinding: points exceeded estimate");
-    if (f->numpoints > MAX_POINTS_ON_WINDING)
+    if (numf > MAX_POINTS_ON_WINDING)
         Error("ClipWinding: MAX_POINTS_ON_WINDING");
 
-    FreeWinding(in);
-    *inout = f;
+    return numf;
+}
+
+/*
+=============
+ChopWindingInPlace
+=============
+*/
+void ChopWindingInPlace(winding_t **inout, vec3_t normal, vec_t dist, vec_t epsilon) {
+    winding_t *in, *f;
+    vec3_t points[MAX_POINTS_ON_WINDING + 4];
+    int32_t numpoints;
+
+    in        = *inout;
+    numpoints = ChopWindingPoints(in, normal, dist, epsilon, points);
+
+    if (!numpoints) {
+        FreeWinding(in);
+        *inout = NULL;
+        return;
+    }
+    if (numpoints < 0)
+        return; // inout stays the same
+
+    // a clip seldom adds a point, so the old winding usually has room
+    if (numpoints <= in->numpoints)
+        f = in;
+    else {
+        f = AllocWinding(numpoints);
+        FreeWinding(in);
+    }
+    memcpy(f->p, points, numpoints * sizeof(vec3_t));
+    f->numpoints = numpoints;
+
+    *inout       = f;
+}
+
+/*
+=============
+ChopFixedWindingInPlace
+=============
+*/
+qboolean ChopFixedWindingInPlace(fixedwinding_t *fw, vec3_t normal, vec_t dist, vec_t epsilon) {
+    vec3_t points[MAX_POINTS_ON_WINDING + 4];
+    int32_t numpoints;
+
+    numpoints = ChopWindingPoints(FixedWindingPoints(fw), normal, dist, epsilon, points);
+
+    if (!numpoints) {
+        FreeFixedWinding(fw);
+        return false;
+    }
+    if (numpoints > 0)
+        SetFixedWinding(fw, points, numpoints);
+
+    return true;
 }
 
 /*
@@ -481,13 +634,21 @@ of the cliping plane.  The original is freed.
 =================
 */
 winding_t *ChopWinding(winding_t *in, vec3_t normal, vec_t dist) {
-    winding_t *f, *b;
+    fixedwinding_t f;
+    winding_t *w;
+
+    ClipFixedWindingEpsilon(in, normal, dist, ON_EPSILON, &f, NULL);
+    if (f.numpoints && f.numpoints <= in->numpoints) {
+        // fits in the original
+        w = FixedWindingPoints(&f);
+        memcpy(in->p, w->p, f.numpoints * sizeof(vec3_t));
+        in->numpoints = f.numpoints;
+        FreeFixedWinding(&f);
+        return in;
+    }
 
-    ClipWindingEpsilon(in, normal, dist, ON_EPSILON, &f, &b);
     FreeWinding(in);
-    if (b)
-        FreeWinding(b);
-    return f;
+    return CopyFixedWinding(&f);
 }
 
 /*
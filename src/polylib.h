@@ -27,6 +27,19 @@ typedef struct
     vec3_t p[4]; // variable sized
 } winding_t;
 
+// a winding with room for MAX_POINTS_ON_FIXED_WINDING points of its own, so the
+// clip loops can keep one on the stack.  one with more points spills to a heap
+// winding.  the fixed winding functions below set it up, CopyFixedWinding or
+// FreeFixedWinding let go of it.
+typedef struct
+{
+    int32_t numpoints;
+    vec3_t p[MAX_POINTS_ON_FIXED_WINDING];
+    winding_t *spill; // holds the points instead if there are too many
+} fixedwinding_t;
+
+#define FixedWindingPoints(fw) ((fw)->spill ? (fw)->spill : (winding_t *)(fw))
+
 // you can define on_epsilon in the makefile as tighter
 #ifndef ON_EPSILON
 #define ON_EPSILON 0.1
@@ -52,4 +65,15 @@ void WindingBounds(winding_t *w, vec3_t mins, vec3_t maxs);
 void ChopWindingInPlace(winding_t **w, vec3_t normal, vec_t dist, vec_t epsilon);
 // frees the original if clipped
 
+void BaseFixedWindingForPlane(fixedwinding_t *fw, vec3_t normal, vec_t dist);
+void ClipFixedWindingEpsilon(
+    const winding_t *in, const vec3_t normal, const vec_t dist,
+    const vec_t epsilon, fixedwinding_t *front, fixedwinding_t *back);
+// a side with nothing on it gets no points, back can be NULL
+qboolean ChopFixedWindingInPlace(fixedwinding_t *fw, vec3_t normal, vec_t dist, vec_t epsilon);
+// false if nothing is left
+winding_t *CopyFixedWinding(fixedwinding_t *fw);
+// exact size heap winding, NULL if there are no points. fw is let go of
+void FreeFixedWinding(fixedwinding_t *fw);
+
 void pw(winding_t *w);
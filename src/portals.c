@@ -38,8 +38,7 @@ portal_t *AllocPortal(void) {
     if (c_active_portals > c_peak_portals)
         c_peak_portals = c_active_portals;
 
-    p = malloc(sizeof(portal_t));
-    memset(p, 0, sizeof(portal_t));
+    p = AllocBlock(sizeof(portal_t));
 
     return p;
 }
@@ -49,7 +48,7 @@ void FreePortal(portal_t *p) {
         FreeWinding(p->winding);
     if (numthreads == 1)
         c_active_portals--;
-    free(p);
+    FreeBlock(p);
 }
 
 //==============================================================
@@ -290,32 +289,33 @@ BaseWindingForNode
 #define BASE_WINDING_EPSILON  0.001
 #define SPLIT_WINDING_EPSILON 0.001
 
-winding_t *BaseWindingForNode(node_t *node) {
-    winding_t *w;
+qboolean BaseWindingForNode(node_t *node, fixedwinding_t *w) {
     node_t *n;
     plane_t *plane;
     vec3_t normal;
     vec_t dist;
 
-    w = BaseWindingForPlane(mapplanes[node->planenum].normal,
-                            mapplanes[node->planenum].dist);
+    BaseFixedWindingForPlane(w, mapplanes[node->planenum].normal,
+                             mapplanes[node->planenum].dist);
 
     // clip by all the parents
-    for (n = node->parent; n && w;) {
+    for (n = node->parent; n;) {
         plane = &mapplanes[n->planenum];
 
         if (n->children[0] == node) { // take front
-            ChopWindingInPlace(&w, plane->normal, plane->dist, BASE_WINDING_EPSILON);
+            if (!ChopFixedWindingInPlace(w, plane->normal, plane->dist, BASE_WINDING_EPSILON))
+                return false;
         } else { // take back
             VectorSubtract(vec3_origin, plane->normal, normal);
             dist = -plane->dist;
-            ChopWindingInPlace(&w, normal, dist, BASE_WINDING_EPSILON);
+            if (!ChopFixedWindingInPlace(w, normal, dist, BASE_WINDING_EPSILON))
+                return false;
         }
         node = n;
         n    = n->parent;
     }
 
-    return w;
+    return true;
 }
 
 //============================================================
@@ -332,15 +332,17 @@ and clipping it by all of parents of this node
 */
 void MakeNodePortal(node_t *node) {
     portal_t *new_portal, *p;
-    winding_t *w;
+    fixedwinding_t w;
     vec3_t normal;
     vec_t dist   = 0;
     int32_t side = 0;
 
-    w            = BaseWindingForNode(node);
+    // qb: clipped on the stack, only the finished portal goes to the heap
+    if (!BaseWindingForNode(node, &w))
+        return;
 
     // clip the portal by all the other portals in the node
-    for (p = node->portals; p && w; p = p->next[side]) {
+    for (p = node->portals; p; p = p->next[side]) {
         if (p->nodes[0] == node) {
             side = 0;
             VectorCopy(p->plane.normal, normal);
@@ -352,23 +354,21 @@ void MakeNodePortal(node_t *node) {
         } else
             Error("CutNodePortals_r: mislinked portal");
 
-        ChopWindingInPlace(&w, normal, dist, 0.1);
-    }
-
-    if (!w) {
-        return;
+        if (!ChopFixedWindingInPlace(&w, normal, dist, 0.1))
+            return;
     }
 
-    if (WindingIsTiny(w)) {
-        c_tinyportals++;
-        FreeWinding(w);
+    if (WindingIsTiny(FixedWindingPoints(&w))) {
+        if (numthreads == 1)
+            c_tinyportals++;
+        FreeFixedWinding(&w);
         return;
     }
 
     new_portal          = AllocPortal();
     new_portal->plane   = mapplanes[node->planenum];
     new_portal->onnode  = node;
-    new_portal->winding = w;
+    new_portal->winding = CopyFixedWinding(&w);
     AddPortalToNodes(new_portal, node->children[0], node->children[1]);
 }
 
@@ -385,6 +385,7 @@ void SplitNodePortals(node_t *node) {
     node_t *f, *b, *other_node;
     int32_t side = 0;
     plane_t *plane;
+    fixedwinding_t frontfixed, backfixed;
     winding_t *frontwinding, *backwinding;
 
     plane = &mapplanes[node->planenum];
@@ -407,19 +408,24 @@ void SplitNodePortals(node_t *node) {
         //
         // cut the portal into two portals, one on each side of the cut plane
         //
-        ClipWindingEpsilon(p->winding, plane->normal, plane->dist,
-                           SPLIT_WINDING_EPSILON, &frontwinding, &backwinding);
+        // the pieces stay on the stack until we know both are kept
+        ClipFixedWindingEpsilon(p->winding, plane->normal, plane->dist,
+                                SPLIT_WINDING_EPSILON, &frontfixed, &backfixed);
+        frontwinding = frontfixed.numpoints ? FixedWindingPoints(&frontfixed) : NULL;
+        backwinding  = backfixed.numpoints ? FixedWindingPoints(&backfixed) : NULL;
 
         if (frontwinding && WindingIsTiny(frontwinding)) {
-            FreeWinding(frontwinding);
+            FreeFixedWinding(&frontfixed);
             frontwinding = NULL;
-            c_tinyportals++;
+            if (numthreads == 1)
+                c_tinyportals++;
         }
 
         if (backwinding && WindingIsTiny(backwinding)) {
-            FreeWinding(backwinding);
+            FreeFixedWinding(&backfixed);
             backwinding = NULL;
-            c_tinyportals++;
+            if (numthreads == 1)
+                c_tinyportals++;
         }
 
         if (!frontwinding && !backwinding) { // tiny windings on both sides
@@ -427,7 +433,7 @@ void SplitNodePortals(node_t *node) {
         }
 
         if (!frontwinding) {
-            FreeWinding(backwinding);
+            FreeFixedWinding(&backfixed);
             if (side == 0)
                 AddPortalToNodes(p, b, other_node);
             else
@@ -435,7 +441,7 @@ void SplitNodePortals(node_t *node) {
             continue;
         }
         if (!backwinding) {
-            FreeWinding(frontwinding);
+            FreeFixedWinding(&frontfixed);
             if (side == 0)
                 AddPortalToNodes(p, f, other_node);
             else
@@ -446,9 +452,9 @@ void SplitNodePortals(node_t *node) {
         // the winding is split
         new_portal          = AllocPortal();
         *new_portal         = *p;
-        new_portal->winding = backwinding;
+        new_portal->winding = CopyFixedWinding(&backfixed);
         FreeWinding(p->winding);
-        p->winding = frontwinding;
+        p->winding = CopyFixedWinding(&frontfixed);
 
         if (side == 0) {
             AddPortalToNodes(p, f, other_node);
@@ -784,6 +790,8 @@ void EmitAreaPortals(node_t *headnode) {
         Error("MAX_MAP_AREAS");
     numareas       = c_areas + 1;
     numareaportals = 1; // leave 0 as an error
+    ReserveLump(dareas, numareas);
+    ReserveLump(dareaportals, numareaportals);
 
     for (i = 1; i <= c_areas; i++) {
         dareas[i].firstareaportal = numareaportals;
@@ -791,6 +799,7 @@ void EmitAreaPortals(node_t *headnode) {
             e = &entities[j];
             if (!e->areaportalnum)
                 continue;
+            ReserveLump(dareaportals, numareaportals + 1);
             dp = &dareaportals[numareaportals];
             if (e->portalareas[0] == i) {
                 dp->portalnum = e->areaportalnum;
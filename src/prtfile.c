@@ -29,14 +29,30 @@ Save out name.prt for qvis to read
 ==============================================================================
 */
 
-#define PORTALFILE "PRT1"
+#define PORTALFILE    "PRT1"
+#define PORTALFILEBIN "PRT1-BIN"
 
 extern qboolean use_qbsp;
 
+qboolean binportals = false; // write PRT1-BIN instead of the text format
+
 FILE *pf;
 int32_t num_visclusters; // clusters the player can be in
 int32_t num_visportals;
 
+// PRT1-BIN is the magic line, then little endian clusters, portals and
+// total points, one (numpoints, cluster, cluster) triple per portal and
+// every portal point packed as three floats.  The same data is handed
+// to vis in memory by combined runs.
+qboolean collectportals; // WritePortalFile_r fills stageportals instead of writing text
+int32_t maxportalpoints;
+
+vec_t SnapPortalFloat(vec_t v) {
+    if (fabs(v - Q_rint(v)) < 0.001)
+        return Q_rint(v);
+    return v;
+}
+
 void WriteFloat(FILE *f, vec_t v) {
     if (fabs(v - Q_rint(v)) < 0.001)
         fprintf(f, "%i ", (int32_t)Q_rint(v));
@@ -44,6 +60,38 @@ void WriteFloat(FILE *f, vec_t v) {
         fprintf(f, "%f ", v);
 }
 
+/*
+=================
+AddPortalData
+=================
+*/
+void AddPortalData(winding_t *w, int32_t cluster0, int32_t cluster1) {
+    int32_t i, j;
+    float *out;
+    portaldata_t *prt = &stageportals;
+
+    if (prt->numportals == num_visportals)
+        Error("AddPortalData: more portals than counted");
+
+    prt->info[prt->numportals * 3 + 0] = LittleLong(w->numpoints);
+    prt->info[prt->numportals * 3 + 1] = LittleLong(cluster0);
+    prt->info[prt->numportals * 3 + 2] = LittleLong(cluster1);
+    prt->numportals++;
+
+    if (prt->numpoints + w->numpoints > maxportalpoints) {
+        maxportalpoints = maxportalpoints * 2 + w->numpoints;
+        prt->points     = realloc(prt->points, maxportalpoints * 3 * sizeof(float));
+        if (!prt->points)
+            Error("AddPortalData: out of memory");
+    }
+
+    out = prt->points + prt->numpoints * 3;
+    for (i = 0; i < w->numpoints; i++)
+        for (j = 0; j < 3; j++)
+            *out++ = LittleFloat(SnapPortalFloat(w->p[i][j]));
+    prt->numpoints += w->numpoints;
+}
+
 /*
 =================
 WritePortalFile_r
@@ -79,6 +127,13 @@ void WritePortalFile_r(node_t *node) {
             // plane the same way vis will, and flip the side orders if needed
             // FIXME: is this still relevent?
             WindingPlane(w, normal, &dist);
+            if (collectportals) {
+                if (DotProduct(p->plane.normal, normal) < 0.99)
+                    AddPortalData(w, p->nodes[1]->cluster, p->nodes[0]->cluster);
+                else
+                    AddPortalData(w, p->nodes[0]->cluster, p->nodes[1]->cluster);
+                continue;
+            }
             if (DotProduct(p->plane.normal, normal) < 0.99) {
                 // backwards...
                 fprintf(pf, "%i %i %i ", w->numpoints, p->nodes[1]->cluster, p->nodes[0]->cluster);
@@ -216,6 +271,50 @@ void SaveClusters_r(node_t *node) {
     SaveClusters_r(node->children[1]);
 }
 
+/*
+================
+CollectPortals
+
+Gathers the portals into stageportals
+================
+*/
+void CollectPortals(node_t *headnode) {
+    portaldata_t *prt = &stageportals;
+
+    FreePortalData(prt);
+    prt->numclusters = num_visclusters;
+    maxportalpoints  = num_visportals * 4;
+    prt->info        = malloc(num_visportals * 3 * sizeof(int32_t));
+    prt->points      = malloc(maxportalpoints * 3 * sizeof(float));
+    if (!prt->info || !prt->points)
+        Error("CollectPortals: out of memory");
+
+    collectportals = true;
+    WritePortalFile_r(headnode);
+    collectportals = false;
+
+    if (prt->numportals != num_visportals)
+        Error("CollectPortals: found %i of %i portals", prt->numportals, num_visportals);
+}
+
+/*
+================
+WriteBinaryPortalFile
+================
+*/
+void WriteBinaryPortalFile(portaldata_t *prt) {
+    int32_t header[3];
+
+    header[0] = LittleLong(prt->numclusters);
+    header[1] = LittleLong(prt->numportals);
+    header[2] = LittleLong(prt->numpoints);
+
+    fprintf(pf, "%s\n", PORTALFILEBIN);
+    SafeWrite(pf, header, sizeof(header));
+    SafeWrite(pf, prt->info, prt->numportals * 3 * sizeof(int32_t));
+    SafeWrite(pf, prt->points, prt->numpoints * 3 * sizeof(float));
+}
+
 /*
 ================
 WritePortalFile
@@ -254,21 +353,34 @@ void WritePortalFile(tree_t *tree) {
     else
         printf("brushsides count: %i of %i maximum\n", nummapbrushsides, MAX_MAP_BRUSHSIDES);
 
-    printf("writing %s\n", filename);
-    pf = fopen(filename, "w");
-    if (!pf)
-        Error("Error opening %s", filename);
-
-    fprintf(pf, "%s\n", PORTALFILE);
-    fprintf(pf, "%i\n", num_visclusters);
-    fprintf(pf, "%i\n", num_visportals);
-
     qprintf("%5i visclusters\n", num_visclusters);
     qprintf("%5i visportals\n", num_visportals);
 
-    WritePortalFile_r(headnode);
+    if (binportals || bsp_tomemory)
+        CollectPortals(headnode);
+
+    if (!bsp_tomemory || keepstages) {
+        printf("writing %s\n", filename);
+        pf = fopen(filename, binportals ? "wb" : "w");
+        if (!pf)
+            Error("Error opening %s", filename);
+
+        if (binportals)
+            WriteBinaryPortalFile(&stageportals);
+        else {
+            fprintf(pf, "%s\n", PORTALFILE);
+            fprintf(pf, "%i\n", num_visclusters);
+            fprintf(pf, "%i\n", num_visportals);
+
+            WritePortalFile_r(headnode);
+        }
+
+        fclose(pf);
+    } else
+        printf("keeping %s in memory for vis\n", filename);
 
-    fclose(pf);
+    if (!bsp_tomemory)
+        FreePortalData(&stageportals);
 
     // we need to store the clusters out now because ordering
     // issues made us do this after writebsp...
@@ -23,6 +23,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "scriplib.h"
 #include "polylib.h"
 #include "threads.h"
+#include "memlib.h"
 #include "bspfile.h"
 
 #define MAX_BRUSH_SIDES 128
@@ -182,6 +183,7 @@ extern char source[1024];
 
 extern int32_t max_entities; // qb: from kmqbsp3-  Knightmare- adjustable entity limit
 extern int32_t max_bounds;   // Knightmare- adjustable max bounds
+extern int32_t bspthreads;   // threads for the parts of bsp that are safe to run in parallel
 
 void LoadMapFile(char *filename);
 int32_t FindFloatPlane(vec3_t normal, vec_t dist, int32_t bnum);
@@ -104,14 +104,16 @@ typedef struct patch_s {
     int32_t samples; // for averaging direct light
 } patch_t;
 
-extern patch_t *face_patches[MAX_MAP_FACES_QBSP];
-extern entity_t *face_entity[MAX_MAP_FACES_QBSP];
-extern vec3_t face_offset[MAX_MAP_FACES_QBSP]; // for rotating bmodels
-extern patch_t patches[MAX_PATCHES_QBSP];
+extern patch_t **face_patches;
+extern entity_t **face_entity;
+extern vec3_t *face_offset; // for rotating bmodels
+extern patch_t *patches;
 extern unsigned num_patches;
 
-extern int32_t leafparents[MAX_MAP_LEAFS_QBSP];
-extern int32_t nodeparents[MAX_MAP_NODES_QBSP];
+extern int32_t *leafparents;
+extern int32_t *nodeparents;
+
+void *AllocRadArray(void *old, int32_t count, int32_t size);
 
 extern float lightscale;
 
@@ -133,18 +135,36 @@ void LinkPlaneFaces(void);
 extern float grayscale;
 extern float saturation;
 extern qboolean extrasamples;
+extern float adaptive_threshold;
+extern int32_t adaptive_texels, adaptive_refined;
 extern qboolean dicepatches;
 extern int32_t numbounce;
 extern qboolean noblock;
 extern qboolean noedgefix;
 
-extern directlight_t *directlights[MAX_MAP_LEAFS_QBSP];
-
-extern byte nodehit[MAX_MAP_NODES_QBSP];
+extern directlight_t **directlights;
 
 void BuildLightmaps(void);
 
-void BuildFacelights(int32_t facenum);
+#define MAX_STYLES 32
+typedef struct
+{
+    int32_t numsamples;
+    float *origins;
+    int32_t numstyles;
+    int32_t stylenums[MAX_STYLES];
+    float *samples[MAX_STYLES];
+} facelight_t;
+
+extern facelight_t *facelight;
+
+void AllocFacelights(void);
+void ReserveLightData(void);
+
+extern int32_t numlighttiles;
+
+void MakeLightTiles(void);
+void BuildFacelightTile(int32_t tilenum);
 
 void FinalLightFace(int32_t facenum);
 qboolean PvsForOrigin(vec3_t org, byte *pvs);
@@ -159,7 +179,7 @@ void CreateDirectLights(void);
 dleaf_t *RadPointInLeaf(vec3_t point);
 dleaf_tx *RadPointInLeafX(vec3_t point);
 
-extern dplane_t backplanes[MAX_MAP_PLANES_QBSP];
+extern dplane_t *backplanes;
 extern int32_t fakeplanes; // created planes for origin offset
 extern int32_t maxdata, step;
 
@@ -192,3 +212,14 @@ extern byte *dlightdata_ptr;
 extern byte dlightdata_raw[MAX_MAP_LIGHTING_QBSP];
 
 extern float sunradscale;
+
+int32_t CompressBytes(int32_t size, byte *source, byte *dest);
+
+// radcache.c
+extern qboolean radincremental;
+extern char radcachefile[1060];
+extern byte *facecached;
+
+void LoadRadCache(void);
+void SaveRadCache(void);
+void KeepFaceReach(int32_t facenum, const byte *reach);
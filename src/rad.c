@@ -29,17 +29,19 @@ every surface must be divided into at least two patches each axis
 
 */
 
-patch_t *face_patches[MAX_MAP_FACES_QBSP];
-entity_t *face_entity[MAX_MAP_FACES_QBSP];
-patch_t patches[MAX_PATCHES_QBSP];
+// the per face, plane, leaf and patch arrays are allocated to the
+// counts of the loaded map, patches at the format limit
+patch_t **face_patches;
+entity_t **face_entity;
+patch_t *patches;
 unsigned num_patches;
 int32_t num_smoothing; // qb: number of phong hits
 
-vec3_t radiosity[MAX_PATCHES_QBSP];    // light leaving a patch
-vec3_t illumination[MAX_PATCHES_QBSP]; // light arriving at a patch
+vec3_t *radiosity;    // light leaving a patch
+vec3_t *illumination; // light arriving at a patch
 
-vec3_t face_offset[MAX_MAP_FACES_QBSP]; // for rotating bmodels
-dplane_t backplanes[MAX_MAP_PLANES_QBSP];
+vec3_t *face_offset; // for rotating bmodels
+dplane_t *backplanes;
 
 extern char inbase[32], outbase[32];
 extern qboolean h2tex;
@@ -49,6 +51,7 @@ int32_t fakeplanes; // created planes for origin offset
 int32_t numbounce     = 4;     // default was 8
 qboolean noblock      = false; // when true, disables occlusion testing on light rays
 qboolean extrasamples = false;
+float adaptive_threshold = 0; // -adaptive, only refine -extra where texels differ by more
 qboolean dicepatches  = false;
 qboolean noedgefix    = false;
 int32_t memory        = false;
@@ -58,6 +61,23 @@ float subdiv          = 64;
 qboolean dumppatches;
 
 void BuildFaceExtents(void); // qb: from quemap
+
+/*
+=============
+AllocRadArray
+
+Frees old and returns count zeroed elements of size bytes.
+=============
+*/
+void *AllocRadArray(void *old, int32_t count, int32_t size) {
+    void *data;
+
+    free(old);
+    data = calloc(count > 0 ? count : 1, size);
+    if (!data)
+        Error("AllocRadArray: failed on %i elements of %i bytes", count, size);
+    return data;
+}
 int32_t TestLine(vec3_t start, vec3_t stop);
 float smoothing_threshold; // qb: phong from VHLT
 float smoothing_value = DEFAULT_SMOOTHING_VALUE;
@@ -156,14 +176,15 @@ MakeBackplanes
 void MakeBackplanes(void) {
     int32_t i;
 
+    backplanes = AllocRadArray(backplanes, numplanes, sizeof(backplanes[0]));
     for (i = 0; i < numplanes; i++) {
         backplanes[i].dist = -dplanes[i].dist;
         VectorSubtract(vec3_origin, dplanes[i].normal, backplanes[i].normal);
     }
 }
 
-int32_t leafparents[MAX_MAP_LEAFS_QBSP];
-int32_t nodeparents[MAX_MAP_NODES_QBSP];
+int32_t *leafparents;
+int32_t *nodeparents;
 
 /*
 =============
@@ -782,6 +803,8 @@ void RadWorld(void) {
     if (numnodes == 0 || numfaces == 0)
         Error("Empty map");
     MakeBackplanes();
+    leafparents = AllocRadArray(leafparents, numleafs, sizeof(leafparents[0]));
+    nodeparents = AllocRadArray(nodeparents, numnodes, sizeof(nodeparents[0]));
     MakeParents(0, -1);
     MakeTnodes(&dmodels[0]);
 
@@ -797,9 +820,21 @@ void RadWorld(void) {
     PairEdges(); // qb: moved here for phong
 
     // build initial facelights
-    RunThreadsOnIndividual(numfaces, true, BuildFacelights);
+    AllocFacelights();
+    if (radincremental)
+        LoadRadCache();
+    MakeLightTiles();
+    RunThreadsOnIndividual(numlighttiles, true, BuildFacelightTile);
+    if (radincremental)
+        SaveRadCache();
+    if (adaptive_texels)
+        printf("adaptive -extra: %i of %i texels refined (%.1f%%)\n", adaptive_refined, adaptive_texels,
+               adaptive_texels ? 100.0 * adaptive_refined / adaptive_texels : 0.0);
 
     if (numbounce > 0) {
+        radiosity    = AllocRadArray(radiosity, num_patches, sizeof(radiosity[0]));
+        illumination = AllocRadArray(illumination, num_patches, sizeof(illumination[0]));
+
         // build transfer lists
         if (!memory) {
             RunThreadsOnIndividual(num_patches, true, MakeTransfers);
@@ -826,6 +861,7 @@ void RadWorld(void) {
     LinkPlaneFaces();
 
     lightdatasize = 0;
+    ReserveLightData();
     RunThreadsOnIndividual(numfaces, true, FinalLightFace);
 }
 
@@ -851,9 +887,11 @@ void RAD_ProcessArgument(const char *arg) {
     //	ReadLightFile ();
     name = (char *)malloc(strlen(inbase) + strlen(source) + 1);
     sprintf(name, "%s%s", inbase, source);
-    printf("reading %s\n", name);
-    LoadBSPFile(name);
-    dlightdata_ptr = dlightdata;
+    LoadStageBSPFile(name);
+
+    sprintf(radcachefile, "%s%s", outbase, source);
+    StripExtension(radcachefile);
+    strcat(radcachefile, ".ric");
     if (use_qbsp) {
         maxdata = MAX_MAP_LIGHTING_QBSP;
         step    = QBSP_LMSTEP;
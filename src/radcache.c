@@ -0,0 +1,528 @@
+/*
+===========================================================================
+Copyright (C) 1997-2006 Id Software, Inc.
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+===========================================================================
+*/
+
+#include "qrad.h"
+#include <stddef.h>
+
+/*
+==============================================================================
+
+INCREMENTAL RAD CACHE
+
+With -radincremental, rad saves what BuildFacelights made of each face
+to name.ric: the style samples, and the direct light its patches got
+for the bounces.  The next -radincremental rad of the map gives a face
+its old direct light back if the lights it can see are the same as
+last time, and only gathers the others.  The bounces are always solved again, from
+the cached direct light of the faces that kept it.
+
+Anything that could throw a shadow or move a sample, the geometry, the
+vis, the entities that aren't lights and the options, goes into one
+world key.  If that changed, every face is lit again.
+
+The lights a face can see are the ones in the clusters the pvs of its
+samples takes in, its reach.  The key of a face is made from the
+lights of each cluster of its reach in the order GatherSampleLight
+goes through them, so a face whose key matches gets the same light,
+bit for bit, as a clean run.
+
+header
+for each face: reach length (-1 if not kept), face key, reach,
+samples, styles, style numbers, origins, style samples, patches,
+for each patch its direct light and sample count
+==============================================================================
+*/
+
+#define RADCACHEHEADER (('1' << 24) + ('C' << 16) + ('I' << 8) + 'R') // little-endian "RIC1"
+
+typedef struct
+{
+    int32_t ident;
+    int32_t numfaces;
+    int32_t numclusters;
+    int32_t pad;
+    uint64_t worldkey;
+} radcacheheader_t;
+
+qboolean radincremental;
+char radcachefile[1060];
+
+byte *facecached;        // [numfaces] LoadRadCache filled the face in, NULL without -radincremental
+static byte **facereach; // [numfaces] compressed reach, with its length in front
+
+static uint64_t *clusterkey;
+static int32_t clusterbytes;
+
+#define HashValue(h, v) Hash64(h, &(v), sizeof(v))
+
+/*
+=============
+WorldKey
+
+Everything but the lights that BuildFacelights depends on
+=============
+*/
+static uint64_t WorldKey(void) {
+    uint64_t h;
+    int32_t i, bounce;
+    entity_t *e;
+    epair_t *ep;
+
+    h = HASH64_START;
+    h = Hash64(h, dplanes, numplanes * sizeof(dplane_t));
+    h = Hash64(h, dvertexes, numvertexes * sizeof(dvertex_t));
+    h = Hash64(h, texinfo, numtexinfo * sizeof(texinfo_t));
+    h = Hash64(h, dsurfedges, numsurfedges * sizeof(int32_t));
+    h = Hash64(h, dmodels, nummodels * sizeof(dmodel_t));
+    h = Hash64(h, dvisdata, visdatasize);
+    if (use_qbsp) {
+        h = Hash64(h, dnodesX, numnodes * sizeof(dnode_tx));
+        h = Hash64(h, dleafsX, numleafs * sizeof(dleaf_tx));
+        for (i = 0; i < numfaces; i++) // not the styles and lightofs rad is about to write
+            h = Hash64(h, &dfacesX[i], offsetof(dface_tx, styles));
+        h = Hash64(h, dedgesX, numedges * sizeof(dedge_tx));
+        h = Hash64(h, dleaffacesX, numleaffaces * sizeof(uint32_t));
+    } else {
+        h = Hash64(h, dnodes, numnodes * sizeof(dnode_t));
+        h = Hash64(h, dleafs, numleafs * sizeof(dleaf_t));
+        for (i = 0; i < numfaces; i++)
+            h = Hash64(h, &dfaces[i], offsetof(dface_t, styles));
+        h = Hash64(h, dedges, numedges * sizeof(dedge_t));
+        h = Hash64(h, dleaffaces, numleaffaces * sizeof(uint16_t));
+    }
+
+    // bmodel origins, worldspawn sun keys, spotlight targets
+    for (i = 0, e = entities; i < num_entities; i++, e++) {
+        if (!strncmp(ValueForKey(e, "classname"), "light", 5))
+            continue;
+        for (ep = e->epairs; ep; ep = ep->next) {
+            h = Hash64(h, ep->key, strlen(ep->key) + 1);
+            h = Hash64(h, ep->value, strlen(ep->value) + 1);
+        }
+        h = Hash64(h, "", 1);
+    }
+
+    // the options the direct light and the patches it goes to depend on
+    bounce = numbounce > 0;
+    h      = HashValue(h, use_qbsp);
+    h      = HashValue(h, step);
+    h      = HashValue(h, extrasamples);
+    h      = HashValue(h, adaptive_threshold);
+    h      = HashValue(h, smoothing_threshold);
+    h      = HashValue(h, sample_nudge);
+    h      = HashValue(h, noblock);
+    h      = HashValue(h, noedgefix);
+    h      = HashValue(h, sunradscale);
+    h      = HashValue(h, bounce);
+    h      = HashValue(h, subdiv);
+    h      = HashValue(h, dicepatches);
+    h      = HashValue(h, sun);
+    h      = HashValue(h, sun_alt_color);
+    h      = HashValue(h, sun_pos);
+    h      = HashValue(h, sun_main);
+    h      = HashValue(h, sun_ambient);
+    h      = HashValue(h, sun_color);
+
+    return h;
+}
+
+/*
+=============
+LightKey
+=============
+*/
+static uint64_t LightKey(uint64_t h, const directlight_t *dl) {
+    h = HashValue(h, dl->type);
+    h = HashValue(h, dl->intensity);
+    h = HashValue(h, dl->style);
+    h = HashValue(h, dl->wait);
+    h = HashValue(h, dl->adjangle);
+    h = HashValue(h, dl->falloff);
+    h = HashValue(h, dl->origin);
+    h = HashValue(h, dl->color);
+    h = HashValue(h, dl->normal);
+    h = HashValue(h, dl->stopdot);
+    h = HashValue(h, dl->nodenum);
+    if (dl->plane)
+        h = Hash64(h, dl->plane, sizeof(*dl->plane));
+    return h;
+}
+
+/*
+=============
+FaceKey
+
+The lights of each cluster of the reach, in the order GatherSampleLight
+goes through them, and the light of the face itself
+=============
+*/
+static uint64_t FaceKey(int32_t facenum, const byte *reach) {
+    uint64_t h;
+    int32_t i;
+    patch_t *patch;
+
+    h = HASH64_START;
+    for (i = 0; i < dvis->numclusters; i++)
+        if (reach[i >> 3] & (1 << (i & 7)))
+            h = Mix64(h ^ clusterkey[i]);
+    for (patch = face_patches[facenum]; patch; patch = patch->next)
+        h = HashValue(h, patch->baselight);
+
+    return h;
+}
+
+/*
+=============
+DecompressReach
+
+DecompressBytes that won't run past len or the reach.
+False if it would.
+=============
+*/
+static qboolean DecompressReach(const byte *in, int32_t len, byte *reach) {
+    const byte *end;
+    int32_t c, out;
+
+    if (len < 1)
+        return false;
+    end = in + len;
+    if (!*in++) {
+        if (len != clusterbytes + 1)
+            return false;
+        memcpy(reach, in, clusterbytes);
+        return true;
+    }
+
+    out = 0;
+    while (out < clusterbytes) {
+        if (in >= end)
+            return false;
+        if (*in) {
+            reach[out++] = *in++;
+            continue;
+        }
+
+        if (in + 1 >= end || !in[1] || out + in[1] > clusterbytes)
+            return false;
+        for (c = in[1]; c; c--)
+            reach[out++] = 0;
+        in += 2;
+    }
+
+    return in == end;
+}
+
+/*
+=============
+KeepFaceReach
+
+BuildFacelights is done with the face, keep its reach for SaveRadCache.
+Each face has its own slot, no lock is needed.
+=============
+*/
+void KeepFaceReach(int32_t facenum, const byte *reach) {
+    byte *compressed;
+    int32_t len;
+
+    if (!facereach)
+        return;
+
+    compressed = malloc(clusterbytes + 1);
+    len        = CompressBytes(clusterbytes, (byte *)reach, compressed);
+    facereach[facenum] = malloc(sizeof(int32_t) + len);
+    memcpy(facereach[facenum], &len, sizeof(int32_t));
+    memcpy(facereach[facenum] + sizeof(int32_t), compressed, len);
+    free(compressed);
+}
+
+static qboolean WriteInts(FILE *f, const int32_t *v, int32_t count) {
+    int32_t i, l;
+
+    for (i = 0; i < count; i++) {
+        l = LittleLong(v[i]);
+        if (fwrite(&l, sizeof(l), 1, f) != 1)
+            return false;
+    }
+    return true;
+}
+
+static qboolean WriteFloats(FILE *f, const float *v, int32_t count) {
+    int32_t i;
+    float l;
+
+    for (i = 0; i < count; i++) {
+        l = LittleFloat(v[i]);
+        if (fwrite(&l, sizeof(l), 1, f) != 1)
+            return false;
+    }
+    return true;
+}
+
+static qboolean ReadInts(FILE *f, int32_t *v, int32_t count) {
+    int32_t i;
+
+    if (count && fread(v, sizeof(int32_t), count, f) != count)
+        return false;
+    for (i = 0; i < count; i++)
+        v[i] = LittleLong(v[i]);
+    return true;
+}
+
+static qboolean ReadFloats(FILE *f, float *v, int32_t count) {
+    int32_t i;
+
+    if (count && fread(v, sizeof(float), count, f) != count)
+        return false;
+    for (i = 0; i < count; i++)
+        v[i] = LittleFloat(v[i]);
+    return true;
+}
+
+static int32_t CountFacePatches(int32_t facenum) {
+    int32_t count;
+    patch_t *patch;
+
+    count = 0;
+    for (patch = face_patches[facenum]; patch; patch = patch->next)
+        count++;
+    return count;
+}
+
+/*
+=============
+SaveRadCache
+
+Call once BuildFacelights has been through every face
+=============
+*/
+void SaveRadCache(void) {
+    radcacheheader_t header;
+    facelight_t *fl;
+    patch_t *patch;
+    uint64_t key;
+    byte *reach;
+    int32_t i, s, len, counts[3];
+    FILE *f;
+    qboolean ok;
+
+    if (!facereach)
+        return;
+
+    f = fopen(radcachefile, "wb");
+    if (!f) {
+        printf("WARNING: couldn't write %s\n", radcachefile);
+        return;
+    }
+
+    header.ident       = LittleLong(RADCACHEHEADER);
+    header.numfaces    = LittleLong(numfaces);
+    header.numclusters = LittleLong(dvis->numclusters);
+    header.pad         = 0;
+    header.worldkey    = WorldKey();
+    ok                 = fwrite(&header, sizeof(header), 1, f) == 1;
+
+    reach              = malloc(clusterbytes);
+    for (i = 0; ok && i < numfaces; i++) {
+        if (!facereach[i]) {
+            len = -1; // warp or sky, nothing to keep
+            ok  = WriteInts(f, &len, 1);
+            continue;
+        }
+
+        memcpy(&len, facereach[i], sizeof(int32_t));
+        DecompressReach(facereach[i] + sizeof(int32_t), len, reach);
+        key       = FaceKey(i, reach);
+
+        fl        = &facelight[i];
+        counts[0] = fl->numsamples;
+        counts[1] = fl->numstyles;
+        counts[2] = CountFacePatches(i);
+        ok        = WriteInts(f, &len, 1) && fwrite(&key, sizeof(key), 1, f) == 1 &&
+             fwrite(facereach[i] + sizeof(int32_t), len, 1, f) == 1 && WriteInts(f, counts, 3) &&
+             WriteInts(f, fl->stylenums, fl->numstyles) && WriteFloats(f, fl->origins, fl->numsamples * 3);
+        for (s = 0; ok && s < fl->numstyles; s++)
+            ok = WriteFloats(f, fl->samples[s], fl->numsamples * 3);
+        for (patch = face_patches[i]; ok && patch; patch = patch->next)
+            ok = WriteFloats(f, patch->samplelight, 3) && WriteInts(f, &patch->samples, 1);
+    }
+    if (fclose(f))
+        ok = false;
+
+    if (!ok) {
+        printf("WARNING: couldn't write %s\n", radcachefile);
+        remove(radcachefile);
+    }
+
+    free(reach);
+    for (i = 0; i < numfaces; i++)
+        free(facereach[i]);
+    free(facereach);
+    facereach = NULL;
+    free(facecached);
+    facecached = NULL;
+    free(clusterkey);
+    clusterkey = NULL;
+}
+
+/*
+=============
+ReuseFace
+
+Reads the face from the cache and fills it in if its key still matches.
+False if the file is bad.
+=============
+*/
+static qboolean ReuseFace(FILE *f, int32_t facenum, int32_t len, byte *reach, qboolean *reused) {
+    facelight_t *fl;
+    patch_t *patch;
+    uint64_t key;
+    byte *compressed;
+    float *origins, *samples[MAX_STYLES], *light;
+    int32_t i, s, counts[3], stylenums[MAX_STYLES], *lightsamples;
+    qboolean ok;
+
+    *reused = false;
+    if (len < 1 || len > clusterbytes + 1)
+        return false;
+
+    compressed = malloc(sizeof(int32_t) + len);
+    memcpy(compressed, &len, sizeof(int32_t));
+    ok = fread(&key, sizeof(key), 1, f) == 1 && fread(compressed + sizeof(int32_t), len, 1, f) == 1 &&
+         DecompressReach(compressed + sizeof(int32_t), len, reach) && ReadInts(f, counts, 3) &&
+         counts[0] >= 0 && counts[0] <= MAX_MAP_LIGHTING_QBSP && counts[1] >= 0 && counts[1] <= MAX_STYLES &&
+         counts[2] >= 0 && counts[2] <= MAX_PATCHES_QBSP && ReadInts(f, stylenums, counts[1]);
+    if (!ok) {
+        free(compressed);
+        return false;
+    }
+
+    // read it all before touching the face
+    origins = malloc(counts[0] * 3 * sizeof(float));
+    ok      = ReadFloats(f, origins, counts[0] * 3);
+    for (s = 0; s < counts[1]; s++) {
+        samples[s] = malloc(counts[0] * 3 * sizeof(float));
+        ok         = ok && ReadFloats(f, samples[s], counts[0] * 3);
+    }
+    light        = malloc(counts[2] * 3 * sizeof(float));
+    lightsamples = malloc(counts[2] * sizeof(int32_t));
+    for (i = 0; ok && i < counts[2]; i++)
+        ok = ReadFloats(f, light + i * 3, 3) && ReadInts(f, &lightsamples[i], 1);
+
+    if (ok && key == FaceKey(facenum, reach) && counts[2] == CountFacePatches(facenum)) {
+        fl             = &facelight[facenum];
+        fl->numsamples = counts[0];
+        fl->origins    = origins;
+        fl->numstyles  = counts[1];
+        for (s = 0; s < counts[1]; s++) {
+            fl->stylenums[s] = stylenums[s];
+            fl->samples[s]   = samples[s];
+        }
+        for (i = 0, patch = face_patches[facenum]; patch; i++, patch = patch->next) {
+            VectorCopy((light + i * 3), patch->samplelight);
+            patch->samples = lightsamples[i];
+        }
+        facereach[facenum] = compressed;
+        *reused            = true;
+    } else {
+        free(compressed);
+        free(origins);
+        for (s = 0; s < counts[1]; s++)
+            free(samples[s]);
+    }
+
+    free(light);
+    free(lightsamples);
+    return ok;
+}
+
+/*
+=============
+LoadRadCache
+
+Call after CreateDirectLights.  Marks the faces the cache filled in so
+BuildFacelights leaves them be.  Anything wrong with the file just
+means those faces are lit again.
+=============
+*/
+void LoadRadCache(void) {
+    radcacheheader_t header;
+    directlight_t *dl;
+    byte *reach;
+    int32_t i, len, c_reused;
+    FILE *f;
+    qboolean reused;
+
+    if (!visdatasize) {
+        printf("no vis data, no rad cache\n");
+        return;
+    }
+
+    clusterbytes = (dvis->numclusters + 7) >> 3;
+    clusterkey   = malloc(dvis->numclusters * sizeof(uint64_t));
+    for (i = 0; i < dvis->numclusters; i++) {
+        clusterkey[i] = HashValue(HASH64_START, i);
+        for (dl = directlights[i]; dl; dl = dl->next)
+            clusterkey[i] = LightKey(clusterkey[i], dl);
+    }
+
+    facereach  = malloc(numfaces * sizeof(byte *));
+    facecached = malloc(numfaces);
+    memset(facereach, 0, numfaces * sizeof(byte *));
+    memset(facecached, 0, numfaces);
+
+    f = fopen(radcachefile, "rb");
+    if (!f) {
+        printf("no rad cache %s, lighting every face\n", radcachefile);
+        return;
+    }
+
+    if (fread(&header, sizeof(header), 1, f) != 1 || LittleLong(header.ident) != RADCACHEHEADER) {
+        printf("WARNING: %s is not a rad cache, lighting every face\n", radcachefile);
+        fclose(f);
+        return;
+    }
+    if (LittleLong(header.numfaces) != numfaces || LittleLong(header.numclusters) != dvis->numclusters ||
+        header.worldkey != WorldKey()) {
+        printf("rad cache: geometry, entities or options changed, lighting every face\n");
+        fclose(f);
+        return;
+    }
+
+    reach    = malloc(clusterbytes);
+    c_reused = 0;
+    for (i = 0; i < numfaces; i++) {
+        if (!ReadInts(f, &len, 1))
+            break;
+        if (len == -1)
+            continue;
+        if (!ReuseFace(f, i, len, reach, &reused))
+            break;
+        if (reused) {
+            facecached[i] = true;
+            c_reused++;
+        }
+    }
+    fclose(f);
+    free(reach);
+
+    if (i < numfaces)
+        printf("WARNING: %s is truncated, lighting the rest\n", radcachefile);
+    printf("rad cache: reusing %i of %i faces\n", c_reused, numfaces);
+}
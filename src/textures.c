@@ -198,7 +198,8 @@ int32_t ApplyTexinfoOffset_UV(int32_t texinfoindex, const brush_texture_t *bt, c
         if (TexinfosMatch(*tc, tx))
             return texinfoindex;
 
-    *tc = tx;
+    ReserveLump(texinfo, numtexinfo + 1);
+    texinfo[texinfoindex] = tx;
     numtexinfo++;
     CheckTexinfoCount();
 
@@ -207,9 +208,10 @@ int32_t ApplyTexinfoOffset_UV(int32_t texinfoindex, const brush_texture_t *bt, c
     if (textureref[mt].animname[0]) {
         brush_texture_t anim = *bt;
         strcpy(anim.name, textureref[mt].animname);
-        tc->nexttexinfo = ApplyTexinfoOffset_UV(tc->nexttexinfo, &anim, origin);
+        const int32_t next = ApplyTexinfoOffset_UV(texinfo[texinfoindex].nexttexinfo, &anim, origin);
+        texinfo[texinfoindex].nexttexinfo = next;
     } else {
-        tc->nexttexinfo = -1;
+        texinfo[texinfoindex].nexttexinfo = -1;
     }
 
     // Return new texinfo index.
@@ -246,7 +248,8 @@ int32_t TexinfoForBrushTexture_UV(brush_texture_t *bt, vec_t *UVaxis) {
         if (TexinfosMatch(*tc, tx))
             return texinfoindex;
 
-    *tc = tx;
+    ReserveLump(texinfo, numtexinfo + 1);
+    texinfo[texinfoindex] = tx;
     numtexinfo++;
     CheckTexinfoCount(); // mxd
 
@@ -255,9 +258,10 @@ int32_t TexinfoForBrushTexture_UV(brush_texture_t *bt, vec_t *UVaxis) {
     if (textureref[mt].animname[0]) {
         brush_texture_t anim = *bt;
         strcpy(anim.name, textureref[mt].animname);
-        tc->nexttexinfo = TexinfoForBrushTexture_UV(&anim, UVaxis);
+        const int32_t next = TexinfoForBrushTexture_UV(&anim, UVaxis);
+        texinfo[texinfoindex].nexttexinfo = next;
     } else
-        tc->nexttexinfo = -1;
+        texinfo[texinfoindex].nexttexinfo = -1;
 
     return texinfoindex;
 }
@@ -364,7 +368,8 @@ int32_t TexinfoForBrushTexture(plane_t *plane, brush_texture_t *bt, vec3_t origi
         if (TexinfosMatch(*tc, tx))
             return texinfoindex;
 
-    *tc = tx;
+    ReserveLump(texinfo, numtexinfo + 1);
+    texinfo[texinfoindex] = tx;
     numtexinfo++;
     CheckTexinfoCount(); // mxd
 
@@ -373,9 +378,10 @@ int32_t TexinfoForBrushTexture(plane_t *plane, brush_texture_t *bt, vec3_t origi
     if (textureref[mt].animname[0]) {
         brush_texture_t anim = *bt;
         strcpy(anim.name, textureref[mt].animname);
-        tc->nexttexinfo = TexinfoForBrushTexture(plane, &anim, origin);
+        const int32_t next = TexinfoForBrushTexture(plane, &anim, origin);
+        texinfo[texinfoindex].nexttexinfo = next;
     } else
-        tc->nexttexinfo = -1;
+        texinfo[texinfoindex].nexttexinfo = -1;
 
     return texinfoindex;
 }
@@ -21,8 +21,6 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "cmdlib.h"
 #include "threads.h"
 
-#define MAX_THREADS 64
-
 int32_t dispatch;
 int32_t workcount;
 int32_t oldf;
@@ -30,6 +28,12 @@ qboolean pacifier;
 
 qboolean threaded;
 
+static THREADLOCAL int32_t currentthread;
+
+int32_t ThreadNum(void) {
+    return currentthread;
+}
+
 /*
 =============
 GetThreadWork
@@ -86,6 +90,8 @@ void RunThreadsOnIndividual(int32_t workcnt, qboolean showpacifier, void (*func)
 
 #ifdef USE_PTHREADS
 
+static void (*threadfunc)(int32_t);
+
 #ifdef _WIN32
 
 #define USED
@@ -128,6 +134,12 @@ void ThreadUnlock(void) {
     LeaveCriticalSection(&crit);
 }
 
+static DWORD WINAPI ThreadEntry(LPVOID arg) {
+    currentthread = (int32_t)(intptr_t)arg;
+    threadfunc(currentthread);
+    return 0;
+}
+
 /*
 =============
 RunThreadsOn
@@ -154,12 +166,15 @@ void RunThreadsOn(int32_t workcnt, qboolean showpacifier, void (*func)(int32_t))
     if (numthreads == 1) { // use same thread
         func(0);
     } else {
+        if (numthreads > MAX_THREADS)
+            Error("numthreads %i > MAX_THREADS %i", numthreads, MAX_THREADS);
+        threadfunc = func;
         for (i = 0; i < numthreads; i++) {
             threadhandle[i] = CreateThread(
-                NULL,                         // LPSECURITY_ATTRIBUTES lpsa,
-                0,                            // DWORD cbStack,
-                (LPTHREAD_START_ROUTINE)func, // LPTHREAD_START_ROUTINE lpStartAddr,
-                (LPVOID)i,                    // LPVOID lpvThreadParm,
+                NULL,                 // LPSECURITY_ATTRIBUTES lpsa,
+                0,                    // DWORD cbStack,
+                ThreadEntry,          // LPTHREAD_START_ROUTINE lpStartAddr,
+                (LPVOID)(intptr_t)i,  // LPVOID lpvThreadParm,
                 0,                            //   DWORD fdwCreate,
                 &threadid[i]);
         }
@@ -190,6 +205,13 @@ void ThreadSetDefault(void) {
 #include <pthread.h>
 
 pthread_mutex_t *my_mutex;
+static int32_t threadnums[MAX_THREADS];
+
+static void *ThreadEntry(void *arg) {
+    currentthread = *(int32_t *)arg;
+    threadfunc(currentthread);
+    return NULL;
+}
 
 void ThreadLock(void) {
     if (my_mutex)
@@ -237,8 +259,12 @@ void RunThreadsOn(int32_t workcnt, qboolean showpacifier, void (*func)(int32_t))
     if (pthread_attr_setstacksize(&attrib, 0x1000000) == -1)
         Error("pthread_attr_setstacksize failed");
 
+    if (numthreads > MAX_THREADS)
+        Error("numthreads %i > MAX_THREADS %i", numthreads, MAX_THREADS);
+    threadfunc = func;
     for (i = 0; i < numthreads; i++) {
-        if (pthread_create(&work_threads[i], &attrib, (void *)func, &i) == -1)
+        threadnums[i] = i;
+        if (pthread_create(&work_threads[i], &attrib, ThreadEntry, &threadnums[i]) == -1)
             Error("pthread_create failed");
     }
 
@@ -303,3 +329,29 @@ void RunThreadsOn(int32_t workcnt, qboolean showpacifier, void (*func)(int32_t))
 }
 
 #endif
+
+/*
+=============
+ThreadSleep
+
+Gives up the cpu for a while, to wait on something outside of the
+thread lock
+=============
+*/
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+void ThreadSleep(int32_t msec) {
+#ifdef _WIN32
+    Sleep(msec);
+#else
+    struct timespec ts;
+
+    ts.tv_sec  = msec / 1000;
+    ts.tv_nsec = (long)(msec % 1000) * 1000000;
+    nanosleep(&ts, NULL);
+#endif
+}
@@ -18,6 +18,14 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 ===========================================================================
 */
 
+#define MAX_THREADS 64
+
+#ifdef _MSC_VER
+#define THREADLOCAL __declspec(thread)
+#else
+#define THREADLOCAL _Thread_local
+#endif
+
 extern int32_t numthreads;
 
 void ThreadSetDefault(void);
@@ -26,3 +34,5 @@ void RunThreadsOnIndividual(int32_t workcnt, qboolean showpacifier, void (*func)
 void RunThreadsOn(int32_t workcnt, qboolean showpacifier, void (*func)(int32_t));
 void ThreadLock(void);
 void ThreadUnlock(void);
+int32_t ThreadNum(void); // 0 to numthreads - 1, 0 outside of RunThreadsOn
+void ThreadSleep(int32_t msec);
@@ -94,7 +94,7 @@ void FreeTree_r(node_t *node) {
 
     if (numthreads == 1)
         c_nodes--;
-    free(node);
+    FreeBlock(node);
 }
 
 /*
@@ -28,7 +28,9 @@ int32_t numportals;
 int32_t portalclusters;
 
 portal_t *portals;
+portalhot_t *portalhot;
 leaf_t *leafs;
+int32_t *leafportals;
 
 int32_t c_portaltest, c_portalpass, c_portalcheck;
 
@@ -44,6 +46,10 @@ int32_t portalbytes, portallongs;
 
 qboolean fastvis;
 qboolean nosort;
+qboolean bitbench;
+double vistime;
+int32_t vischains;
+char *bitkernelname; // NULL for the best the cpu has
 
 int32_t totalvis;
 
@@ -85,14 +91,13 @@ winding_t *NewWinding(int32_t points) {
 }
 
 void prl(leaf_t *l) {
-    int32_t i;
-    portal_t *p;
+    int32_t i, pnum;
     plane_t pl;
 
     for (i = 0; i < l->numportals; i++) {
-        p  = l->portals[i];
-        pl = p->plane;
-        printf("portal %4i to leaf %4i : %7.1f : (%4.1f, %4.1f, %4.1f)\n", (int32_t)(p - portals), p->leaf, pl.dist, pl.normal[0], pl.normal[1], pl.normal[2]);
+        pnum = leafportals[l->firstportal + i];
+        pl   = portalhot[pnum].plane;
+        printf("portal %4i to leaf %4i : %7.1f : (%4.1f, %4.1f, %4.1f)\n", pnum, portalhot[pnum].leaf, pl.dist, pl.normal[0], pl.normal[1], pl.normal[2]);
     }
 }
 
@@ -119,9 +124,11 @@ void SortPortals(void) {
     for (i = 0; i < numportals * 2; i++)
         sorted_portals[i] = &portals[i];
 
-    if (nosort)
-        return;
-    qsort(sorted_portals, numportals * 2, sizeof(sorted_portals[0]), PComp);
+    if (!nosort)
+        qsort(sorted_portals, numportals * 2, sizeof(sorted_portals[0]), PComp);
+
+    for (i = 0; i < numportals * 2; i++)
+        sorted_portals[i]->sortrank = i;
 }
 
 /*
@@ -130,16 +137,15 @@ LeafVectorFromPortalVector
 ==============
 */
 int32_t LeafVectorFromPortalVector(byte *portalbits, byte *leafbits) {
-    int32_t i;
-    portal_t *p;
+    int32_t i, leaf;
     int32_t c_leafs;
 
     memset(leafbits, 0, leafbytes);
 
     for (i = 0; i < numportals * 2; i++) {
         if (portalbits[i >> 3] & (1 << (i & 7))) {
-            p = portals + i;
-            leafbits[p->leaf >> 3] |= (1 << (p->leaf & 7));
+            leaf = portalhot[i].leaf;
+            leafbits[leaf >> 3] |= (1 << (leaf & 7));
         }
     }
 
@@ -148,6 +154,104 @@ int32_t LeafVectorFromPortalVector(byte *portalbits, byte *leafbits) {
     return c_leafs;
 }
 
+/*
+===============================================================================
+
+The threads compress rows into buffers of their own, WriteRows copies
+them into the vismap in cluster order once they are all done, so the
+visdata comes out the same however the clusters were handed out.
+
+===============================================================================
+*/
+
+typedef struct
+{
+    byte *data;
+    int32_t size, maxsize;
+} rowbuffer_t;
+
+static rowbuffer_t rowbuffers[MAX_THREADS];
+static int32_t *rowthread, *rowofs, *rowlen, *rowcount; // [portalclusters]
+
+void AllocRows(void) {
+    rowthread = malloc(portalclusters * sizeof(int32_t));
+    rowofs    = malloc(portalclusters * sizeof(int32_t));
+    rowlen    = malloc(portalclusters * sizeof(int32_t));
+    rowcount  = malloc(portalclusters * sizeof(int32_t));
+}
+
+void FreeRows(void) {
+    int32_t i;
+
+    for (i = 0; i < MAX_THREADS; i++) {
+        free(rowbuffers[i].data);
+        memset(&rowbuffers[i], 0, sizeof(rowbuffers[i]));
+    }
+    free(rowthread);
+    free(rowofs);
+    free(rowlen);
+    free(rowcount);
+}
+
+/*
+===============
+StoreRow
+
+Keeps the compressed row of a cluster and its bit count until WriteRows
+===============
+*/
+void StoreRow(int32_t cluster, byte *compressed, int32_t len, int32_t count) {
+    rowbuffer_t *rb;
+
+    rb = &rowbuffers[ThreadNum()];
+    if (rb->size + len > rb->maxsize) {
+        rb->maxsize = rb->maxsize ? rb->maxsize * 2 : 0x10000;
+        if (rb->maxsize < rb->size + len)
+            rb->maxsize = rb->size + len;
+        rb->data = realloc(rb->data, rb->maxsize);
+        if (!rb->data)
+            Error("StoreRow: out of memory");
+    }
+
+    memcpy(rb->data + rb->size, compressed, len);
+    rowthread[cluster] = ThreadNum();
+    rowofs[cluster]    = rb->size;
+    rowlen[cluster]    = len;
+    rowcount[cluster]  = count;
+    rb->size += len;
+}
+
+/*
+===============
+WriteRows
+
+Appends the stored rows to the vismap as DVIS_PVS or DVIS_PHS,
+returns the total of their bit counts
+===============
+*/
+int32_t WriteRows(int32_t kind) {
+    int32_t i, total;
+    byte *dest;
+
+    total = 0;
+    for (i = 0; i < portalclusters; i++) {
+        dest = vismap_p;
+        vismap_p += rowlen[i];
+
+        if (vismap_p > vismap_end)
+            Error("Vismap expansion overflow. Exceeds extended limit");
+
+        dvis->bitofs[i][kind] = dest - vismap;
+        memcpy(dest, rowbuffers[rowthread[i]].data + rowofs[i], rowlen[i]);
+        total += rowcount[i];
+    }
+
+    for (i = 0; i < MAX_THREADS; i++)
+        rowbuffers[i].size = 0;
+
+    return total;
+}
+
 /*
 ===============
 ClusterMerge
@@ -160,9 +264,8 @@ void ClusterMerge(int32_t leafnum) {
     byte portalvector[MAX_PORTALS_QBSP / 8];
     byte uncompressed[MAX_MAP_LEAFS_QBSP / 8];
     byte compressed[MAX_MAP_LEAFS_QBSP / 8];
-    int32_t i, j;
+    int32_t i;
     int32_t numvis;
-    byte *dest;
     portal_t *p;
     int32_t pnum;
 
@@ -172,12 +275,11 @@ void ClusterMerge(int32_t leafnum) {
     leaf = &leafs[leafnum];
 
     for (i = 0; i < leaf->numportals; i++) {
-        p = leaf->portals[i];
+        pnum = leafportals[leaf->firstportal + i];
+        p    = &portals[pnum];
         if (p->status != stat_done)
             Error("portal not done");
-        for (j = 0; j < portallongs; j++)
-            ((long *)portalvector)[j] |= ((long *)p->portalvis)[j];
-        pnum = p - portals;
+        OrBits(portalvector, p->portalvis, portalbytes);
         portalvector[pnum >> 3] |= 1 << (pnum & 7);
     }
 
@@ -197,18 +299,38 @@ void ClusterMerge(int32_t leafnum) {
     // compress the bit string
     //
     qprintf("cluster %4i : %4i visible\n", leafnum, numvis);
-    totalvis += numvis;
 
-    i    = CompressVis(uncompressed, compressed);
+    i = CompressVis(uncompressed, compressed);
+    StoreRow(leafnum, compressed, i, numvis);
+}
 
-    dest = vismap_p;
-    vismap_p += i;
+/*
+==================
+ReportOverBudget
 
-    if (vismap_p > vismap_end)
-        Error("Vismap expansion overflow. Exceeds extended limit");
+Lists the portals that ran out of -vistime or -vischains, the
+places a hint brush would help
+==================
+*/
+void ReportOverBudget(void) {
+    int32_t i, count;
+    portal_t *p;
+    portalhot_t *ph;
 
-    dvis->bitofs[leafnum][DVIS_PVS] = dest - vismap;
-    memcpy(dest, compressed, i);
+    count = 0;
+    for (i = 0, p = portals; i < numportals * 2; i++, p++) {
+        if (!p->overbudget)
+            continue;
+        if (!count)
+            printf("portals over the vis budget, using their flood:\n");
+        count++;
+        ph = &portalhot[i];
+        printf("  portal %5i: cluster %4i to %4i at (%.0f %.0f %.0f), %i chains, %i mightsee\n", i,
+               portalhot[i ^ 1].leaf, ph->leaf, ph->origin[0], ph->origin[1], ph->origin[2], p->overbudget, p->nummightsee);
+    }
+
+    if (count)
+        printf("%i of %i portals over the vis budget\n", count, numportals * 2);
 }
 
 /*
@@ -221,6 +343,8 @@ void CalcPortalVis(void) {
 
     // fastvis just uses mightsee for a very loose bound
     if (fastvis) {
+        if (visshard || vismerge)
+            Error("-visshard and -vismerge are for the full vis, not -fast");
         for (i = 0; i < numportals * 2; i++) {
             portals[i].portalvis = portals[i].portalflood;
             portals[i].status    = stat_done;
@@ -228,7 +352,145 @@ void CalcPortalVis(void) {
         return;
     }
 
+    if (incremental)
+        LoadVisCache();
+
+    if (visshard) {
+        BeginShard();
+        BeginVisProfile();
+        RunThreadsOnIndividual(numportals * 2, true, PortalFlow);
+        FreeFlowStacks();
+        EndShard();
+        WriteVisProfile();
+        ReportOverBudget();
+        return;
+    }
+
+    if (vismerge)
+        MergeShards();
+    BeginCheckpoints();
+    BeginVisProfile();
     RunThreadsOnIndividual(numportals * 2, true, PortalFlow);
+    FreeFlowStacks();
+    EndCheckpoints();
+    WriteVisProfile();
+
+    if (incremental)
+        SaveVisCache();
+
+    ReportOverBudget();
+}
+
+/*
+==================
+BenchBitKernels
+
+Times each bit kernel the cpu has on the portalflood strings of the
+map, and the separating plane search on each portal against the
+portals of the leaf it leads into, and checks each kernel gets the
+same answers as the plain c one
+==================
+*/
+static int32_t BenchSeparators(int32_t *edges, uint32_t *hash) {
+    soawinding_t source, pass;
+    vec_t planes[MAX_SOA_POINTS][4];
+    uint32_t bits[4];
+    int32_t i, j, e, n, count;
+    winding_t *w;
+    leaf_t *leaf;
+
+    count = 0;
+    for (i = 0; i < numportals * 2; i++) {
+        w = portals[i].winding;
+        SoAWinding(w->points, w->numpoints, &source);
+        leaf = &leafs[portalhot[i].leaf];
+        for (j = 0; j < leaf->numportals; j++) {
+            w = portals[leafportals[leaf->firstportal + j]].winding;
+            SoAWinding(w->points, w->numpoints, &pass);
+            for (e = 0; e < source.numpoints; e++, (*edges)++) {
+                n = EdgeSeparators(&source, &pass, e, ON_EPSILON, false, planes);
+                count += n;
+                while (n--) {
+                    memcpy(bits, planes[n], sizeof(bits));
+                    *hash = (((*hash * 31 + bits[0]) * 31 + bits[1]) * 31 + bits[2]) * 31 + bits[3];
+                }
+            }
+        }
+    }
+
+    return count;
+}
+
+void BenchBitKernels(void) {
+    bitkernel_t *list[8], *keep;
+    int32_t i, k, n, pass, passes, count;
+    int32_t c_more, c_bits, c_or, c_planes, edges;
+    int32_t r_more = 0, r_bits = 0, r_or = 0, r_planes = 0;
+    uint32_t c_hash, r_hash = 0;
+    byte *dest, *acc;
+    clock_t start;
+    double t_and, t_or, t_count, t_sep;
+
+    n      = numportals * 2;
+    dest   = malloc(portalbytes);
+    acc    = malloc(portalbytes);
+    keep   = bitkernel;
+    count  = SupportedBitKernels(list);
+
+    // about 64MB through each kernel
+    passes = (64 << 20) / ((int64_t)n * portalbytes);
+    if (passes < 1)
+        passes = 1;
+
+    printf("bit kernels on %i strings of %i bytes, %i passes, separators on the portals of each leaf:\n", n,
+           portalbytes, passes);
+    for (k = 0; k < count; k++) {
+        bitkernel = list[k];
+        c_more = c_bits = 0;
+        memset(acc, 0, portalbytes);
+
+        start = clock();
+        for (pass = 0; pass < passes; pass++)
+            for (i = 0; i < n; i++)
+                c_more += AndBits(dest, portals[i].portalflood, portals[(i + 1) % n].portalflood,
+                                  portals[(i + 7) % n].portalflood, portalbytes);
+        t_and = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+        start = clock();
+        for (pass = 0; pass < passes; pass++)
+            for (i = 0; i < n; i++)
+                OrBits(acc, portals[i].portalflood, portalbytes);
+        t_or  = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+        start = clock();
+        for (pass = 0; pass < passes; pass++)
+            for (i = 0; i < n; i++)
+                c_bits += CountBits(portals[i].portalflood, n);
+        t_count = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+        c_hash = edges = 0;
+        start  = clock();
+        c_planes = BenchSeparators(&edges, &c_hash);
+        t_sep    = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+        c_or     = CountBits(acc, n);
+        if (!k) {
+            r_more   = c_more;
+            r_bits   = c_bits;
+            r_or     = c_or;
+            r_planes = c_planes;
+            r_hash   = c_hash;
+        } else if (c_more != r_more || c_bits != r_bits || c_or != r_or || c_planes != r_planes || c_hash != r_hash)
+            Error("bit kernel %s disagrees with %s", list[k]->name, list[0]->name);
+
+        printf("%8s: and %7.1f  or %7.1f  count %7.1f  ns per string, separators %7.1f ns per edge\n",
+               list[k]->name, t_and * 1e9 / ((double)passes * n), t_or * 1e9 / ((double)passes * n),
+               t_count * 1e9 / ((double)passes * n), t_sep * 1e9 / (edges ? edges : 1));
+    }
+
+    bitkernel = keep;
+    free(dest);
+    free(acc);
 }
 
 /*
@@ -237,32 +499,38 @@ CalcVis
 ==================
 */
 void CalcVis(void) {
-    int32_t i;
-
+    BuildPortalSphereTree();
     RunThreadsOnIndividual(numportals * 2, true, BasePortalVis);
+    FreePortalSphereTree();
 
     //	RunThreadsOnIndividual (numportals*2, true, BetterPortalVis);
 
     SortPortals();
 
+    if (bitbench)
+        BenchBitKernels();
+
     CalcPortalVis();
 
+    // -vismerge does the rest once all the shards are there
+    if (visshard)
+        return;
+
     //
     // assemble the leaf vis lists by oring and compressing the portal lists
     //
-    for (i = 0; i < portalclusters; i++)
-        ClusterMerge(i);
+    AllocRows();
+    RunThreadsOnIndividual(portalclusters, false, ClusterMerge);
+    totalvis = WriteRows(DVIS_PVS);
 
     printf("Average clusters visible: %i\n", totalvis / portalclusters);
 }
 
-void SetPortalSphere(portal_t *p) {
+void SetPortalSphere(portalhot_t *p, winding_t *w) {
     int32_t i;
     vec3_t total, dist;
-    winding_t *w;
     float r, bestr;
 
-    w = p->winding;
     VectorCopy(vec3_origin, total);
     for (i = 0; i < w->numpoints; i++) {
         VectorAdd(total, w->points[i], total);
@@ -284,32 +552,13 @@ void SetPortalSphere(portal_t *p) {
 
 /*
 ============
-LoadPortals
+AllocPortals
+
+Sizes the portal, leaf and vis buffers once the header has been read
 ============
 */
-void LoadPortals(char *name) {
-    int32_t i, j;
-    portal_t *p;
-    leaf_t *l;
-    char magic[80];
-    FILE *f;
-    int32_t numpoints;
-    winding_t *w;
-    int32_t leafnums[2];
-    plane_t plane;
-
-    if (!strcmp(name, "-"))
-        f = stdin;
-    else {
-        f = fopen(name, "r");
-        if (!f)
-            Error("LoadPortals: couldn't read %s\n", name);
-    }
-
-    if (fscanf(f, "%79s\n%i\n%i\n", magic, &portalclusters, &numportals) != 3)
-        Error("LoadPortals: failed to read header");
-    if (strcmp(magic, PORTALFILE))
-        Error("LoadPortals: not a portal file");
+void AllocPortals(void) {
+    int64_t visbound;
 
     printf("%4i portalclusters\n", portalclusters);
     printf("%4i numportals\n", numportals);
@@ -324,30 +573,122 @@ void LoadPortals(char *name) {
     // each file portal is split into two memory portals
     portals     = malloc(2 * numportals * sizeof(portal_t));
     memset(portals, 0, 2 * numportals * sizeof(portal_t));
+    portalhot = malloc(2 * numportals * sizeof(portalhot_t));
+    memset(portalhot, 0, 2 * numportals * sizeof(portalhot_t));
 
     leafs = malloc(portalclusters * sizeof(leaf_t));
     memset(leafs, 0, portalclusters * sizeof(leaf_t));
+    leafportals = malloc(2 * numportals * sizeof(int32_t));
 
     originalvismapsize = portalclusters * leafbytes;
     uncompressedvis    = malloc(originalvismapsize);
 
+    // the threads write compressed rows straight into dvisdata, so reserve
+    // the worst case once: the offsets plus a pvs and phs row per cluster,
+    // each at most twice its uncompressed size
+    visbound = (int64_t)sizeof(int32_t) + portalclusters * 8 + portalclusters * 4 * (int64_t)leafbytes;
+    if (visbound > MAX_MAP_VISIBILITY_QBSP)
+        visbound = MAX_MAP_VISIBILITY_QBSP;
+    ReserveVisData((int32_t)visbound);
+
     vismap = vismap_p = dvisdata;
     dvis->numclusters = portalclusters;
     vismap_p          = (byte *)&dvis->bitofs[portalclusters];
 
-    vismap_end        = vismap + MAX_MAP_VISIBILITY_QBSP;
+    vismap_end        = vismap + visbound;
+}
+
+/*
+============
+SetupPortal
+
+Turns file portal i into a forward and a backward memory portal
+============
+*/
+void SetupPortal(int32_t i, winding_t *w, int32_t leafnums[2]) {
+    int32_t j;
+    portal_t *p;
+    portalhot_t *ph;
+    plane_t plane;
+
+    // calc plane
+    PlaneFromWinding(w, &plane);
+
+    // create forward portal, it goes out of leafnums[0]
+    p          = &portals[i * 2];
+    ph         = &portalhot[i * 2];
+    leafs[leafnums[0]].numportals++;
+
+    p->winding = w;
+    VectorSubtract(vec3_origin, plane.normal, ph->plane.normal);
+    ph->plane.dist = -plane.dist;
+    ph->leaf       = leafnums[1];
+    SetPortalSphere(ph, p->winding);
+    p++;
+    ph++;
+
+    // create backwards portal
+    leafs[leafnums[1]].numportals++;
+
+    p->winding            = NewWinding(w->numpoints);
+    p->winding->numpoints = w->numpoints;
+    for (j = 0; j < w->numpoints; j++) {
+        VectorCopy(w->points[w->numpoints - 1 - j], p->winding->points[j]);
+    }
+
+    ph->plane = plane;
+    ph->leaf  = leafnums[0];
+    SetPortalSphere(ph, p->winding);
+}
+
+/*
+============
+LinkLeafPortals
+
+Fills in leafportals once SetupPortal has counted the portals of
+each leaf.  A leaf's portals stay in portal order.
+============
+*/
+void LinkLeafPortals(void) {
+    int32_t i, first;
+    leaf_t *l;
+
+    first = 0;
+    for (i = 0, l = leafs; i < portalclusters; i++, l++) {
+        l->firstportal = first;
+        first += l->numportals;
+        l->numportals = 0;
+    }
 
-    for (i = 0, p = portals; i < numportals; i++) {
+    // the leaf a portal goes out of is the one its other side looks into
+    for (i = 0; i < numportals * 2; i++) {
+        l = &leafs[portalhot[i ^ 1].leaf];
+        leafportals[l->firstportal + l->numportals++] = i;
+    }
+}
+
+/*
+============
+LoadTextPortals
+============
+*/
+void LoadTextPortals(FILE *f) {
+    int32_t i, j;
+    int32_t numpoints;
+    winding_t *w;
+    int32_t leafnums[2];
+
+    for (i = 0; i < numportals; i++) {
         if (fscanf(f, "%i %i %i ", &numpoints, &leafnums[0], &leafnums[1]) != 3)
             Error("LoadPortals: reading portal %i", i);
         if (numpoints > MAX_POINTS_ON_WINDING)
             Error("LoadPortals: portal %i has too many points", i);
-        if ((unsigned)leafnums[0] > portalclusters || (unsigned)leafnums[1] > portalclusters)
+        if ((unsigned)leafnums[0] >= portalclusters || (unsigned)leafnums[1] >= portalclusters)
             Error("LoadPortals: reading portal %i", i);
 
-        w = p->winding = NewWinding(numpoints);
-        w->original    = true;
-        w->numpoints   = numpoints;
+        w            = NewWinding(numpoints);
+        w->original  = true;
+        w->numpoints = numpoints;
 
         for (j = 0; j < numpoints; j++) {
             double v[3];
@@ -362,104 +703,222 @@ void LoadPortals(char *name) {
         }
         fscanf(f, "\n");
 
-        // calc plane
-        PlaneFromWinding(w, &plane);
-
-        // create forward portal
-        l = &leafs[leafnums[0]];
-        if (l->numportals == MAX_PORTALS_ON_LEAF)
-            Error("Leaf with too many portals");
-        l->portals[l->numportals] = p;
-        l->numportals++;
-
-        p->winding = w;
-        VectorSubtract(vec3_origin, plane.normal, p->plane.normal);
-        p->plane.dist = -plane.dist;
-        p->leaf       = leafnums[1];
-        SetPortalSphere(p);
-        p++;
-
-        // create backwards portal
-        l = &leafs[leafnums[1]];
-        if (l->numportals == MAX_PORTALS_ON_LEAF)
-            Error("Leaf with too many portals");
-        l->portals[l->numportals] = p;
-        l->numportals++;
-
-        p->winding            = NewWinding(w->numpoints);
-        p->winding->numpoints = w->numpoints;
-        for (j = 0; j < w->numpoints; j++) {
-            VectorCopy(w->points[w->numpoints - 1 - j], p->winding->points[j]);
-        }
+        SetupPortal(i, w, leafnums);
+    }
+}
 
-        p->plane = plane;
-        p->leaf  = leafnums[0];
-        SetPortalSphere(p);
-        p++;
+/*
+============
+LoadPortalData
+
+Sets up the portals from PRT1-BIN data, either read from a file
+or handed over by bsp
+============
+*/
+void LoadPortalData(portaldata_t *prt) {
+    int32_t i, j, k;
+    int32_t numpoints, numfilepoints;
+    winding_t *w;
+    int32_t leafnums[2];
+    int32_t *info;
+    float *points;
+
+    info          = prt->info;
+    points        = prt->points;
+    numfilepoints = prt->numpoints;
+
+    for (i = 0; i < numportals; i++) {
+        numpoints   = LittleLong(info[i * 3 + 0]);
+        leafnums[0] = LittleLong(info[i * 3 + 1]);
+        leafnums[1] = LittleLong(info[i * 3 + 2]);
+        if (numpoints < 3 || numpoints > MAX_POINTS_ON_WINDING)
+            Error("LoadPortals: portal %i has a bad point count", i);
+        if ((unsigned)leafnums[0] >= portalclusters || (unsigned)leafnums[1] >= portalclusters)
+            Error("LoadPortals: reading portal %i", i);
+        if (numpoints > numfilepoints)
+            Error("LoadPortals: reading portal %i", i);
+        numfilepoints -= numpoints;
+
+        w            = NewWinding(numpoints);
+        w->original  = true;
+        w->numpoints = numpoints;
+
+        for (j = 0; j < numpoints; j++)
+            for (k = 0; k < 3; k++)
+                w->points[j][k] = LittleFloat(*points++);
+
+        SetupPortal(i, w, leafnums);
     }
+}
+
+/*
+============
+LoadBinaryPortals
+
+The portal triples and points of a PRT1-BIN file are read in one go
+============
+*/
+void LoadBinaryPortals(FILE *f, int32_t numfilepoints) {
+    portaldata_t prt;
+    size_t size;
+
+    if (numfilepoints < 0)
+        Error("LoadPortals: bad point count");
+
+    size = (size_t)numportals * 3 * sizeof(int32_t) + (size_t)numfilepoints * 3 * sizeof(float);
+    memset(&prt, 0, sizeof(prt));
+    prt.numportals = numportals;
+    prt.numpoints  = numfilepoints;
+    prt.info       = malloc(size);
+    if (!prt.info)
+        Error("LoadPortals: out of memory");
+    if (fread(prt.info, 1, size, f) != size)
+        Error("LoadPortals: file is truncated");
+    prt.points = (float *)(prt.info + numportals * 3);
+
+    LoadPortalData(&prt);
+
+    free(prt.info);
+}
+
+/*
+============
+LoadStagePortals
+
+Uses the portals bsp left in memory
+============
+*/
+void LoadStagePortals(void) {
+    portalclusters = stageportals.numclusters;
+    numportals     = stageportals.numportals;
+
+    AllocPortals();
+    LoadPortalData(&stageportals);
+    FreePortalData(&stageportals);
+    LinkLeafPortals();
+}
+
+/*
+============
+LoadPortals
+
+Reads either the text PRT1 file or the binary PRT1-BIN one
+============
+*/
+void LoadPortals(char *name) {
+    char magic[80];
+    FILE *f;
+    int32_t header[3];
+    qboolean binary;
+
+    if (!strcmp(name, "-"))
+        f = stdin;
+    else {
+        f = fopen(name, "rb");
+        if (!f)
+            Error("LoadPortals: couldn't read %s\n", name);
+    }
+
+    if (!fgets(magic, sizeof(magic), f))
+        Error("LoadPortals: failed to read header");
+    magic[strcspn(magic, " \t\r\n")] = 0;
+
+    binary = !strcmp(magic, PORTALFILEBIN);
+    if (binary) {
+        if (fread(header, sizeof(header), 1, f) != 1)
+            Error("LoadPortals: failed to read header");
+        portalclusters = LittleLong(header[0]);
+        numportals     = LittleLong(header[1]);
+    } else {
+        if (strcmp(magic, PORTALFILE))
+            Error("LoadPortals: not a portal file");
+        if (fscanf(f, "%i\n%i\n", &portalclusters, &numportals) != 2)
+            Error("LoadPortals: failed to read header");
+    }
+
+    AllocPortals();
+
+    if (binary)
+        LoadBinaryPortals(f, LittleLong(header[2]));
+    else
+        LoadTextPortals(f);
 
     fclose(f);
+    LinkLeafPortals();
 }
 
+#define PHS_BLOCK 16
+
 /*
 ================
-CalcPHS
+ClusterPHS
 
-Calculate the PHS (Potentially Hearable Set)
-by ORing together all the PVS visible from a leaf
+The PHS rows of PHS_BLOCK clusters, each the OR of the PVS rows of
+every cluster in its PVS.  A PVS row is read once for all the rows
+of the block that need it, while it is still in the cache.
 ================
 */
-void CalcPHS(void) {
-    int32_t i, j, k, l, index;
-    int32_t bitbyte;
-    long *dest, *src;
-    byte *scan;
-    int32_t count;
-    byte uncompressed[MAX_MAP_LEAFS_QBSP / 8];
+void ClusterPHS(int32_t block) {
+    int32_t i, j, k, index;
+    int32_t first, numrows, len;
+    byte *pvs, *rows, *src;
+    byte seen[MAX_MAP_LEAFS_QBSP / 8]; // any row of the block sees it
     byte compressed[MAX_MAP_LEAFS_QBSP / 8];
 
-    printf("Building PHS...\n");
-
-    count = 0;
-    for (i = 0; i < portalclusters; i++) {
-        scan = uncompressedvis + i * leafbytes;
-        memcpy(uncompressed, scan, leafbytes);
-        for (j = 0; j < leafbytes; j++) {
-            bitbyte = scan[j];
-            if (!bitbyte)
+    first   = block * PHS_BLOCK;
+    numrows = portalclusters - first < PHS_BLOCK ? portalclusters - first : PHS_BLOCK;
+    pvs     = uncompressedvis + (size_t)first * leafbytes;
+    rows    = malloc((size_t)numrows * leafbytes);
+    memcpy(rows, pvs, (size_t)numrows * leafbytes);
+
+    memset(seen, 0, leafbytes);
+    for (i = 0; i < numrows; i++)
+        OrBits(seen, pvs + (size_t)i * leafbytes, leafbytes);
+
+    for (j = 0; j < leafbytes; j++) {
+        if (!seen[j])
+            continue;
+        for (k = 0; k < 8; k++) {
+            if (!(seen[j] & (1 << k)))
                 continue;
-            for (k = 0; k < 8; k++) {
-                if (!(bitbyte & (1 << k)))
-                    continue;
-                // OR this pvs row into the phs
-                index = ((j << 3) + k);
-                if (index >= portalclusters)
-                    Error("Bad bit in PVS"); // pad bits should be 0
-                src  = (long *)(uncompressedvis + index * leafbytes);
-                dest = (long *)uncompressed;
-                for (l = 0; l < leaflongs; l++)
-                    ((long *)uncompressed)[l] |= src[l];
-            }
+            // OR this pvs row into the phs of each row that sees it
+            index = ((j << 3) + k);
+            if (index >= portalclusters)
+                Error("Bad bit in PVS"); // pad bits should be 0
+            src = uncompressedvis + (size_t)index * leafbytes;
+            for (i = 0; i < numrows; i++)
+                if (pvs[(size_t)i * leafbytes + j] & (1 << k))
+                    OrBits(rows + (size_t)i * leafbytes, src, leafbytes);
         }
-        for (j = 0; j < portalclusters; j++)
-            if (uncompressed[j >> 3] & (1 << (j & 7)))
-                count++;
+    }
 
-        //
-        // compress the bit string
-        //
-        j    = CompressVis(uncompressed, compressed);
+    //
+    // compress the bit strings
+    //
+    for (i = 0; i < numrows; i++) {
+        len = CompressVis(rows + (size_t)i * leafbytes, compressed);
+        StoreRow(first + i, compressed, len, CountBits(rows + (size_t)i * leafbytes, portalclusters));
+    }
 
-        dest = (long *)vismap_p;
-        vismap_p += j;
+    free(rows);
+}
 
-        if (vismap_p > vismap_end)
-            Error("Vismap expansion overflow. Exceeds extended limit");
+/*
+================
+CalcPHS
+
+Calculate the PHS (Potentially Hearable Set)
+by ORing together all the PVS visible from a leaf
+================
+*/
+void CalcPHS(void) {
+    int32_t count;
 
-        dvis->bitofs[i][DVIS_PHS] = (byte *)dest - vismap;
+    printf("Building PHS...\n");
 
-        memcpy(dest, compressed, j);
-    }
+    RunThreadsOnIndividual((portalclusters + PHS_BLOCK - 1) / PHS_BLOCK, false, ClusterPHS);
+    count = WriteRows(DVIS_PHS);
+    FreeRows();
 
     printf("Average clusters hearable: %i\n", count / portalclusters);
 }
@@ -480,8 +939,7 @@ void VIS_ProcessArgument(const char * arg) {
     DefaultExtension(source, ".bsp");
 
     sprintf(name, "%s%s", inbase, source);
-    printf("reading %s\n", name);
-    LoadBSPFile(name);
+    LoadStageBSPFile(name);
     if (numnodes == 0 || numfaces == 0)
         Error("Empty map");
 
@@ -489,11 +947,42 @@ void VIS_ProcessArgument(const char * arg) {
     StripExtension(portalfile);
     strcat(portalfile, ".prt");
 
-    printf("reading %s\n", portalfile);
-    LoadPortals(portalfile);
+    sprintf(checkpointfile, "%s%s", outbase, source);
+    StripExtension(checkpointfile);
+    strcat(checkpointfile, ".vck");
+
+    sprintf(shardbase, "%s%s", outbase, source);
+    StripExtension(shardbase);
+
+    if (visprofile) {
+        sprintf(visprofilefile, "%s%s", outbase, source);
+        StripExtension(visprofilefile);
+        strcat(visprofilefile, ".vis.");
+        strcat(visprofilefile, visprofile);
+    }
+
+    sprintf(viscachefile, "%s%s", outbase, source);
+    StripExtension(viscachefile);
+    strcat(viscachefile, ".vic");
+
+    if (bsp_frommemory && stageportals.info) {
+        printf("using %s from memory\n", portalfile);
+        LoadStagePortals();
+    } else {
+        printf("reading %s\n", portalfile);
+        LoadPortals(portalfile);
+    }
+
+    SelectBitKernel(bitkernelname);
+    qprintf("bit kernel: %s\n", bitkernel->name);
 
     CalcVis();
 
+    if (visshard) {
+        printf("<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<< END vis >>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>\n\n");
+        return;
+    }
+
     CalcPHS();
 
     visdatasize = vismap_p - dvisdata;
@@ -504,7 +993,7 @@ void VIS_ProcessArgument(const char * arg) {
         printf("\nWARNING: visdatasize exceeds default limit of %i\n\n", DEFAULT_MAP_VISIBILITY);
 
     sprintf(name, "%s%s", outbase, source);
-    WriteBSPFile(name);
+    WriteStageBSPFile(name);
 
     PrintBSPFileSizes();
 
@@ -21,12 +21,14 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "cmdlib.h"
 #include "mathlib.h"
 #include "bspfile.h"
+#include "bitlib.h"
 
 //#define	MAX_PORTALS	32767
 
 #define MAX_PORTALS_QBSP MAX_MAP_PORTALS_QBSP / 2 // qb: half
 
 #define PORTALFILE       "PRT1"
+#define PORTALFILEBIN    "PRT1-BIN"
 
 #define ON_EPSILON       0.1
 
@@ -50,14 +52,18 @@ winding_t *CopyWinding(winding_t *w);
 typedef enum { stat_none,
                stat_working,
                stat_done } vstatus_t;
+// what the flow looks at for every portal it walks past, kept apart
+// from the windings and bit strings so it packs into one cache line
 typedef struct
 {
     plane_t plane; // normal pointing into neighbor
-    int32_t leaf;  // neighbor
-
     vec3_t origin; // for fast clip testing
     float radius;
+    int32_t leaf; // neighbor
+} portalhot_t;
 
+typedef struct
+{
     winding_t *winding;
     vstatus_t status;
     byte *portalfront; // [portals], preliminary
@@ -65,28 +71,29 @@ typedef struct
     byte *portalvis;   // [portals], final
 
     int32_t nummightsee; // bit count on portalflood for sort
+    int32_t overbudget;  // chains when the flow gave up, portalvis is the flood
+    int32_t sortrank;    // place in sorted_portals
+    qboolean cached;     // portalvis is from the -incremental cache
 } portal_t;
 
-typedef struct seperating_plane_s {
-    struct seperating_plane_s *next;
-    plane_t plane; // from portal is on positive side
-} sep_t;
-
-typedef struct passage_s {
-    struct passage_s *next;
-    int32_t from, to; // leaf numbers
-    sep_t *planes;
-} passage_t;
-
-#define MAX_PORTALS_ON_LEAF 1024 //qb: was 128
+// the portals out of a leaf are leafportals[firstportal] on
 typedef struct leaf_s {
+    int32_t firstportal;
     int32_t numportals;
-    passage_t *passages;
-    portal_t *portals[MAX_PORTALS_ON_LEAF];
 } leaf_t;
 
+// separators kept for a source and pass pair, more than this are found every time
+#define MAX_SEPARATORS 64
+
 typedef struct pstack_s {
-    byte mightsee[MAX_PORTALS_QBSP / 8]; // bit string
+    byte *mightsee; // bit string, portalbytes long
+    int32_t depth;  // 0 for the head, which uses the portal's flood
+
+    // the separators of the previous frame's source and pass, [1] for flipclip.
+    // -1 until they are found, -2 if there are too many to keep
+    plane_t *separators[2];
+    int32_t numseparators[2];
+
     struct pstack_s *next;
     leaf_t *leaf;
     portal_t *portal; // portal exiting
@@ -99,10 +106,22 @@ typedef struct pstack_s {
     plane_t portalplane;
 } pstack_t;
 
+// the mightsee strings and separators of all the frames of one thread,
+// one after the other
+typedef struct
+{
+    byte *bits;
+    plane_t *separators; // 2 * MAX_SEPARATORS a frame
+    int32_t depth;       // frames there is room for
+} flowstack_t;
+
 typedef struct
 {
     portal_t *base;
     int32_t c_chains;
+    double starttime;
+    qboolean overbudget; // -vistime or -vischains ran out, unwinding
+    flowstack_t *flowstack;
     pstack_t pstack_head;
 } threaddata_t;
 
@@ -110,7 +129,9 @@ extern int32_t numportals;
 extern int32_t portalclusters;
 
 extern portal_t *portals;
+extern portalhot_t *portalhot; // [numportals * 2], same order as portals
 extern leaf_t *leafs;
+extern int32_t *leafportals; // [numportals * 2] portal numbers, by leaf
 
 extern int32_t c_portaltest, c_portalpass, c_portalcheck;
 extern int32_t c_portalskip, c_leafskip;
@@ -124,12 +145,55 @@ extern byte *uncompressed;
 extern int32_t leafbytes, leaflongs;
 extern int32_t portalbytes, portallongs;
 
+extern double vistime;    // seconds PortalFlow gets for one portal, 0 for no limit
+extern int32_t vischains; // same for RecursiveLeafFlow calls
+
 void LeafFlow(int32_t leafnum);
 
+void BuildPortalSphereTree(void);
+void FreePortalSphereTree(void);
 void BasePortalVis(int32_t portalnum);
 void BetterPortalVis(int32_t portalnum);
 void PortalFlow(int32_t portalnum);
+void FreeFlowStacks(void);
+
+// checkpoint.c
+extern int32_t checkpointtime;
+extern qboolean resume;
+extern char checkpointfile[1060];
+
+void BeginCheckpoints(void);
+void CheckpointPortal(portal_t *p);
+void EndCheckpoints(void);
+
+extern qboolean visshard;
+extern int32_t shardnum, numshards;
+extern qboolean vismerge;
+extern qboolean keeporder;
+extern char shardbase[1060];
+
+void BeginShard(void);
+void PublishPortal(portal_t *p);
+void ShardHeartbeat(void);
+qboolean PortalFromShards(portal_t *p);
+void EndShard(void);
+void MergeShards(void);
+
+// viscache.c
+extern qboolean incremental;
+extern char viscachefile[1060];
+
+void LoadVisCache(void);
+void SaveVisCache(void);
+
+// visprofile.c
+extern char *visprofile;
+extern char visprofilefile[1060];
+
+void BeginVisProfile(void);
+void ProfilePortal(portal_t *p, double seconds, int32_t chains, int32_t mightsee, int32_t cansee);
+void WriteVisProfile(void);
 
 extern portal_t *sorted_portals[MAX_MAP_PORTALS_QBSP * 2];
 
-int32_t CountBits(byte *bits, int32_t numbits);
+void BenchBitKernels(void);
@@ -0,0 +1,418 @@
+/*
+===========================================================================
+Copyright (C) 1997-2006 Id Software, Inc.
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+===========================================================================
+*/
+
+#include "vis.h"
+
+/*
+==============================================================================
+
+INCREMENTAL VIS CACHE
+
+With -incremental, a full vis saves every portal's fingerprint,
+portalflood and portalvis to name.vic.  The next -incremental vis of
+the map looks its portals up by fingerprint, and a portal whose flood
+is made of the same portals as last time gets its old portalvis back
+instead of going through PortalFlow.
+
+Portal and cluster numbers change from one bsp to the next, so a
+fingerprint is made from the winding alone, mixed with the windings
+of the portals of the leafs on both sides.
+
+header
+for each memory portal: fingerprint, flood and vis lengths, flood, vis
+The bit strings are run length coded like the vis data.  A portal
+that went over -vistime or -vischains has no vis.
+==============================================================================
+*/
+
+#define VISCACHEHEADER (('1' << 24) + ('C' << 16) + ('I' << 8) + 'V') // little-endian "VIC1"
+
+// past this much of the map changed, the cache is dropped and it's a full vis
+#define MAX_CACHE_CHANGE 0.5
+
+typedef struct
+{
+    int32_t ident;
+    int32_t numportals; // memory portals
+    int32_t portalbytes;
+} viscacheheader_t;
+
+typedef struct
+{
+    uint64_t fingerprint;
+    int32_t portalnum;
+} cacheentry_t;
+
+qboolean incremental;
+char viscachefile[1060];
+
+/*
+=============
+CompressBits
+
+CompressVis for a string of any length
+=============
+*/
+static int32_t CompressBits(const byte *bits, int32_t bytes, byte *dest) {
+    int32_t j, rep;
+    byte *dest_p;
+
+    dest_p = dest;
+    for (j = 0; j < bytes; j++) {
+        *dest_p++ = bits[j];
+        if (bits[j])
+            continue;
+
+        rep = 1;
+        for (j++; j < bytes; j++)
+            if (bits[j] || rep == 255)
+                break;
+            else
+                rep++;
+        *dest_p++ = rep;
+        j--;
+    }
+
+    return dest_p - dest;
+}
+
+/*
+=============
+DecompressBits
+
+False if the data runs past len or the string
+=============
+*/
+static qboolean DecompressBits(const byte *in, int32_t len, byte *bits, int32_t bytes) {
+    const byte *end;
+    int32_t c, out;
+
+    end = in + len;
+    out = 0;
+    while (out < bytes) {
+        if (in >= end)
+            return false;
+        if (*in) {
+            bits[out++] = *in++;
+            continue;
+        }
+
+        if (in + 1 >= end || !in[1] || out + in[1] > bytes)
+            return false;
+        for (c = in[1]; c; c--)
+            bits[out++] = 0;
+        in += 2;
+    }
+
+    return in == end;
+}
+
+/*
+=============
+WindingHash
+
+fnv-1a of the points, as the floats they were in the portal file
+=============
+*/
+static uint64_t WindingHash(winding_t *w) {
+    uint64_t h;
+    float f;
+    int32_t i, j;
+
+    h = HASH64_START;
+    for (i = 0; i < w->numpoints; i++) {
+        for (j = 0; j < 3; j++) {
+            f = LittleFloat((float)w->points[i][j]);
+            h = Hash64(h, &f, sizeof(f));
+        }
+    }
+
+    return h;
+}
+
+/*
+=============
+PortalFingerprints
+
+The winding of each portal, the windings out of the leaf it's in and
+the windings out of the leaf it looks into.  The leaf sums don't care
+about portal order.
+=============
+*/
+static uint64_t *PortalFingerprints(void) {
+    uint64_t *wind, *leafsum, *fp;
+    int32_t i, j;
+    leaf_t *l;
+
+    wind = malloc(numportals * 2 * sizeof(uint64_t));
+    for (i = 0; i < numportals * 2; i++)
+        wind[i] = WindingHash(portals[i].winding);
+
+    leafsum = malloc(portalclusters * sizeof(uint64_t));
+    for (i = 0, l = leafs; i < portalclusters; i++, l++) {
+        leafsum[i] = 0;
+        for (j = 0; j < l->numportals; j++)
+            leafsum[i] += Mix64(wind[leafportals[l->firstportal + j]]);
+    }
+
+    // the leaf a portal is in is the one its other side looks into
+    fp = malloc(numportals * 2 * sizeof(uint64_t));
+    for (i = 0; i < numportals * 2; i++)
+        fp[i] = Mix64(wind[i] ^ Mix64(leafsum[portalhot[i].leaf] + 1) ^ Mix64(leafsum[portalhot[i ^ 1].leaf] + 2));
+
+    free(wind);
+    free(leafsum);
+    return fp;
+}
+
+static int32_t EntryComp(const void *a, const void *b) {
+    const cacheentry_t *ea = a, *eb = b;
+
+    if (ea->fingerprint != eb->fingerprint)
+        return ea->fingerprint < eb->fingerprint ? -1 : 1;
+    return ea->portalnum - eb->portalnum;
+}
+
+/*
+=============
+SaveVisCache
+=============
+*/
+void SaveVisCache(void) {
+    viscacheheader_t header;
+    uint64_t *fp;
+    byte *compressed;
+    int32_t i, len[2];
+    FILE *f;
+    qboolean ok;
+
+    f = fopen(viscachefile, "wb");
+    if (!f) {
+        printf("WARNING: couldn't write %s\n", viscachefile);
+        return;
+    }
+
+    header.ident       = LittleLong(VISCACHEHEADER);
+    header.numportals  = LittleLong(numportals * 2);
+    header.portalbytes = LittleLong(portalbytes);
+    ok                 = fwrite(&header, sizeof(header), 1, f) == 1;
+
+    fp         = PortalFingerprints();
+    compressed = malloc(portalbytes * 2 * 2); // worst case doubles, for flood and vis
+    for (i = 0; ok && i < numportals * 2; i++) {
+        len[0] = CompressBits(portals[i].portalflood, portalbytes, compressed);
+        len[1] = CompressBits(portals[i].portalvis, portalbytes, compressed + len[0]);
+        if (portals[i].overbudget)
+            len[1] = 0; // only the flood, a run without the budget has to redo it
+        ok     = fwrite(&fp[i], sizeof(fp[i]), 1, f) == 1;
+        len[0] = LittleLong(len[0]);
+        len[1] = LittleLong(len[1]);
+        ok     = ok && fwrite(len, sizeof(len), 1, f) == 1;
+        ok     = ok && fwrite(compressed, LittleLong(len[0]) + LittleLong(len[1]), 1, f) == 1;
+    }
+    if (fclose(f))
+        ok = false;
+
+    if (!ok) {
+        printf("WARNING: couldn't write %s\n", viscachefile);
+        remove(viscachefile);
+    }
+
+    free(fp);
+    free(compressed);
+}
+
+/*
+=============
+ReusePortal
+
+Maps the old portalvis of p over if p's flood is the same set of portals
+as the old one's.  oldbits[0] and [1] are for the old flood and vis.
+=============
+*/
+static qboolean ReusePortal(portal_t *p, byte **olddata, int32_t oldportals, int32_t oldbytes, int32_t *oldof,
+                            int32_t *newnum, byte **oldbits) {
+    int32_t i, k, count;
+
+    for (i = 0; i < 2; i++)
+        if (!DecompressBits(olddata[i] + sizeof(int32_t), *(int32_t *)olddata[i], oldbits[i], oldbytes))
+            return false;
+
+    count = 0;
+    for (i = 0; i < numportals * 2; i++) {
+        if (!(p->portalflood[i >> 3] & (1 << (i & 7))))
+            continue;
+        k = oldof[i];
+        if (k < 0 || !(oldbits[0][k >> 3] & (1 << (k & 7))))
+            return false; // something new in the flood
+        count++;
+    }
+    if (count != CountBits(oldbits[0], oldportals))
+        return false; // something gone from the flood
+
+    memset(p->portalvis, 0, portalbytes);
+    for (i = 0; i < oldportals; i++) {
+        if (!(oldbits[1][i >> 3] & (1 << (i & 7))))
+            continue;
+        k = newnum[i];
+        if (k < 0) {
+            memset(p->portalvis, 0, portalbytes);
+            return false;
+        }
+        p->portalvis[k >> 3] |= 1 << (k & 7);
+    }
+
+    return true;
+}
+
+/*
+=============
+LoadVisCache
+
+Marks the portals the cache has a good portalvis for as done.
+Anything wrong with the file just means a full vis.
+=============
+*/
+void LoadVisCache(void) {
+    viscacheheader_t header;
+    FILE *f;
+    int32_t i, j, lo, hi, mid, oldnum;
+    int32_t oldportals, oldbytes, len[2], c_reused;
+    int32_t *newnum, *oldof;
+    cacheentry_t *entries;
+    uint64_t *fp;
+    byte **data, *oldbits[2];
+    qboolean ok;
+
+    f = fopen(viscachefile, "rb");
+    if (!f) {
+        printf("no vis cache %s, full vis\n", viscachefile);
+        return;
+    }
+
+    if (fread(&header, sizeof(header), 1, f) != 1 || LittleLong(header.ident) != VISCACHEHEADER ||
+        LittleLong(header.numportals) <= 0 || LittleLong(header.numportals) > MAX_MAP_PORTALS_QBSP * 2) {
+        printf("WARNING: %s is not a vis cache, full vis\n", viscachefile);
+        fclose(f);
+        return;
+    }
+    oldportals = LittleLong(header.numportals);
+    oldbytes   = LittleLong(header.portalbytes);
+
+    // read the whole thing before touching the portals,
+    // each string is kept with its length in front
+    entries    = malloc(oldportals * sizeof(cacheentry_t));
+    data       = malloc(oldportals * 2 * sizeof(byte *));
+    memset(data, 0, oldportals * 2 * sizeof(byte *));
+    ok = oldbytes == ((oldportals + 63) & ~63) >> 3;
+    for (i = 0; ok && i < oldportals; i++) {
+        ok = fread(&entries[i].fingerprint, sizeof(uint64_t), 1, f) == 1 && fread(len, sizeof(len), 1, f) == 1;
+        entries[i].portalnum = i;
+        for (j = 0; ok && j < 2; j++) {
+            len[j] = LittleLong(len[j]);
+            ok     = len[j] >= 0 && len[j] <= oldbytes * 2;
+            if (ok) {
+                data[i * 2 + j] = malloc(sizeof(int32_t) + len[j]);
+                memcpy(data[i * 2 + j], &len[j], sizeof(int32_t));
+                ok = !len[j] || fread(data[i * 2 + j] + sizeof(int32_t), len[j], 1, f) == 1;
+            }
+        }
+    }
+    fclose(f);
+
+    newnum     = malloc(oldportals * sizeof(int32_t));
+    oldof      = malloc(numportals * 2 * sizeof(int32_t));
+    oldbits[0] = malloc(oldbytes);
+    oldbits[1] = malloc(oldbytes);
+    fp         = PortalFingerprints();
+    c_reused   = 0;
+    if (!ok) {
+        printf("WARNING: %s is truncated, full vis\n", viscachefile);
+        goto done;
+    }
+
+    //
+    // match the new portals up with the old ones, leaving out
+    // any fingerprint that more than one portal has
+    //
+    qsort(entries, oldportals, sizeof(cacheentry_t), EntryComp);
+    for (i = 0; i < oldportals; i++)
+        newnum[i] = -1;
+    for (i = 0; i < numportals * 2; i++) {
+        oldof[i] = -1;
+
+        lo       = 0;
+        hi       = oldportals;
+        while (lo < hi) {
+            mid = (lo + hi) / 2;
+            if (entries[mid].fingerprint < fp[i])
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        if (lo == oldportals || entries[lo].fingerprint != fp[i])
+            continue; // new or changed
+        if (lo + 1 < oldportals && entries[lo + 1].fingerprint == fp[i])
+            continue;
+
+        oldnum = entries[lo].portalnum;
+        if (newnum[oldnum] >= 0)
+            oldof[newnum[oldnum]] = -1;
+        if (newnum[oldnum] != -1) {
+            newnum[oldnum] = -2;
+            continue;
+        }
+        newnum[oldnum] = i;
+        oldof[i]       = oldnum;
+    }
+
+    for (i = 0; i < numportals * 2; i++) {
+        if (oldof[i] < 0)
+            continue;
+        if (ReusePortal(&portals[i], data + oldof[i] * 2, oldportals, oldbytes, oldof, newnum, oldbits)) {
+            portals[i].status = stat_done;
+            portals[i].cached = true;
+            c_reused++;
+        }
+    }
+
+    if (c_reused < numportals * 2 * (1 - MAX_CACHE_CHANGE)) {
+        printf("vis cache: only %i of %i portals unchanged, full vis\n", c_reused, numportals * 2);
+        for (i = 0; i < numportals * 2; i++) {
+            if (portals[i].status != stat_done)
+                continue;
+            portals[i].status = stat_none;
+            portals[i].cached = false;
+            memset(portals[i].portalvis, 0, portalbytes);
+        }
+    } else
+        printf("vis cache: reusing %i of %i portals\n", c_reused, numportals * 2);
+
+done:
+    free(fp);
+    free(newnum);
+    free(oldof);
+    free(oldbits[0]);
+    free(oldbits[1]);
+    for (i = 0; i < oldportals * 2; i++)
+        free(data[i]);
+    free(data);
+    free(entries);
+}
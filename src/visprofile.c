@@ -0,0 +1,200 @@
+/*
+===========================================================================
+Copyright (C) 1997-2006 Id Software, Inc.
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+===========================================================================
+*/
+
+#include "vis.h"
+#include "threads.h"
+
+/*
+==============================================================================
+
+VIS PROFILE
+
+-visprofile csv or -visprofile json writes what PortalFlow spent on
+each portal to name.vis.csv or name.vis.json, with the clusters on
+both sides and where the portal is, so the places that make a full
+vis slow can be found and hinted.  chains is the same every run,
+seconds depends on the machine and on what the other threads are
+doing.
+
+A portal PortalFlow didn't run, from the -incremental cache, a
+-resume checkpoint or another -visshard shard, has thread -1.
+==============================================================================
+*/
+
+#define NUM_SLOWEST 10
+
+typedef struct
+{
+    double seconds;
+    int32_t chains;
+    int32_t mightsee;
+    int32_t cansee;
+    int32_t thread; // -1 if PortalFlow didn't run it
+} portalprofile_t;
+
+char *visprofile; // "csv" or "json", NULL for no profile
+char visprofilefile[1060];
+
+static portalprofile_t *portalprofile;
+
+/*
+=============
+BeginVisProfile
+
+Call before PortalFlow
+=============
+*/
+void BeginVisProfile(void) {
+    int32_t i;
+
+    if (!visprofile)
+        return;
+
+    portalprofile = malloc(numportals * 2 * sizeof(portalprofile_t));
+    memset(portalprofile, 0, numportals * 2 * sizeof(portalprofile_t));
+    for (i = 0; i < numportals * 2; i++)
+        portalprofile[i].thread = -1;
+}
+
+/*
+=============
+ProfilePortal
+
+PortalFlow is done with p.  Each portal has its own slot, no lock
+is needed.
+=============
+*/
+void ProfilePortal(portal_t *p, double seconds, int32_t chains, int32_t mightsee, int32_t cansee) {
+    portalprofile_t *pp;
+
+    if (!portalprofile)
+        return;
+
+    pp           = &portalprofile[p - portals];
+    pp->seconds  = seconds;
+    pp->chains   = chains;
+    pp->mightsee = mightsee;
+    pp->cansee   = cansee;
+    pp->thread   = ThreadNum();
+}
+
+static const char *PortalHow(int32_t pnum) {
+    if (portalprofile[pnum].thread < 0)
+        return portals[pnum].cached ? "cached" : "loaded";
+    return portals[pnum].overbudget ? "overbudget" : "flow";
+}
+
+static int32_t PSlower(const void *a, const void *b) {
+    double ta, tb;
+
+    ta = portalprofile[*(const int32_t *)a].seconds;
+    tb = portalprofile[*(const int32_t *)b].seconds;
+    if (ta > tb)
+        return -1;
+    if (ta < tb)
+        return 1;
+    return *(const int32_t *)a - *(const int32_t *)b;
+}
+
+/*
+=============
+WriteVisProfile
+
+Call once PortalFlow is done with every portal
+=============
+*/
+void WriteVisProfile(void) {
+    FILE *f;
+    int32_t i, pnum, *order;
+    double total;
+    int64_t chains;
+    portalprofile_t *pp;
+    portalhot_t *ph;
+
+    if (!portalprofile)
+        return;
+
+    // the ones PortalFlow didn't run still have their counts
+    total  = 0;
+    chains = 0;
+    for (i = 0, pp = portalprofile; i < numportals * 2; i++, pp++) {
+        if (pp->thread < 0) {
+            pp->mightsee = CountBits(portals[i].portalflood, numportals * 2);
+            pp->cansee   = CountBits(portals[i].portalvis, numportals * 2);
+        }
+        total += pp->seconds;
+        chains += pp->chains;
+    }
+
+    f = fopen(visprofilefile, "w");
+    if (!f)
+        Error("Error opening %s", visprofilefile);
+
+    if (!strcmp(visprofile, "json")) {
+        fprintf(f, "{\n  \"portals\": %i,\n  \"clusters\": %i,\n  \"chains\": %lld,\n  \"seconds\": %.6f,\n",
+                numportals * 2, portalclusters, (long long)chains, total);
+        fprintf(f, "  \"portal\": [\n");
+        for (i = 0, pp = portalprofile; i < numportals * 2; i++, pp++) {
+            ph = &portalhot[i];
+            fprintf(f,
+                    "    {\"portal\": %i, \"rank\": %i, \"from\": %i, \"to\": %i, \"origin\": [%.1f, %.1f, %.1f], "
+                    "\"radius\": %.1f, \"mightsee\": %i, \"cansee\": %i, \"chains\": %i, \"seconds\": %.6f, "
+                    "\"thread\": %i, \"how\": \"%s\"}%s\n",
+                    i, portals[i].sortrank, portalhot[i ^ 1].leaf, ph->leaf, ph->origin[0], ph->origin[1],
+                    ph->origin[2], ph->radius, pp->mightsee, pp->cansee, pp->chains, pp->seconds, pp->thread,
+                    PortalHow(i), i < numportals * 2 - 1 ? "," : "");
+        }
+        fprintf(f, "  ]\n}\n");
+    } else {
+        fprintf(f, "portal,rank,from,to,x,y,z,radius,mightsee,cansee,chains,seconds,thread,how\n");
+        for (i = 0, pp = portalprofile; i < numportals * 2; i++, pp++) {
+            ph = &portalhot[i];
+            fprintf(f, "%i,%i,%i,%i,%.1f,%.1f,%.1f,%.1f,%i,%i,%i,%.6f,%i,%s\n", i, portals[i].sortrank,
+                    portalhot[i ^ 1].leaf, ph->leaf, ph->origin[0], ph->origin[1], ph->origin[2], ph->radius,
+                    pp->mightsee, pp->cansee, pp->chains, pp->seconds, pp->thread, PortalHow(i));
+        }
+    }
+
+    if (fclose(f))
+        Error("Error writing %s", visprofilefile);
+    printf("wrote %s\n", visprofilefile);
+
+    // the worst ones, where a hint brush would help most
+    order = malloc(numportals * 2 * sizeof(int32_t));
+    for (i = 0; i < numportals * 2; i++)
+        order[i] = i;
+    qsort(order, numportals * 2, sizeof(order[0]), PSlower);
+
+    printf("slowest portals, %.2f seconds and %lld chains in all:\n", total, (long long)chains);
+    for (i = 0; i < NUM_SLOWEST && i < numportals * 2; i++) {
+        pnum = order[i];
+        pp   = &portalprofile[pnum];
+        if (pp->thread < 0)
+            break;
+        ph = &portalhot[pnum];
+        printf("  portal %5i: cluster %4i to %4i at (%.0f %.0f %.0f), %.3f s, %i chains, %i mightsee, %i cansee\n",
+               pnum, portalhot[pnum ^ 1].leaf, ph->leaf, ph->origin[0], ph->origin[1], ph->origin[2], pp->seconds,
+               pp->chains, pp->mightsee, pp->cansee);
+    }
+
+    free(order);
+    free(portalprofile);
+    portalprofile = NULL;
+}
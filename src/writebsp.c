@@ -45,6 +45,8 @@ void EmitPlanes(void) {
     dplane_t *dp;
     plane_t *mp;
 
+    ReserveLump(dplanes, numplanes + nummapplanes);
+
     mp = mapplanes;
     for (i = 0; i < nummapplanes; i++, mp++) {
         dp = &dplanes[numplanes];
@@ -83,6 +85,7 @@ void EmitMarkFace(dleaf_t *leaf_p, face_t *f) {
         if (numleaffaces >= MAX_MAP_LEAFFACES)
             Error("MAX_MAP_LEAFFACES");
 
+        ReserveLump(dleaffaces, numleaffaces + 1);
         dleaffaces[numleaffaces] = facenum;
         numleaffaces++;
     }
@@ -114,6 +117,7 @@ void EmitMarkFaceX(dleaf_tx *leaf_p, face_t *f) {
         if (numleaffaces >= MAX_MAP_LEAFFACES_QBSP)
             Error("MAX_MAP_LEAFFACES_QBSP");
 
+        ReserveLump(dleaffacesX, numleaffaces + 1);
         dleaffacesX[numleaffaces] = facenum;
         numleaffaces++;
     }
@@ -139,6 +143,7 @@ void EmitLeaf(node_t *node) {
         if (numleafs >= MAX_MAP_LEAFS_QBSP)
             Error("MAX_MAP_LEAFS_QBSP");
 
+        ReserveLump(dleafsX, numleafs + 1);
         leaf_p = &dleafsX[numleafs];
         numleafs++;
 
@@ -165,6 +170,7 @@ void EmitLeaf(node_t *node) {
                 if (dleafbrushesX[i] == brushnum)
                     break;
             if (i == numleafbrushes) {
+                ReserveLump(dleafbrushesX, numleafbrushes + 1);
                 dleafbrushesX[numleafbrushes] = brushnum;
                 numleafbrushes++;
             }
@@ -196,6 +202,7 @@ void EmitLeaf(node_t *node) {
         if (numleafs >= MAX_MAP_LEAFS)
             Error("MAX_MAP_LEAFS");
 
+        ReserveLump(dleafs, numleafs + 1);
         leaf_p = &dleafs[numleafs];
         numleafs++;
 
@@ -222,6 +229,7 @@ void EmitLeaf(node_t *node) {
                 if (dleafbrushes[i] == brushnum)
                     break;
             if (i == numleafbrushes) {
+                ReserveLump(dleafbrushes, numleafbrushes + 1);
                 dleafbrushes[numleafbrushes] = brushnum;
                 numleafbrushes++;
             }
@@ -274,6 +282,7 @@ void EmitFace(face_t *f) {
         dface_tx *df;
         if (numfaces >= MAX_MAP_FACES_QBSP)
             Error("numfaces == MAX_MAP_FACES_QBSP");
+        ReserveLump(dfacesX, numfaces + 1);
         df = &dfacesX[numfaces];
         numfaces++;
 
@@ -288,6 +297,7 @@ void EmitFace(face_t *f) {
             e = GetEdge(f->vertexnums[i], f->vertexnums[(i + 1) % f->numpoints], f);
             if (numsurfedges >= MAX_MAP_SURFEDGES_QBSP)
                 Error("numsurfedges == MAX_MAP_SURFEDGES_QBSP");
+            ReserveLump(dsurfedges, numsurfedges + 1);
             dsurfedges[numsurfedges] = e;
             numsurfedges++;
         }
@@ -295,6 +305,7 @@ void EmitFace(face_t *f) {
         dface_t *df;
         if (numfaces >= MAX_MAP_FACES)
             Error("numfaces == MAX_MAP_FACES");
+        ReserveLump(dfaces, numfaces + 1);
         df = &dfaces[numfaces];
         numfaces++;
 
@@ -309,6 +320,7 @@ void EmitFace(face_t *f) {
             e = GetEdge(f->vertexnums[i], f->vertexnums[(i + 1) % f->numpoints], f);
             if (numsurfedges >= MAX_MAP_SURFEDGES)
                 Error("numsurfedges == MAX_MAP_SURFEDGES");
+            ReserveLump(dsurfedges, numsurfedges + 1);
             dsurfedges[numsurfedges] = e;
             numsurfedges++;
         }
@@ -323,6 +335,7 @@ EmitDrawingNode_r
 int32_t EmitDrawNode_r(node_t *node) {
     face_t *f;
     int32_t i;
+    int32_t nodenum;
 
     if (node->planenum == PLANENUM_LEAF) {
         EmitLeaf(node);
@@ -334,7 +347,9 @@ int32_t EmitDrawNode_r(node_t *node) {
         dnode_tx *n;
         if (numnodes == MAX_MAP_NODES_QBSP)
             Error("MAX_MAP_NODES_QBSP");
-        n = &dnodesX[numnodes];
+        ReserveLump(dnodesX, numnodes + 1);
+        nodenum = numnodes;
+        n       = &dnodesX[nodenum];
         numnodes++;
 
         VectorCopy(node->mins, n->mins);
@@ -358,8 +373,9 @@ int32_t EmitDrawNode_r(node_t *node) {
 
         n->numfaces = numfaces - n->firstface;
 
-        // recursively output the other nodes
+        // recursively output the other nodes, which can move the node lump
         for (i = 0; i < 2; i++) {
+            n = &dnodesX[nodenum];
             if (node->children[i]->planenum == PLANENUM_LEAF) {
                 n->children[i] = -(numleafs + 1);
                 EmitLeaf(node->children[i]);
@@ -369,7 +385,7 @@ int32_t EmitDrawNode_r(node_t *node) {
             }
         }
 
-        return n - dnodesX;
+        return nodenum;
     }
 
     else // ibsp
@@ -377,7 +393,9 @@ int32_t EmitDrawNode_r(node_t *node) {
         dnode_t *n;
         if (numnodes == MAX_MAP_NODES)
             Error("MAX_MAP_NODES");
-        n = &dnodes[numnodes];
+        ReserveLump(dnodes, numnodes + 1);
+        nodenum = numnodes;
+        n       = &dnodes[nodenum];
         numnodes++;
 
         VectorCopy(node->mins, n->mins);
@@ -401,8 +419,9 @@ int32_t EmitDrawNode_r(node_t *node) {
 
         n->numfaces = numfaces - n->firstface;
 
-        // recursively output the other nodes
+        // recursively output the other nodes, which can move the node lump
         for (i = 0; i < 2; i++) {
+            n = &dnodes[nodenum];
             if (node->children[i]->planenum == PLANENUM_LEAF) {
                 n->children[i] = -(numleafs + 1);
                 EmitLeaf(node->children[i]);
@@ -412,7 +431,7 @@ int32_t EmitDrawNode_r(node_t *node) {
             }
         }
 
-        return n - dnodes;
+        return nodenum;
     }
 }
 
@@ -521,6 +540,7 @@ void EmitBrushes(void) {
 
     numbrushsides = 0;
     numbrushes    = nummapbrushes;
+    ReserveLump(dbrushes, numbrushes);
 
     for (bnum = 0; bnum < nummapbrushes; bnum++) {
         b             = &mapbrushes[bnum];
@@ -535,6 +555,7 @@ void EmitBrushes(void) {
             for (j = 0; j < b->numsides; j++) {
                 if (numbrushsides == MAX_MAP_BRUSHSIDES_QBSP)
                     Error("MAX_MAP_BRUSHSIDES_QBSP");
+                ReserveLump(dbrushsidesX, numbrushsides + 1);
                 cp = &dbrushsidesX[numbrushsides];
                 numbrushsides++;
                 cp->planenum = b->original_sides[j].planenum;
@@ -545,6 +566,7 @@ void EmitBrushes(void) {
                 dbrushside_t *cp;
                 if (numbrushsides == MAX_MAP_BRUSHSIDES)
                     Error("MAX_MAP_BRUSHSIDES");
+                ReserveLump(dbrushsides, numbrushsides + 1);
                 cp = &dbrushsides[numbrushsides];
                 numbrushsides++;
                 cp->planenum = b->original_sides[j].planenum;
@@ -570,12 +592,14 @@ void EmitBrushes(void) {
                     if (use_qbsp) {
                         if (numbrushsides >= MAX_MAP_BRUSHSIDES_QBSP)
                             Error("MAX_MAP_BRUSHSIDES_QBSP");
+                        ReserveLump(dbrushsidesX, numbrushsides + 1);
                         dbrushsidesX[numbrushsides].planenum = planenum;
                         dbrushsidesX[numbrushsides].texinfo  = dbrushsidesX[numbrushsides - 1].texinfo;
 
                     } else {
                         if (numbrushsides >= MAX_MAP_BRUSHSIDES)
                             Error("MAX_MAP_BRUSHSIDES");
+                        ReserveLump(dbrushsides, numbrushsides + 1);
                         dbrushsides[numbrushsides].planenum = planenum;
                         dbrushsides[numbrushsides].texinfo  = dbrushsides[numbrushsides - 1].texinfo;
                     }
@@ -613,6 +637,13 @@ void BeginBSPFile(void) {
 
     // leave leaf 0 as an error
     numleafs            = 1;
+    ReserveLump(dleafs, 1);
+    ReserveLump(dleafsX, 1);
+    ReserveLump(dvertexes, 1);
+    if (use_qbsp)
+        ReserveLump(dedgesX, 1);
+    else
+        ReserveLump(dedges, 1);
     dleafs[0].contents  = CONTENTS_SOLID;
     dleafsX[0].contents = CONTENTS_SOLID;
 }
@@ -637,9 +668,13 @@ void EndBSPFile(void) {
     free (buf);
 #endif
 
+    // a leaked map has no portals for vis to use, so write it out
+    if (!stageportals.info)
+        bsp_tomemory = false;
+
     // write the map
     sprintf(path, "%s.bsp", source);
-    WriteBSPFile(path);
+    WriteStageBSPFile(path);
 }
 
 /*
@@ -666,6 +701,7 @@ void BeginModel(void) {
     } else if (nummodels == MAX_MAP_MODELS)
         Error("nummodels exceeds MAX_MAP_MODELS");
 
+    ReserveLump(dmodels, nummodels + 1);
     mod            = &dmodels[nummodels];
 
     mod->firstface = numfaces;